@@ -0,0 +1,145 @@
+/** Measures the memory of scripted sessions
+ *
+ * Every session feeds its input to a fresh `Readline`. The allocations,
+ * the peak of live heap bytes, the bytes held at the end and the bytes
+ * held after hibernation, as reported by `Readline::memory_usage`, are
+ * compared to the thresholds of the session. Peak RSS of the whole run is checked as well. The thresholds
+ * have some headroom, raise them deliberately when the growth is expected.
+ */
+#include <malloc.h>
+#include <sys/resource.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <algorithm>
+#include "../src/readline.hh"
+
+static size_t allocations = 0;
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+
+static void *allocate(size_t size) {
+    void *p = std::malloc(size ? size : 1);
+
+    if (!p) {
+        throw std::bad_alloc{};
+    }
+
+    allocations++;
+    live_bytes += malloc_usable_size(p);
+    peak_bytes = std::max(peak_bytes, live_bytes);
+
+    return p;
+}
+
+static void deallocate(void *p) noexcept {
+    if (p) {
+        live_bytes -= malloc_usable_size(p);
+        std::free(p);
+    }
+}
+
+void *operator new(size_t size) { return allocate(size); }
+void *operator new[](size_t size) { return allocate(size); }
+void operator delete(void *p) noexcept { deallocate(p); }
+void operator delete[](void *p) noexcept { deallocate(p); }
+void operator delete(void *p, size_t) noexcept { deallocate(p); }
+void operator delete[](void *p, size_t) noexcept { deallocate(p); }
+
+static std::string repeat(const std::string &s, size_t n) {
+    std::string result;
+    result.reserve(s.size() * n);
+
+    while (n--) {
+        result += s;
+    }
+
+    return result;
+}
+
+struct Session {
+    const char *name;
+    std::string input;
+
+    /** Thresholds */
+    size_t max_allocations;
+    size_t max_peak_bytes;
+    size_t max_held_bytes;
+    size_t max_hibernated_bytes;
+};
+
+static std::vector<Session> sessions() {
+    const std::string line(64, 'x');
+    const std::string editing = "select name\0\x1b[D\x1b[D\x1bw from t\x19"
+                                "\x18\x15\x01\x12na\x12\x1b[C\x17\x19\n"s;
+
+    return {
+        {"idle", "ls\ncd /tmp\n", 140, 8000, 7000, 300},
+        {"typing", repeat(line + "\n", 2000), 10500, 230000, 216000, 84000},
+        {"editing", repeat(editing, 500), 2800, 88000, 84000, 14000},
+        {"history", repeat(line + "\n", 64) + repeat("\x1b[A", 64) + "\n" + repeat("\x1b[B", 64) + "\n", 720, 29000, 27000, 5600},
+        {"macro", "\x18(abc\x7f\x7f\x18)" + repeat("\x18" "e", 1000) + "\n", 160, 20000, 18000, 3000},
+        {"long-line", std::string(1 << 20, 'y') + "\n", 200, 5400000, 2750000, 2200000},
+    };
+}
+
+/** Peak RSS of the whole run */
+static constexpr size_t max_rss_kib = 16 << 10;
+
+int main() {
+    bool passed = true;
+
+    std::printf("%-10s %12s %12s %12s %12s   %s\n", "session", "allocations", "peak bytes", "held bytes",
+                "hibernated", "buffer/history/keys/input/output/editing");
+
+    for (auto &session: sessions()) {
+        std::istringstream input{session.input};
+        std::ostream output{nullptr};
+
+        const auto allocations_before = allocations;
+        const auto live_before = live_bytes;
+        peak_bytes = live_bytes;
+
+        Readline readline{};
+        readline.set_input_stream(input).set_output_stream(output).set_columns(80);
+
+        for (auto lines = std::count(session.input.begin(), session.input.end(), '\n'); lines--;) {
+            readline.read();
+        }
+
+        const auto usage = readline.memory_usage();
+        const auto session_allocations = allocations - allocations_before;
+        const auto session_peak = peak_bytes - live_before;
+
+        readline.hibernate();
+        const auto hibernated = readline.memory_usage().total();
+
+        std::printf("%-10s %12zu %12zu %12zu %12zu   %zu/%zu/%zu/%zu/%zu/%zu\n", session.name,
+                    session_allocations, session_peak, usage.total(), hibernated,
+                    usage.buffer, usage.history, usage.key_bindings, usage.input, usage.output, usage.editing);
+
+        auto check = [&](const char *what, size_t value, size_t threshold) {
+            if (value > threshold) {
+                std::printf("  %s: %zu over the threshold of %zu\n", what, value, threshold);
+                passed = false;
+            }
+        };
+
+        check("allocations", session_allocations, session.max_allocations);
+        check("peak bytes", session_peak, session.max_peak_bytes);
+        check("held bytes", usage.total(), session.max_held_bytes);
+        check("hibernated bytes", hibernated, session.max_hibernated_bytes);
+    }
+
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+
+    std::printf("peak RSS %ld KiB\n", usage.ru_maxrss);
+
+    if (static_cast<size_t>(usage.ru_maxrss) > max_rss_kib) {
+        std::printf("  peak RSS over the threshold of %zu KiB\n", max_rss_kib);
+        passed = false;
+    }
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,106 @@
+/** Measures how the session scheduler scales with threads
+ *
+ * Every session gets bursts of pasted text and typed lines, the same
+ * workload runs with one worker and then with more, up to the CPUs the
+ * process may run on. The speedup depends on the load of the host and on
+ * SMT siblings counted as CPUs, so it's only reported. With
+ * `READLINE_BENCH_SCALING` set and several CPUs, the throughput of the most
+ * threads has to be a reasonable multiple of one thread's.
+ */
+#include <sched.h>
+#include <cstdio>
+#include <cstdlib>
+#include "../src/scheduler.hh"
+
+static constexpr size_t sessions = 1000;
+static constexpr size_t rounds = 4;
+static constexpr size_t max_threads = 8;
+
+static std::string workload() {
+    std::string paste;
+
+    while (paste.size() < 2048) {
+        paste += "select name, value from settings where name like 'editor.%' ";
+    }
+
+    return paste + "\n" + "ls -la\x1b[D\x1b[D\x7f\n" + "\x1b[A\x01#\n";
+}
+
+/** Bytes of input processed per second */
+static double run(size_t threads, const std::string &input) {
+    std::vector<std::unique_ptr<std::ostream>> outputs;
+    std::vector<SessionScheduler::Session *> added;
+    size_t lines = 0;
+
+    SessionScheduler scheduler{threads};
+
+    for (size_t i = 0; i < sessions; i++) {
+        auto &output = *outputs.emplace_back(std::make_unique<std::ostream>(nullptr));
+        added.push_back(&scheduler.add([&](Readline &readline) {
+            readline.set_output_stream(output).set_columns(80).set_prompter([] { return "$ "; });
+        }));
+    }
+
+    std::vector<size_t> counts(sessions);
+    const auto begin = std::chrono::steady_clock::now();
+
+    for (size_t round = 0; round < rounds; round++) {
+        for (size_t i = 0; i < sessions; i++) {
+            scheduler.feed(*added[i], input, [&counts, i](std::string_view) { counts[i]++; });
+        }
+    }
+
+    scheduler.wait();
+
+    const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+    for (auto n: counts) {
+        lines += n;
+    }
+
+    if (lines != sessions * rounds * 3) {
+        std::printf("  %zu lines instead of %zu\n", lines, sessions * rounds * 3);
+        std::exit(EXIT_FAILURE);
+    }
+
+    return sessions * rounds * input.size() / seconds;
+}
+
+int main() {
+    cpu_set_t allowed;
+    const size_t cpus = sched_getaffinity(0, sizeof(allowed), &allowed) == 0 ? CPU_COUNT(&allowed) : 1;
+    const auto input = workload();
+
+    std::printf("%-8s %12s %10s\n", "threads", "MiB/s", "speedup");
+
+    const double single = run(1, input);
+    double last = single;
+    size_t most = 1;
+
+    std::printf("%-8d %12.1f %10.2f\n", 1, single / (1 << 20), 1.0);
+
+    for (size_t threads = 2; threads <= std::min(std::max<size_t>(cpus, 2), max_threads); threads *= 2) {
+        last = run(threads, input);
+        most = threads;
+        std::printf("%-8zu %12.1f %10.2f\n", threads, last / (1 << 20), last / single);
+    }
+
+    if (!std::getenv("READLINE_BENCH_SCALING")) {
+        return EXIT_SUCCESS;
+    }
+
+    if (cpus < 2) {
+        std::printf("a single CPU is available, the scaling isn't checked\n");
+        return EXIT_SUCCESS;
+    }
+
+    // half of the ideal speedup beyond the first thread
+    const double required = 1 + 0.5 * (std::min(most, cpus) - 1);
+
+    if (last / single < required) {
+        std::printf("  speedup %.2f with %zu threads under the threshold of %.2f\n", last / single, most, required);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
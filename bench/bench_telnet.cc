@@ -0,0 +1,164 @@
+/** Compares the epoll and io_uring backends of the telnet server
+ *
+ * The server runs in its own thread, the clients send a line on every
+ * connection and wait for all answers, round after round. CPU time and
+ * context switches of the server thread are measured, so the work of the
+ * clients isn't counted. A backend which isn't available is skipped. The
+ * threshold of CPU time per line is loose, it catches only gross
+ * regressions of either backend.
+ */
+#include <sys/resource.h>
+#include <atomic>
+#include <future>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+#include "../src/telnet.hh"
+
+static constexpr size_t sessions = 200;
+static constexpr size_t rounds = 50;
+
+/** Server CPU time per line */
+static constexpr double max_cpu_us_per_line = 500;
+
+struct Result {
+    bool available;
+    double seconds;
+    double cpu_seconds;
+    long context_switches;
+};
+
+static double cpu_seconds(const rusage &usage) {
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static int connect_to(uint16_t port) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (fd == -1 || connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)) == -1) {
+        throw std::system_error{errno, std::generic_category()};
+    }
+
+    return fd;
+}
+
+/** Read until the text arrives, the data up to it is dropped */
+static void receive_until(int fd, std::string &received, std::string_view text) {
+    char chunk[4096];
+
+    for (auto found = received.find(text); found == std::string::npos; found = received.find(text)) {
+        const auto n = recv(fd, chunk, sizeof(chunk), 0);
+
+        if (n <= 0) {
+            throw std::runtime_error{"connection closed"};
+        }
+
+        received.append(chunk, n);
+    }
+
+    received.erase(0, received.find(text) + text.size());
+}
+
+static Result run(TelnetServer::Backend backend) {
+    std::promise<std::pair<uint16_t, bool>> started;
+    std::atomic<bool> stop{false};
+    rusage server_usage{};
+
+    // the ring belongs to the thread which created it
+    std::thread server_thread([&] {
+        TelnetServer server{0, "127.0.0.1", backend};
+
+        server.set_session_setup([](Readline &readline) { readline.set_prompter([] { return "> "; }); })
+              .set_line_handler([](TelnetServer::Connection &, std::string_view) { return std::optional<std::string>{"ok\n"}; });
+
+        started.set_value({server.port(), server.backend() == backend});
+
+        rusage before{}, after{};
+        getrusage(RUSAGE_THREAD, &before);
+
+        while (!stop) {
+            server.poll(10);
+        }
+
+        getrusage(RUSAGE_THREAD, &after);
+
+        server_usage.ru_utime.tv_sec = after.ru_utime.tv_sec - before.ru_utime.tv_sec;
+        server_usage.ru_utime.tv_usec = after.ru_utime.tv_usec - before.ru_utime.tv_usec;
+        server_usage.ru_stime.tv_sec = after.ru_stime.tv_sec - before.ru_stime.tv_sec;
+        server_usage.ru_stime.tv_usec = after.ru_stime.tv_usec - before.ru_stime.tv_usec;
+        server_usage.ru_nvcsw = after.ru_nvcsw - before.ru_nvcsw + after.ru_nivcsw - before.ru_nivcsw;
+    });
+
+    const auto [port, available] = started.get_future().get();
+    Result result{available, 0, 0, 0};
+
+    if (available) {
+        std::vector<int> clients;
+        std::vector<std::string> received(sessions);
+
+        for (size_t i = 0; i < sessions; i++) {
+            clients.push_back(connect_to(port));
+            receive_until(clients.back(), received[i], "> ");
+        }
+
+        const std::string line{"hello world\r\n"};
+        const auto begin = std::chrono::steady_clock::now();
+
+        for (size_t round = 0; round < rounds; round++) {
+            for (int fd: clients) {
+                send(fd, line.data(), line.size(), MSG_NOSIGNAL);
+            }
+
+            for (size_t i = 0; i < sessions; i++) {
+                receive_until(clients[i], received[i], "ok\r\n");
+            }
+        }
+
+        result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        for (int fd: clients) {
+            close(fd);
+        }
+    }
+
+    stop = true;
+    server_thread.join();
+
+    result.cpu_seconds = cpu_seconds(server_usage);
+    result.context_switches = server_usage.ru_nvcsw;
+    return result;
+}
+
+int main() {
+    bool passed = true;
+    const double lines = sessions * rounds;
+
+    std::printf("%-10s %12s %14s %18s\n", "backend", "lines/s", "server cpu/line", "context switches");
+
+    for (auto [name, backend]: {std::pair{"epoll", TelnetServer::Backend::Epoll},
+                                std::pair{"io_uring", TelnetServer::Backend::IoUring}}) {
+        const auto result = run(backend);
+
+        if (!result.available) {
+            std::printf("%-10s not available\n", name);
+            continue;
+        }
+
+        const double cpu_us_per_line = result.cpu_seconds * 1e6 / lines;
+
+        std::printf("%-10s %12.0f %12.1f us %18ld\n", name, lines / result.seconds, cpu_us_per_line,
+                    result.context_switches);
+
+        if (cpu_us_per_line > max_cpu_us_per_line) {
+            std::printf("  server cpu time over the threshold of %.0f us per line\n", max_cpu_us_per_line);
+            passed = false;
+        }
+    }
+
+    return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+/** This class measures the cost of running an input
+ *
+ * Retired user space instructions are counted when perf events are
+ * available, they don't depend on the load of the machine. Otherwise
+ * nanoseconds of wall time are used.
+ */
+class CostMeter {
+    int fd_{-1};
+    std::chrono::steady_clock::time_point start_{};
+
+public:
+    CostMeter() {
+        perf_event_attr attr;
+        std::memset(&attr, 0, sizeof(attr));
+
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        fd_ = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    }
+
+    ~CostMeter() {
+        if (fd_ != -1) {
+            close(fd_);
+        }
+    }
+
+    CostMeter(const CostMeter &) = delete;
+    CostMeter &operator=(const CostMeter &) = delete;
+
+    bool counts_instructions() const {
+        return fd_ != -1;
+    }
+
+    void start() {
+        if (fd_ != -1) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        } else {
+            start_ = std::chrono::steady_clock::now();
+        }
+    }
+
+    uint64_t stop() {
+        if (fd_ == -1) {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start_).count();
+        }
+
+        uint64_t count = 0;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+
+        if (::read(fd_, &count, sizeof(count)) != sizeof(count)) {
+            return 0;
+        }
+
+        return count;
+    }
+};
+
+/** This class reports inputs whose cost isn't linear in their size
+ *
+ * The budget of an input is `base + per_byte * size` instructions, a
+ * nanosecond is counted as an instruction when only time is measured.
+ * The budget is multiplied by $READLINE_FUZZ_BUDGET, e.g. for slower
+ * sanitizer builds. An input over the budget aborts, so the fuzzer
+ * stores it as a finding.
+ */
+class CostBudget {
+    CostMeter meter_{};
+    uint64_t per_byte_;
+    uint64_t base_;
+    double scale_{1.0};
+
+public:
+    explicit CostBudget(uint64_t per_byte, uint64_t base = 20'000'000): per_byte_{per_byte}, base_{base} {
+        if (const char *scale = std::getenv("READLINE_FUZZ_BUDGET")) {
+            scale_ = std::atof(scale);
+        }
+    }
+
+    void start() {
+        meter_.start();
+    }
+
+    void check(size_t size) {
+        const auto cost = meter_.stop();
+        const auto budget = static_cast<uint64_t>((base_ + per_byte_ * size) * scale_);
+
+        if (cost > budget) {
+            std::fprintf(stderr, "input of %zu bytes cost %llu %s, over the linear budget of %llu\n",
+                         size, static_cast<unsigned long long>(cost),
+                         meter_.counts_instructions() ? "instructions" : "ns",
+                         static_cast<unsigned long long>(budget));
+            std::abort();
+        }
+    }
+};
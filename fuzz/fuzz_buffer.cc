@@ -0,0 +1,135 @@
+#include "../src/readline.hh"
+#include "cost.hh"
+
+static CostBudget budget{2000};
+
+/** Apply operations encoded in the input, the model is updated when it's given */
+static void run(const uint8_t *data, size_t size, Buffer &buffer, std::string *model) {
+    for (size_t i = 0; i + 2 <= size;) {
+        const auto op = data[i] % 8;
+        const size_t argument = data[i + 1];
+        i += 2;
+
+        switch (op) {
+            case 0: {
+                const auto n = std::min(argument % 64, size - i);
+                const std::string_view text{reinterpret_cast<const char *>(data + i), n};
+
+                if (model) {
+                    model->insert(buffer.position(), text);
+                }
+
+                buffer.insert(text);
+                i += n;
+                break;
+            }
+            case 1:
+                buffer.set_position(buffer.size() * argument / 255);
+                break;
+            case 2: {
+                const auto begin = buffer.size() * argument / 255;
+                const auto end = std::min(begin + argument % 16 + 1, buffer.size());
+
+                if (model) {
+                    model->erase(begin, end - begin);
+                }
+
+                buffer.erase(begin, end);
+                break;
+            }
+            case 3:
+                argument % 2 ? buffer.move_left(argument % 8) : buffer.move_right(argument % 8);
+                break;
+            case 4:
+                buffer.set_mark();
+                break;
+            case 5: {
+                auto [begin, end] = buffer.region();
+                buffer.convert_case(begin, end, argument % 2 ? LetterCase::Upper : LetterCase::Lower);
+
+                if (model) {
+                    model->assign(buffer.view());
+                }
+                break;
+            }
+            case 6:
+                buffer.transpose_words();
+
+                if (model) {
+                    model->assign(buffer.view());
+                }
+                break;
+            case 7:
+                if (argument == 0) {
+                    buffer.reset(buffer.data());
+                }
+                break;
+        }
+    }
+}
+
+/** The matching token found by scanning the text */
+static std::optional<size_t> scan_for_match(std::string_view text, size_t pos) {
+    const auto open = "([{"sv, close = ")]}"sv;
+    const auto ch = text[pos];
+
+    if (ch == '"' || ch == '\'') {
+        size_t rank = std::count(text.begin(), text.begin() + pos, ch);
+        const size_t target = rank % 2 ? rank - 1 : rank + 1;
+
+        for (size_t i = 0, n = 0; i < text.size(); i++) {
+            if (text[i] == ch && n++ == target) {
+                return i;
+            }
+        }
+    } else if (open.find(ch) != std::string_view::npos) {
+        for (size_t i = pos + 1, depth = 1; i < text.size(); i++) {
+            depth += open.find(text[i]) != std::string_view::npos;
+
+            if (close.find(text[i]) != std::string_view::npos && !--depth) {
+                return i;
+            }
+        }
+    } else if (close.find(ch) != std::string_view::npos) {
+        for (size_t i = pos, depth = 1; i--;) {
+            depth += close.find(text[i]) != std::string_view::npos;
+
+            if (open.find(text[i]) != std::string_view::npos && !--depth) {
+                return i;
+            }
+        }
+    }
+
+    return std::nullopt;
+}
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    {
+        // only the buffer is measured, checks against the model aren't linear
+        Buffer buffer{};
+
+        budget.start();
+        run(data, size, buffer, nullptr);
+        budget.check(size);
+    }
+
+    Buffer buffer{};
+    std::string model;
+
+    run(data, size, buffer, &model);
+
+    if (buffer.view() != model || buffer.position() > buffer.size()) {
+        std::abort();
+    }
+
+    // a sample of positions, so the check stays fast for large inputs
+    const size_t step = std::max<size_t>(1, buffer.size() / 64);
+
+    for (size_t pos = 0; pos < buffer.size(); pos += step) {
+        if (buffer.matching_bracket(pos) != scan_for_match(model, pos)) {
+            std::abort();
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,34 @@
+#include <sstream>
+#include "../src/readline.hh"
+#include "cost.hh"
+
+static CostBudget budget{2000};
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    std::istringstream input{std::string{reinterpret_cast<const char *>(data), size}};
+    CommandReader reader{input};
+    size_t consumed = 0;
+
+    reader.enable_key_events();
+    reader.add_repeatable_command(MOVE_LEFT, [&] { consumed += 3 * reader.repeat_count(); });
+    reader.add_command({ESC, '[', '2', '0', '0', '~'}, [&] { consumed += 6; });
+    reader.add_command(CTRL_SPACE, [&] { consumed++; });
+    reader.add_command(TRANSPOSE_WORDS, [&] { consumed += 2; });
+
+    reader.set_self_insert([&] {
+        const auto text = reader.current_text();
+
+        // invalid sequences must be replaced before reaching the command
+        if (Utf8::valid_prefix(text) != text.size()) {
+            std::abort();
+        }
+
+        consumed += text.size();
+    });
+
+    budget.start();
+    reader.read_and_execute();
+    budget.check(size);
+
+    return 0;
+}
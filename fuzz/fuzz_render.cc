@@ -0,0 +1,45 @@
+#include <sstream>
+#include "../src/readline.hh"
+#include "cost.hh"
+
+static CostBudget budget{20000};
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    std::string text{reinterpret_cast<const char *>(data), size};
+
+    // playing macros multiplies the input by design and the external
+    // editor runs a process, so both are disabled
+    for (size_t pos = text.find(CTRL_X); pos != std::string::npos; pos = text.find(CTRL_X, pos + 1)) {
+        if (pos + 1 < text.size() && (text[pos + 1] == 'e' || text[pos + 1] == '\x05')) {
+            text[pos + 1] = '.';
+        }
+    }
+
+    std::istringstream input{text};
+    std::ostream output{nullptr};
+    Readline readline{};
+
+    // lines wrapped by the terminal are redrawn as a whole, only the
+    // scrolled rendering is bounded by the terminal width
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_columns(40)
+            .set_horizontal_scroll(true)
+            .set_bracket_matching(true);
+
+    const auto lines = std::count(text.begin(), text.end(), NEWLINE) + 1;
+
+    budget.start();
+
+    for (long i = 0; i < lines; i++) {
+        const auto line = readline.read_view();
+
+        if (Utf8::valid_prefix(line) != line.size()) {
+            std::abort();
+        }
+    }
+
+    budget.check(size);
+
+    return 0;
+}
@@ -0,0 +1,62 @@
+/** Runs a fuzz target without libFuzzer
+ *
+ * Inputs are read from the files given as arguments. Without arguments
+ * generated worst-case inputs are run, so complexity regressions are
+ * caught by ctest too.
+ */
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size);
+
+static std::string repeat(const std::string &s, size_t n) {
+    std::string result;
+    result.reserve(s.size() * n);
+
+    while (n--) {
+        result += s;
+    }
+
+    return result;
+}
+
+static std::vector<std::string> generated() {
+    return {
+        std::string(256 << 10, 'a'),
+        "\x1b[" + repeat("1;", 64 << 10),
+        repeat("\x1b[1;2", 32 << 10),
+        repeat("\x1b", 64 << 10),
+        repeat("a\x1b[D", 32 << 10),
+        repeat("(", 64 << 10) + repeat(")", 64 << 10),
+        repeat("\xc3\xff", 64 << 10),
+        repeat("\x1b[97u", 32 << 10),
+        repeat("x\x7f", 64 << 10),
+        repeat("\x12" "a", 32 << 10),
+    };
+}
+
+int main(int argc, char **argv) {
+    size_t inputs = 0;
+
+    auto run = [&](const std::string &input) {
+        LLVMFuzzerTestOneInput(reinterpret_cast<const uint8_t *>(input.data()), input.size());
+        inputs++;
+    };
+
+    if (argc == 1) {
+        for (auto &input: generated()) {
+            run(input);
+        }
+    }
+
+    for (int i = 1; i < argc; i++) {
+        std::ifstream file{argv[i], std::ios::binary};
+        run({std::istreambuf_iterator<char>{file}, std::istreambuf_iterator<char>{}});
+    }
+
+    std::cout << inputs << " inputs passed" << std::endl;
+}
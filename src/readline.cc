@@ -1,11 +1,21 @@
 #include <iostream>
+#include <fstream>
 #include "readline.hh"
 
 int main() {
 
+    // READLINE_TRACE=file writes a timeline of the session for chrome://tracing
+    const char *trace_path = std::getenv("READLINE_TRACE");
+    TraceRecorder recorder{};
+
+    if (trace_path) {
+        TraceRecorder::install(&recorder);
+    }
+
     auto settings = TerminalSettings()
         .set_echo(false)
         .set_canonical(false)
+        .set_flow_control(false)
         .set_output_processing(false)
         .set_ctrlc_ctrlz_as_characters(true)
         .set_timeout_for_non_canonical_read(0)
@@ -14,9 +24,18 @@ int main() {
     Readline readline{};
 
     readline.set_terminal_settings(settings);
+    readline.detect_terminal_capabilities();
     readline.set_prompter([] { return "$> "; });
+    readline.set_bracket_matching(true);
+    readline.set_clipboard(true);
+    readline.set_latency_budget(std::chrono::milliseconds{16});
 
     for (auto line = readline.read(); !line.empty(); line = readline.read()) {
         std::cout << "got: " << line << std::endl;
     }
+
+    if (trace_path) {
+        std::ofstream trace{trace_path};
+        recorder.dump(trace);
+    }
 }
@@ -1,17 +1,336 @@
 #pragma once
 
 #include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <signal.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <tmmintrin.h>
+#define READLINE_SSSE3 1
+#endif
 #include <unistd.h>
 #include <system_error>
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <string_view>
 #include <functional>
 #include <iomanip>
 #include <unordered_map>
-#include <deque>
 #include <iterator>
 #include <memory>
 #include <vector>
+#include <optional>
+#include <variant>
+#include <filesystem>
+#include <cstdlib>
+#include <cctype>
+#include <cwctype>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+#include <limits>
+#include <chrono>
+
+/* Static tracepoints for bpftrace and other USDT consumers
+ *
+ * With <sys/sdt.h> every probe is guarded by its semaphore, which is set
+ * by the tracer when it attaches, so not even the arguments are computed
+ * otherwise. Without the header the probes compile to nothing.
+ *
+ * The header decides whether probes have semaphores when it's included,
+ * so `_SDT_HAS_SEMAPHORES` is defined only around the include and doesn't
+ * reach the includer. When the includer already included the header
+ * without semaphores, the probes of readline are unguarded.
+ */
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#define READLINE_USDT 1
+
+#if !defined(_SYS_SDT_H) && !defined(_SDT_HAS_SEMAPHORES)
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+#undef _SDT_HAS_SEMAPHORES
+#define READLINE_USDT_SEMAPHORES 1
+#elif defined(_SDT_HAS_SEMAPHORES)
+#include <sys/sdt.h>
+#define READLINE_USDT_SEMAPHORES 1
+#else
+#include <sys/sdt.h>
+#endif
+
+#endif
+#endif
+
+#ifdef READLINE_USDT_SEMAPHORES
+#define READLINE_SEMAPHORE(name) \
+    __extension__ unsigned short readline_##name##_semaphore __attribute__((unused)) __attribute__((section(".probes")))
+
+READLINE_SEMAPHORE(input_read);
+READLINE_SEMAPHORE(command_start);
+READLINE_SEMAPHORE(command_done);
+READLINE_SEMAPHORE(buffer_insert);
+READLINE_SEMAPHORE(buffer_erase);
+READLINE_SEMAPHORE(terminal_flush);
+READLINE_SEMAPHORE(history_add);
+READLINE_SEMAPHORE(history_write);
+
+#define READLINE_PROBE(name, ...) \
+    do { \
+        if (__builtin_expect(readline_##name##_semaphore, 0)) { \
+            STAP_PROBEV(readline, name, __VA_ARGS__); \
+        } \
+    } while (0)
+#elif defined(READLINE_USDT)
+#define READLINE_PROBE(name, ...) STAP_PROBEV(readline, name, __VA_ARGS__)
+#else
+#define READLINE_PROBE(name, ...) do {} while (0)
+#endif
+
+/** This class records recent events of the editor for a timeline
+ *
+ * Events are kept in a ring of fixed size, so recording doesn't allocate
+ * and a long session keeps only the most recent events. Recording is
+ * process wide and only one recorder is installed at a time.
+ */
+class TraceRecorder {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    struct Event {
+        const char *name;
+        Clock::time_point begin;
+        Clock::duration duration;
+        uint64_t argument;
+        /** `X` for complete events, `i` for instant ones */
+        char phase;
+    };
+
+private:
+    std::vector<Event> events_;
+    size_t next_{0};
+    size_t size_{0};
+
+    /** Timestamps are relative to the creation of the recorder */
+    Clock::time_point origin_{Clock::now()};
+
+    static inline TraceRecorder *active_{nullptr};
+
+public:
+    explicit TraceRecorder(size_t capacity = 1 << 16): events_(std::max<size_t>(capacity, 1)) {}
+
+    ~TraceRecorder() {
+        if (active_ == this) {
+            active_ = nullptr;
+        }
+    }
+
+    TraceRecorder(const TraceRecorder &) = delete;
+    TraceRecorder &operator=(const TraceRecorder &) = delete;
+
+    /** Record events to the recorder, null stops recording */
+    static void install(TraceRecorder *recorder) {
+        active_ = recorder;
+    }
+
+    static TraceRecorder *active() {
+        return active_;
+    }
+
+    void record(const Event &event) {
+        events_[next_] = event;
+        next_ = (next_ + 1) % events_.size();
+        size_ = std::min(size_ + 1, events_.size());
+    }
+
+    /** Record an event without duration to the installed recorder */
+    static void instant(const char *name, uint64_t argument) {
+        if (active_) {
+            active_->record({name, Clock::now(), {}, argument, 'i'});
+        }
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    /** Write the events in the Chrome trace event format
+     *
+     * The output can be opened in chrome://tracing or in Perfetto.
+     */
+    void dump(std::ostream &os) const {
+        const auto flags = os.flags();
+        const auto precision = os.precision();
+        const auto first = (next_ + events_.size() - size_) % events_.size();
+
+        os << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+
+        for (size_t i = 0; i < size_; i++) {
+            const auto &event = events_[(first + i) % events_.size()];
+            const std::chrono::duration<double, std::micro> begin{event.begin - origin_};
+
+            os << (i ? ",\n" : "\n")
+               << "{\"name\":\"" << event.name << "\",\"ph\":\"" << event.phase << "\",\"ts\":" << begin.count();
+
+            if (event.phase == 'X') {
+                os << ",\"dur\":" << std::chrono::duration<double, std::micro>{event.duration}.count();
+            } else {
+                os << ",\"s\":\"t\"";
+            }
+
+            os << ",\"pid\":" << getpid() << ",\"tid\":1,\"args\":{\"value\":" << event.argument << "}}";
+        }
+
+        os << "\n]}\n";
+        os.flags(flags);
+        os.precision(precision);
+    }
+};
+
+/** This class records its scope as an event, when a recorder is installed */
+class TraceSpan {
+    const char *name_;
+    uint64_t argument_;
+    TraceRecorder::Clock::time_point begin_{};
+
+public:
+    TraceSpan(const char *name, uint64_t argument): name_{name}, argument_{argument} {
+        if (TraceRecorder::active()) {
+            begin_ = TraceRecorder::Clock::now();
+        }
+    }
+
+    ~TraceSpan() {
+        if (auto *recorder = TraceRecorder::active(); recorder && begin_ != TraceRecorder::Clock::time_point{}) {
+            recorder->record({name_, begin_, TraceRecorder::Clock::now() - begin_, argument_, 'X'});
+        }
+    }
+
+    TraceSpan(const TraceSpan &) = delete;
+    TraceSpan &operator=(const TraceSpan &) = delete;
+};
+
+/** Heap bytes held by the parts of a `Readline`, see `Readline::memory_usage`
+ *
+ * The sizes are estimated from the capacities of the containers, the
+ * overhead of the allocator and captures of commands aren't included.
+ */
+struct MemoryUsage {
+    /** Text of the line and its bracket index, a spilled line is mapped and not counted */
+    size_t buffer{0};
+
+    size_t history{0};
+
+    /** The trie of command sequences */
+    size_t key_bindings{0};
+
+    /** Input read ahead, the sequence being matched and keyboard macros */
+    size_t input{0};
+
+    /** Output which wasn't flushed yet */
+    size_t output{0};
+
+    /** Kill ring, incomplete statement and the search pattern */
+    size_t editing{0};
+
+    /** State of a hibernated session, see `Readline::hibernate` */
+    size_t hibernated{0};
+
+    size_t total() const {
+        return buffer + history + key_bindings + input + output + editing + hibernated;
+    }
+
+    /** Short strings are stored inline */
+    static size_t of(const std::string &s) {
+        return s.capacity() > std::string{}.capacity() ? s.capacity() + 1 : 0;
+    }
+
+    template <typename T>
+    static size_t of(const std::vector<T> &v) {
+        return v.capacity() * sizeof(T);
+    }
+};
+
+/** This class is the compact binary form of a hibernated session
+ *
+ * Numbers are LEB128 varints and texts are prefixed by their size, parts
+ * of the session are written and read in the same order.
+ */
+class SessionState {
+    std::string data_{};
+    size_t pos_{0};
+
+public:
+    SessionState() = default;
+
+    explicit SessionState(std::string data): data_{std::move(data)} {}
+
+    void put_number(size_t n) {
+        do {
+            const auto byte = static_cast<char>(n & 0x7f);
+            n >>= 7;
+            data_.push_back(n ? byte | 0x80 : byte);
+        } while (n);
+    }
+
+    void put_text(std::string_view text) {
+        put_number(text.size());
+        data_.append(text);
+    }
+
+    size_t number() {
+        size_t n = 0;
+
+        for (unsigned shift = 0; shift < 64 && pos_ < data_.size(); shift += 7) {
+            const auto byte = static_cast<unsigned char>(data_[pos_++]);
+            n |= static_cast<size_t>(byte & 0x7f) << shift;
+
+            if (!(byte & 0x80)) {
+                return n;
+            }
+        }
+
+        throw std::runtime_error("Malformed session state");
+    }
+
+    /** Number of the following items, each of them takes a byte at least */
+    size_t count() {
+        const auto n = number();
+
+        if (n > data_.size() - pos_) {
+            throw std::runtime_error("Malformed session state");
+        }
+
+        return n;
+    }
+
+    std::string_view text() {
+        const auto size = number();
+
+        if (size > data_.size() - pos_) {
+            throw std::runtime_error("Malformed session state");
+        }
+
+        pos_ += size;
+        return std::string_view{data_}.substr(pos_ - size, size);
+    }
+
+    /** Take the data, the state is empty then */
+    std::string release() {
+        pos_ = 0;
+        return std::move(data_);
+    }
+};
 
 /** This class contains terminal control sequences
  *
@@ -26,16 +345,34 @@ struct ControlSequences {
     static const std::string MoveCursorHorizonalAbsolute;
     static const std::string ClearTheLine;
     static const std::string SetGraphicRendition;
+    static const std::string RequestPrivateMode;
+    static const std::string RequestKeyboardFlags;
+    static const std::string RequestCursorPosition;
+    static const std::string RequestDeviceAttributes;
+    static const std::string PushKeyboardFlags;
+    static const std::string PopKeyboardFlags;
+    static const std::string SetClipboard;
+    static const std::string StringTerminator;
+    static const std::string Bell;
 };
 
 using namespace std::literals;
 
 const std::string ControlSequences::ClearTheScreen{"\x1b[2J"s};
 const std::string ControlSequences::ClearTheLine{"\x1b[K"s}; // from the active pos to end of the line
-const std::string ControlSequences::MoveCursorBackward{"\x1b[1D"s};
+const std::string ControlSequences::MoveCursorBackward{"\x1b[{N}D"s};
 const std::string ControlSequences::MoveCursorForward{"\x1b[{N}C"s};
 const std::string ControlSequences::MoveCursorHorizonalAbsolute{"\x1b[{N}G"s};
 const std::string ControlSequences::SetGraphicRendition{"\x1b[{}m"};
+const std::string ControlSequences::RequestPrivateMode{"\x1b[?{N}$p"s}; // DECRQM
+const std::string ControlSequences::RequestKeyboardFlags{"\x1b[?u"s}; // kitty keyboard protocol
+const std::string ControlSequences::RequestCursorPosition{"\x1b[6n"s}; // CPR
+const std::string ControlSequences::RequestDeviceAttributes{"\x1b[c"s}; // DA1
+const std::string ControlSequences::PushKeyboardFlags{"\x1b[>{N}u"s};
+const std::string ControlSequences::PopKeyboardFlags{"\x1b[<u"s};
+const std::string ControlSequences::SetClipboard{"\x1b]52;c;"s}; // OSC 52, base64 data follows
+const std::string ControlSequences::StringTerminator{"\x1b\\"s};
+const std::string ControlSequences::Bell{"\a"s};
 
 /** Select Graphic Rendition sets display attributes.
  *
@@ -54,752 +391,5802 @@ enum class SelectGraphicRendition {
     Reverse = 7,
 };
 
-namespace {
-    termios get_terminal_attr(void) {
-        termios term;
+/** Progressive enhancement flags of the kitty keyboard protocol
+ *
+ * For more info check: https://sw.kovidgoyal.net/kitty/keyboard-protocol/
+ */
+enum class KeyboardFlags {
+    /** Esc, alt+key and ctrl+key are reported as `CSI code ; modifiers u` */
+    DisambiguateEscapeCodes = 1,
+};
 
-        if (int rv = tcgetattr(STDIN_FILENO, &term); rv)
-            throw std::system_error{errno, std::generic_category()};
+/** DEC private modes which are queried during capability probing */
+enum class PrivateMode {
+    BracketedPaste = 2004,
+    SynchronizedOutput = 2026,
+};
 
-        return term;
+/** This class describes features supported by the terminal emulator
+ *
+ * The capabilities are discovered by querying the terminal (see
+ * `TerminalCapabilitiesReader`) and persisted by `TerminalCapabilitiesCache`,
+ * so the probe round-trip is paid only once per terminal.
+ */
+struct TerminalCapabilities {
+    /** Synchronized output (mode 2026) */
+    bool synchronized_output{false};
+    /** Bracketed paste (mode 2004) */
+    bool bracketed_paste{false};
+    /** Kitty progressive keyboard enhancement protocol */
+    bool kitty_keyboard{false};
+    /** 24-bit colors */
+    bool true_color{false};
+    /** East Asian ambiguous-width characters occupy two cells */
+    bool ambiguous_wide{false};
+
+    /** Terminals advertise 24-bit colors through $COLORTERM */
+    static bool true_color_from_environment() {
+        const char *colorterm = std::getenv("COLORTERM");
+
+        if (!colorterm) {
+            return false;
+        }
+
+        return colorterm == "truecolor"s || colorterm == "24bit"s;
     }
 
-    void set_terminal_attr(const termios term) {
-        if (int rv = tcsetattr(STDIN_FILENO, TCSAFLUSH, &term); rv)
-            throw std::system_error{errno, std::generic_category()};
+    void serialize(std::ostream &os) const {
+        os << "synchronized_output=" << synchronized_output << '\n'
+           << "bracketed_paste=" << bracketed_paste << '\n'
+           << "kitty_keyboard=" << kitty_keyboard << '\n'
+           << "true_color=" << true_color << '\n'
+           << "ambiguous_wide=" << ambiguous_wide << '\n';
     }
-}
 
-/** This class represent terminal settings */
-class TerminalSettings {
-    private:
-        /** Terminal settings captured before any modification */
-        termios original_{get_terminal_attr()};
+    static TerminalCapabilities deserialize(std::istream &is) {
+        TerminalCapabilities capabilities{};
 
-        /** Modified terminal settings */
-        termios current_{get_terminal_attr()};
-    public:
-        TerminalSettings() {}
+        const std::unordered_map<std::string, bool TerminalCapabilities::*> fields{
+            {"synchronized_output", &TerminalCapabilities::synchronized_output},
+            {"bracketed_paste", &TerminalCapabilities::bracketed_paste},
+            {"kitty_keyboard", &TerminalCapabilities::kitty_keyboard},
+            {"true_color", &TerminalCapabilities::true_color},
+            {"ambiguous_wide", &TerminalCapabilities::ambiguous_wide},
+        };
 
-        TerminalSettings(const TerminalSettings &s) {
-            original_ = s.original_;
-            current_ = s.current_;
+        for (std::string line; std::getline(is, line);) {
+            auto separator = line.find('=');
+
+            if (separator == std::string::npos) {
+                continue;
+            }
+
+            // unknown keys are ignored, so older caches remain readable
+            if (auto field = fields.find(line.substr(0, separator)); field != fields.end()) {
+                capabilities.*(field->second) = line.substr(separator + 1) == "1";
+            }
         }
 
-        /** Apply changed terminal settings */
-        void apply() const {
-            set_terminal_attr(current_);
+        return capabilities;
+    }
+};
+
+/** This class persists terminal capabilities on the disk
+ *
+ * There is one file per terminal identity in `$XDG_CACHE_HOME/readline`
+ * (or `~/.cache/readline`).
+ */
+class TerminalCapabilitiesCache {
+    std::filesystem::path directory_;
+
+    static std::filesystem::path default_directory() {
+        if (const char *cache = std::getenv("XDG_CACHE_HOME"); cache && *cache) {
+            return std::filesystem::path{cache} / "readline";
         }
 
-        /** Reset terminal settings to the original state */
-        void reset() const {
-            set_terminal_attr(original_);
+        if (const char *home = std::getenv("HOME"); home && *home) {
+            return std::filesystem::path{home} / ".cache" / "readline";
         }
 
-        /** Echo input characters */
-        TerminalSettings &set_echo(bool to) {
-            current_.c_lflag &= to ? ECHO : ~ECHO;
-            return *this;
+        return {};
+    }
+
+    std::filesystem::path path_for(const std::string &identity) const {
+        std::string name{"terminal-"};
+
+        for (auto ch: identity) {
+            name.push_back(std::isalnum(static_cast<unsigned char>(ch)) || ch == '-' || ch == '.' ? ch : '_');
         }
 
-        /** Set canonical mode
-         *
-         * In Canonical mode:
-         * - Input is made available line by line
-         * - Line editing is enabled
-         * - The maximum line length is limited
-         *
-         * In noncanonical mode:
-         * - input is available immediately
-         * - no input processing is avaiable
-         */
-        TerminalSettings &set_canonical(bool to) {
-            current_.c_lflag &= to ? ICANON : ~ICANON;
-            return *this;
+        return directory_ / name;
+    }
+
+public:
+    TerminalCapabilitiesCache(): directory_{default_directory()} {}
+    TerminalCapabilitiesCache(std::filesystem::path directory): directory_{std::move(directory)} {}
+
+    /** Identity of the current terminal: $TERM refined by $TERM_PROGRAM and its version */
+    static std::string identity() {
+        std::string identity;
+
+        for (auto variable: {"TERM", "TERM_PROGRAM", "TERM_PROGRAM_VERSION"}) {
+            const char *value = std::getenv(variable);
+            identity += (identity.empty() ? "" : "-") + std::string{value ? value : ""};
         }
 
-        /** Minimum number of characters for noncanonical read */
-        TerminalSettings &set_min_chars_for_non_canonical_read(size_t n) {
-            current_.c_cc[VMIN] = n;
-            return *this;
+        return identity;
+    }
+
+    std::optional<TerminalCapabilities> load(const std::string &identity) const {
+        if (directory_.empty()) {
+            return std::nullopt;
         }
 
-        /** Timeout in deciseconds (1/10s) for noncanonical read */
-        TerminalSettings &set_timeout_for_non_canonical_read(size_t n) {
-            current_.c_cc[VTIME] = n;
-            return *this;
+        std::ifstream file{path_for(identity)};
+
+        if (!file) {
+            return std::nullopt;
         }
 
-        /** When any of INTR (ctrl+c), QUIT (ctrl+q), SUSP (ctrl+z) are received,
-         * generate correspending signal
-         */
-        TerminalSettings &set_ctrlc_ctrlz_as_characters(bool to) {
-            current_.c_lflag &= to ? ~ISIG : ISIG;
-            return *this;
+        return TerminalCapabilities::deserialize(file);
+    }
+
+    /** Store capabilities, the file is replaced atomically */
+    void store(const std::string &identity, const TerminalCapabilities &capabilities) const {
+        if (directory_.empty()) {
+            return;
         }
 
-        /** Set implementation-defined output processing
-         *
-         *  If OPOST is set output characters are post-processed as indicated by
-         *  the remaining flags otherwise characters are transmitted without change.
-         **/
-        TerminalSettings &set_output_processing(bool to) {
-            current_.c_oflag &= to ? ~OPOST : OPOST;
-            return *this;
+        std::error_code ec;
+        std::filesystem::create_directories(directory_, ec);
+
+        auto path = path_for(identity);
+        auto temporary = path;
+        temporary += "." + std::to_string(getpid());
+
+        {
+            std::ofstream file{temporary};
+
+            if (!file) {
+                return;
+            }
+
+            capabilities.serialize(file);
         }
 
+        std::filesystem::rename(temporary, path, ec);
+    }
 };
 
-/** This class represents software terminal
+/** UTF-8 encoding and display width helpers
  *
- * It provides functions like moving the cursor and graphics rendering
+ * Invalid bytes are decoded as U+FFFD one byte at a time.
  */
-class Terminal {
-    private:
-        TerminalSettings settings_;
+struct Utf8 {
+    static bool is_continuation(char ch) {
+        return (static_cast<unsigned char>(ch) & 0xc0) == 0x80;
+    }
 
-        /** Writes control sequence to the stdin
-         *
-         * It's expected that terminal will read it and interpret the sequence
-         */
-        static void write_sequence(const std::string &sequence) {
-            ssize_t written = write(STDOUT_FILENO,
-                                    sequence.c_str(),
-                                    sequence.size());
+    /** Length of the sequence starting with the lead byte */
+    static size_t sequence_length(char lead) {
+        auto byte = static_cast<unsigned char>(lead);
+
+        if (byte < 0xc2) {
+            return 1;
+        } else if (byte < 0xe0) {
+            return 2;
+        } else if (byte < 0xf0) {
+            return 3;
+        } else if (byte < 0xf5) {
+            return 4;
+        }
 
-            if (written == -1) {
-                throw std::system_error{errno, std::generic_category()};
-            }
+        return 1;
+    }
 
-            if (static_cast<size_t>(written) != sequence.size()) {
-                throw std::runtime_error{"Not enough bytes was written"};
-            }
+    /** Decode codepoint at the position and move the position after it */
+    static char32_t decode(std::string_view s, size_t &pos) {
+        const auto length = sequence_length(s[pos]);
+        auto byte = static_cast<unsigned char>(s[pos]);
+
+        if (length == 1) {
+            pos++;
+            return byte < 0x80 ? byte : 0xfffd;
         }
 
-    public:
+        if (pos + length > s.size()) {
+            pos++;
+            return 0xfffd;
+        }
 
-        Terminal() {}
+        char32_t cp = byte & (0x7f >> length);
 
-        Terminal(const TerminalSettings &settings): settings_{settings} {}
-        Terminal(const Terminal &t): settings_{t.settings_} {}
+        for (size_t i = 1; i < length; i++) {
+            if (!is_continuation(s[pos + i])) {
+                pos++;
+                return 0xfffd;
+            }
 
-        /** Moves cursor one cell to the right */
-        void move_cursor_forward() const {
-            return move_cursor_forward(1);
+            cp = (cp << 6) | (static_cast<unsigned char>(s[pos + i]) & 0x3f);
         }
 
-        /** Moves cursor n cells to the right */
-        void move_cursor_forward(size_t n) const {
-            auto sequence{ControlSequences::MoveCursorForward};
-            sequence.replace(sequence.find("{N}"s), 3, std::to_string(n));
+        pos += length;
+        return cp;
+    }
 
-            write_sequence(sequence);
+    /** Length of the well-formed sequence at the position
+     *
+     * Returns 0 for an ill-formed or truncated sequence, `subpart` is then
+     * the length of its maximal subpart, which is replaced by a single
+     * U+FFFD. See the Unicode standard, table 3-7.
+     */
+    static size_t well_formed_length(std::string_view s, size_t pos, size_t &subpart) {
+        const auto lead = static_cast<unsigned char>(s[pos]);
+        unsigned char low = 0x80, high = 0xbf;
+        size_t length = 0;
+
+        if (lead < 0x80) {
+            return 1;
+        } else if (lead >= 0xc2 && lead <= 0xdf) {
+            length = 2;
+        } else if (lead >= 0xe0 && lead <= 0xef) {
+            length = 3;
+            low = lead == 0xe0 ? 0xa0 : 0x80;
+            high = lead == 0xed ? 0x9f : 0xbf;
+        } else if (lead >= 0xf0 && lead <= 0xf4) {
+            length = 4;
+            low = lead == 0xf0 ? 0x90 : 0x80;
+            high = lead == 0xf4 ? 0x8f : 0xbf;
+        } else {
+            subpart = 1;
+            return 0;
         }
 
-        /** Moves cursor one cell to the left */
-        void move_cursor_backward() const {
-            write_sequence(ControlSequences::MoveCursorBackward);
-        }
+        for (size_t i = 1; i < length; i++) {
+            if (pos + i == s.size()) {
+                subpart = i;
+                return 0;
+            }
 
-        /** Clear the entire screen */
-        void clear_the_screen() const {
-            write_sequence(ControlSequences::ClearTheScreen);
+            const auto byte = static_cast<unsigned char>(s[pos + i]);
+
+            if (byte < (i == 1 ? low : 0x80) || byte > (i == 1 ? high : 0xbf)) {
+                subpart = i;
+                return 0;
+            }
         }
 
-        /** Reverse graphics using graphic rendetion */
-        void reverse_graphics() const {
+        return length;
+    }
 
-            auto sequence{ControlSequences::SetGraphicRendition};
-            auto param = static_cast<int>(SelectGraphicRendition::Reverse);
+    /** Length of the ASCII prefix, 16 bytes are checked at once */
+    static size_t ascii_prefix(std::string_view s) {
+        size_t pos = 0;
 
-            sequence.replace(sequence.find("{}"s), 2, std::to_string(param));
-            write_sequence(sequence);
+#ifdef __SSE2__
+        for (; pos + 16 <= s.size(); pos += 16) {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + pos));
+
+            if (int mask = _mm_movemask_epi8(chunk)) {
+                return pos + __builtin_ctz(mask);
+            }
         }
+#else
+        for (; pos + 8 <= s.size(); pos += 8) {
+            uint64_t chunk;
+            std::memcpy(&chunk, s.data() + pos, sizeof(chunk));
 
-        /** Clear the line from the cursor to the end of the line */
-        void clear_the_line() const {
-            write_sequence(ControlSequences::ClearTheLine);
+            if (chunk & 0x8080808080808080ull) {
+                break;
+            }
         }
+#endif
 
-        /** Move cursor to the begining of the current line */
-        void move_cursor_horizontal_absolute() const {
-            move_cursor_horizontal_absolute(0);
+        while (pos < s.size() && !(s[pos] & 0x80)) {
+            pos++;
         }
 
-        /** Move cursor to the nth position of the current line */
-        void move_cursor_horizontal_absolute(size_t n) const {
-            auto sequence{ControlSequences::MoveCursorHorizonalAbsolute};
-            sequence.replace(sequence.find("{N}"s), 3, std::to_string(n));
+        return pos;
+    }
 
-            write_sequence(sequence);
-        }
+    /** Length of the valid prefix of the text */
+    static size_t valid_prefix(std::string_view s) {
+        size_t pos = 0, subpart = 0;
 
-        void set_settings(const TerminalSettings &s) {
-            settings_ = s;
-        }
+        while (pos < s.size()) {
+            pos += ascii_prefix(s.substr(pos));
 
-        void apply_settings() {
-            settings_.apply();
-        }
+            if (pos == s.size()) {
+                break;
+            }
 
-        void reset_settings() {
-            settings_.reset();
+            if (auto length = well_formed_length(s, pos, subpart)) {
+                pos += length;
+            } else {
+                break;
+            }
         }
-};
-
-/** This class represents storage of inputs */
-class History {
-    /** File where should be history persisted */
-    std::shared_ptr<std::ostream> history_file_{};
 
-    /** Maximum input entries */
-    size_t max_entries_{1024};
+        return pos;
+    }
 
-    /** Stored input entries */
-    std::deque<std::string> entries_{};
+    /** Replace every maximal subpart of an ill-formed sequence with U+FFFD */
+    static std::string sanitize(std::string_view s) {
+        std::string text;
+        text.reserve(s.size() + 8);
+
+        while (!s.empty()) {
+            const auto valid = valid_prefix(s);
+            text.append(s.substr(0, valid));
+            s.remove_prefix(valid);
+
+            if (!s.empty()) {
+                size_t subpart = 1;
+                well_formed_length(s, 0, subpart);
+                text.append("\xef\xbf\xbd");
+                s.remove_prefix(subpart);
+            }
+        }
 
-    void write_to_file() {
-        std::copy(entries_.cbegin(),
-                  entries_.cend(),
-                  std::ostream_iterator<std::string>{*history_file_.get(), "\n"});
+        return text;
     }
 
-public:
+    /** Number of bytes missing to complete the sequence at the end of the text */
+    static size_t missing_bytes(std::string_view s) {
+        for (size_t back = 1; back <= std::min<size_t>(3, s.size()); back++) {
+            const auto pos = s.size() - back;
 
-    std::string get_line(const size_t n) const {
-        return entries_.at(n);
-    }
+            if (is_continuation(s[pos])) {
+                continue;
+            }
 
-    void add_line(const std::string &line) {
+            size_t subpart = 0;
 
-        entries_.push_back(line);
+            if (well_formed_length(s, pos, subpart) == 0 && pos + subpart == s.size()) {
+                return sequence_length(s[pos]) - back;
+            }
 
-        if (entries_.size() > max_entries_) {
-            entries_.pop_front();
+            return 0;
         }
-    }
 
-    size_t size() const {
-        return entries_.size();
+        return 0;
     }
 
-    bool empty() const {
-        return !size();
+    /** Codepoint doesn't start a new grapheme cluster */
+    static bool is_extending(char32_t cp) {
+        return (cp >= 0x300 && cp <= 0x36f) || (cp >= 0x1ab0 && cp <= 0x1aff) ||
+               (cp >= 0x1dc0 && cp <= 0x1dff) || (cp >= 0x20d0 && cp <= 0x20ff) ||
+               (cp >= 0xfe20 && cp <= 0xfe2f) || (cp >= 0xfe00 && cp <= 0xfe0f) ||
+               (cp >= 0x1f3fb && cp <= 0x1f3ff) || (cp >= 0xe0020 && cp <= 0xe007f) ||
+               (cp >= 0xe0100 && cp <= 0xe01ef) || cp == 0x200d;
     }
 
-    void save() {
-        write_to_file();
+    /** Position of the codepoint before the position */
+    static size_t previous_codepoint(std::string_view s, size_t pos) {
+        size_t start = pos - 1;
+
+        while (start && is_continuation(s[start]) && pos - start < 4) {
+            start--;
+        }
+
+        return start;
     }
-};
 
-class HistoryView {
-    History history_;
-    size_t current_line_{0};
+    /** End of the grapheme cluster starting at the position
+     *
+     * The cluster is approximated as a codepoint followed by combining
+     * marks, variation selectors and zero width joiner sequences.
+     */
+    static size_t next_boundary(std::string_view s, size_t pos) {
+        decode(s, pos);
 
-public:
+        while (pos < s.size()) {
+            size_t next = pos;
+            const auto cp = decode(s, next);
 
-    void add_line(const std::string &line) {
-        const size_t current_size = history_.size();
-        history_.add_line(line);
-        if (current_size < history_.size()) {
-            current_line_++;
+            if (!is_extending(cp)) {
+                break;
+            }
+
+            pos = next;
+
+            if (cp == 0x200d && pos < s.size()) {
+                decode(s, pos);
+            }
         }
 
+        return pos;
     }
 
-    void reset_position() {
-        current_line_ = history_.size();
-    }
+    /** Start of the grapheme cluster which ends at the position */
+    static size_t previous_boundary(std::string_view s, size_t pos) {
+        while (pos) {
+            size_t start = previous_codepoint(s, pos), next = start;
+            const auto cp = decode(s, next);
 
-    size_t size() const {
-        return history_.size();
-    }
+            pos = start;
 
-    bool empty() const {
-        return !size();
-    }
+            if (is_extending(cp)) {
+                continue;
+            }
 
-    const std::string previous() {
+            if (pos) {
+                size_t joiner = previous_codepoint(s, pos);
 
-        if (history_.empty()) {
-            return "";
-        }
+                if (decode(s, joiner) == 0x200d) {
+                    continue;
+                }
+            }
 
-        if (current_line_) {
-            current_line_--;
-            return history_.get_line(current_line_);
-        } else {
-            return history_.get_line(0);
+            break;
         }
 
+        return pos;
     }
 
-    const std::string next() {
+    /** Number of terminal cells occupied by the codepoint */
+    static size_t codepoint_width(char32_t cp) {
+        if (cp < 0x20 || (cp >= 0x7f && cp < 0xa0)) {
+            return 0;
+        }
 
-        if (history_.empty()) {
-            return "";
+        // combining marks, zero width space/joiners, variation selectors, tags
+        if ((cp >= 0x300 && cp <= 0x36f) || (cp >= 0x200b && cp <= 0x200f) ||
+            (cp >= 0xfe00 && cp <= 0xfe0f) || (cp >= 0x20d0 && cp <= 0x20ff) ||
+            (cp >= 0xe0020 && cp <= 0xe007f)) {
+            return 0;
         }
 
-        if (current_line_ < history_.size()) {
-            return history_.get_line(current_line_++);
+        // east asian wide and fullwidth characters, emoji
+        if ((cp >= 0x1100 && cp <= 0x115f) || (cp >= 0x2e80 && cp <= 0xa4cf && cp != 0x303f) ||
+            (cp >= 0xac00 && cp <= 0xd7a3) || (cp >= 0xf900 && cp <= 0xfaff) ||
+            (cp >= 0xfe30 && cp <= 0xfe4f) || (cp >= 0xff00 && cp <= 0xff60) ||
+            (cp >= 0xffe0 && cp <= 0xffe6) || (cp >= 0x1f300 && cp <= 0x1f64f) ||
+            (cp >= 0x1f900 && cp <= 0x1f9ff) || (cp >= 0x20000 && cp <= 0x3fffd)) {
+            return 2;
         }
 
-        return ""; //history_.get_line(history_.size() - 1);
+        return 1;
     }
-};
-
-class Prompt {
-    std::function<std::string(void)> prompter_{};
-    std::string prompt_{""};
-public:
 
-    void set_prompt(decltype(prompter_) p) {
-        prompter_ = p;
-    }
+    /** Bytes scanned for a column of `prefix_by_width` and `suffix_by_width`
+     *
+     * Zero width characters belong to the previous cell and are counted
+     * exactly, e.g. the tags of a flag or stacked combining marks. A run of
+     * them could make the scan of a few columns take the whole text, so the
+     * scan stops after this many bytes per column and the text beyond is
+     * treated as not fitting.
+     */
+    static constexpr size_t max_bytes_per_column = 64;
 
-    const std::string &operator() () {
-        prompt_ = prompter_();
-        return prompt_;
-    }
+    /** Number of terminal cells occupied by the text */
+    static size_t width(std::string_view s) {
+        size_t columns = 0;
 
-    size_t size() const {
-        return prompt_.size();
-    }
+        for (size_t pos = 0; pos < s.size();) {
+            columns += codepoint_width(decode(s, pos));
+        }
 
-    operator bool () const {
-        return static_cast<bool>(prompter_);
+        return columns;
     }
-};
 
-class Buffer {
-    size_t cursor_pos_{0};
-    std::string data_;
+    /** Length in bytes of the longest prefix which fits into the columns
+     *
+     * At most `max_bytes_per_column` bytes per column are scanned, so the
+     * cost is bounded by the columns.
+     */
+    static size_t prefix_by_width(std::string_view s, size_t columns) {
+        const size_t window = std::min(s.size(), (columns + 1) * max_bytes_per_column);
+        size_t pos = 0, used = 0;
 
-public:
-    void insert(char c) {
-        if (cursor_pos_ == data_.size()) {
-            data_.push_back(c);
-            cursor_pos_++;
-        } else {
-            // TODO: check size
-            auto ending = data_.substr(cursor_pos_);
-            data_.erase(cursor_pos_);
+        while (pos < window) {
+            size_t next = pos;
+            used += codepoint_width(decode(s, next));
 
-            data_.insert(cursor_pos_, 1, c);
+            if (used > columns || next > window) {
+                break;
+            }
 
-            cursor_pos_++;
-            data_.insert(cursor_pos_, ending);
+            pos = next;
         }
-    }
 
-    void move_left() {
-        if (cursor_pos_ >= 1) {
-            cursor_pos_--;
-        }
+        return pos;
     }
 
-    void move_right() {
-        if (cursor_pos_ < data_.size()) {
-            cursor_pos_++;
+    /** Length in bytes of the longest suffix which fits into the columns, scanned like `prefix_by_width` */
+    static size_t suffix_by_width(std::string_view s, size_t columns) {
+        const size_t window = std::min(s.size(), (columns + 1) * max_bytes_per_column);
+        size_t begin = s.size(), used = 0;
+
+        // zero width characters belong to the cell before them, they are kept only with it
+        size_t cell_begin = begin;
+
+        while (begin > s.size() - window) {
+            size_t start = begin - 1;
+
+            while (start && is_continuation(s[start]) && begin - start < 4) {
+                start--;
+            }
+
+            size_t next = start;
+            const auto w = codepoint_width(decode(s, next));
+            used += w;
+
+            if (used > columns || start < s.size() - window) {
+                break;
+            }
+
+            begin = start;
+
+            if (w || !begin) {
+                cell_begin = begin;
+            }
         }
+
+        return s.size() - cell_begin;
     }
 
-    void remove() {
-        if (cursor_pos_ >= 1) {
-            data_.erase(--cursor_pos_, 1);
+    static std::string encode(char32_t cp) {
+        std::string bytes;
+
+        if (cp < 0x80) {
+            bytes.push_back(static_cast<char>(cp));
+        } else if (cp < 0x800) {
+            bytes.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+            bytes.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        } else if (cp < 0x10000) {
+            bytes.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+            bytes.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+            bytes.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+        } else {
+            bytes.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+            bytes.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+            bytes.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+            bytes.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
         }
-    }
 
-    void clear() {
-        cursor_pos_ = 0;
-        data_.clear();
+        return bytes;
     }
+};
 
-    void reset(std::string s) {
-        data_ = std::move(s);
-        cursor_pos_ = data_.size();
+namespace {
+    termios get_terminal_attr(void) {
+        termios term;
+
+        if (int rv = tcgetattr(STDIN_FILENO, &term); rv)
+            throw std::system_error{errno, std::generic_category()};
+
+        return term;
     }
 
-    size_t position() const {
-        return cursor_pos_;
+    void set_terminal_attr(const termios term) {
+        if (int rv = tcsetattr(STDIN_FILENO, TCSAFLUSH, &term); rv)
+            throw std::system_error{errno, std::generic_category()};
     }
+}
 
-    std::string data() const {
-        return data_;
+/** Base64 encoding, used to pass text to the terminal's clipboard
+ *
+ * With SSSE3, which is detected at runtime, 12 bytes are encoded at once.
+ */
+struct Base64 {
+
+    static constexpr size_t encoded_size(size_t n) {
+        return (n + 2) / 3 * 4;
     }
 
-    bool empty() const {
-        return data_.empty();
+    /** Encode the bytes, the output must have room for `encoded_size` bytes */
+    static void encode(std::string_view in, char *out) {
+        size_t done = 0;
+
+#ifdef READLINE_SSSE3
+        if (__builtin_cpu_supports("ssse3")) {
+            done = encode_ssse3(in, out);
+        }
+#endif
+
+        encode_scalar(in.substr(done), out + encoded_size(done));
     }
 
-    size_t size() const {
-        return data_.size();
+    static void encode_scalar(std::string_view in, char *out) {
+        static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+        size_t i = 0;
+
+        for (; i + 3 <= in.size(); i += 3) {
+            const uint32_t bits = static_cast<unsigned char>(in[i]) << 16 |
+                                  static_cast<unsigned char>(in[i + 1]) << 8 |
+                                  static_cast<unsigned char>(in[i + 2]);
+
+            *out++ = alphabet[bits >> 18];
+            *out++ = alphabet[bits >> 12 & 0x3f];
+            *out++ = alphabet[bits >> 6 & 0x3f];
+            *out++ = alphabet[bits & 0x3f];
+        }
+
+        if (i < in.size()) {
+            const bool two = i + 1 < in.size();
+            const uint32_t bits = static_cast<unsigned char>(in[i]) << 16 |
+                                  (two ? static_cast<unsigned char>(in[i + 1]) << 8 : 0);
+
+            *out++ = alphabet[bits >> 18];
+            *out++ = alphabet[bits >> 12 & 0x3f];
+            *out++ = two ? alphabet[bits >> 6 & 0x3f] : '=';
+            *out++ = '=';
+        }
     }
 
-    friend std::ostream &operator<<(std::ostream &, const Buffer &);
-};
+#ifdef READLINE_SSSE3
+    /** Encode blocks of 12 bytes, returns number of encoded bytes
+     *
+     * 16 bytes are loaded for every block, so the tail is left to the
+     * scalar encoder. For more info check: http://0x80.pl/notesen/2016-01-12-sse-base64-encoding.html
+     */
+    __attribute__((target("ssse3")))
+    static size_t encode_ssse3(std::string_view in, char *out) {
+        size_t i = 0;
 
-std::ostream &operator<<(std::ostream &os, const Buffer &b) {
-    return os << b.data_;
-}
+        for (; i + 16 <= in.size(); i += 12, out += 16) {
+            auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(in.data() + i));
 
-//class TerminalBuffer {
-//
-//    size_t prompt_end_{0};
-//    Buffer &buffer_;
-//    Terminal &terminal_;
-//
-//public:
-//    void set_prompt_end(const size_t end) {
-//        prompt_end_ = end;
-//    }
-//};
+            // spread 3 bytes to 4 lanes of 6 bits
+            chunk = _mm_shuffle_epi8(chunk, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
 
-const auto CTRL_C = 3;
-const auto CTRL_D = 4;
-const auto CTRL_U = 21;
-const auto ESC = '\x1b';
-const auto BACKSPACE = '\x7f';
-const auto NEWLINE = '\n';
-const auto TAB = '\t';
+            const auto high = _mm_mulhi_epu16(_mm_and_si128(chunk, _mm_set1_epi32(0x0fc0fc00)),
+                                              _mm_set1_epi32(0x04000040));
+            const auto low = _mm_mullo_epi16(_mm_and_si128(chunk, _mm_set1_epi32(0x003f03f0)),
+                                             _mm_set1_epi32(0x01000010));
+            const auto indices = _mm_or_si128(high, low);
 
-const auto MOVE_LEFT = {ESC, '[', 'D'};
-const auto MOVE_RIGHT = {ESC, '[', 'C'};
-const auto MOVE_DOWN = {ESC, '[', 'A'};
-const auto MOVE_UP = {ESC, '[', 'B'};
+            // offset of the character class of every index
+            auto classes = _mm_subs_epu8(indices, _mm_set1_epi8(51));
+            const auto letters = _mm_cmpgt_epi8(_mm_set1_epi8(26), indices);
+            classes = _mm_or_si128(classes, _mm_and_si128(letters, _mm_set1_epi8(13)));
 
-struct CommandSequences {
+            const auto offsets = _mm_setr_epi8('a' - 26, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52,
+                                               '0' - 52, '0' - 52, '0' - 52, '0' - 52, '0' - 52, '+' - 62,
+                                               '/' - 63, 'A', 0, 0);
+            const auto encoded = _mm_add_epi8(_mm_shuffle_epi8(offsets, classes), indices);
 
-    using SequenceChar = char;
-    using SubSequence = std::shared_ptr<CommandSequences>;
-    using Command = std::function<void(void)>;
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(out), encoded);
+        }
 
-    std::unordered_map<SequenceChar, SubSequence> sequences;
-    Command command;
+        return i;
+    }
+#endif
+};
 
-    template <typename It>
-    void insert(It begin, It end, const Command &command) {
+// only the encoder above needs it, includers don't get it
+#undef READLINE_SSSE3
 
-        CommandSequences *sequence = this;
+/** This class represent terminal settings */
+class TerminalSettings {
+    private:
+        /** Input isn't a terminal (pipe, file), settings are not applied */
+        bool is_terminal_{isatty(STDIN_FILENO) == 1};
 
-        while (begin != end) {
+        /** Terminal settings captured before any modification */
+        termios original_{is_terminal_ ? get_terminal_attr() : termios{}};
 
-            if (!sequence->contains(*begin)) {
-                sequence->sequences[*begin].reset(new CommandSequences());
+        /** Modified terminal settings */
+        termios current_{original_};
+    public:
+        TerminalSettings() {}
+
+        TerminalSettings(const TerminalSettings &s) {
+            is_terminal_ = s.is_terminal_;
+            original_ = s.original_;
+            current_ = s.current_;
+        }
+
+        /** Apply changed terminal settings */
+        void apply() const {
+            if (is_terminal_) {
+                set_terminal_attr(current_);
             }
+        }
 
-            sequence = sequence->sequences[*begin].get();
+        /** Reset terminal settings to the original state */
+        void reset() const {
+            if (is_terminal_) {
+                set_terminal_attr(original_);
+            }
+        }
 
-            begin = std::next(begin);
+        /** The original settings are saved too, so a process taking over the terminal can restore them */
+        void save_state(SessionState &state) const {
+            state.put_number(is_terminal_);
+            state.put_text({reinterpret_cast<const char *>(&original_), sizeof(original_)});
+            state.put_text({reinterpret_cast<const char *>(&current_), sizeof(current_)});
         }
 
-        sequence->command = command;
-    }
+        void load_state(SessionState &state) {
+            is_terminal_ = state.number();
 
-    template <typename CharType>
-    void insert(const std::initializer_list<CharType> &sequence, const Command &command) {
-        insert(std::begin(sequence), std::end(sequence), command);
-    }
+            for (auto *settings: {&original_, &current_}) {
+                const auto text = state.text();
+
+                if (text.size() != sizeof(*settings)) {
+                    throw std::runtime_error("Malformed session state");
+                }
+
+                std::memcpy(settings, text.data(), sizeof(*settings));
+            }
+        }
+
+        /** Echo input characters */
+        TerminalSettings &set_echo(bool to) {
+            current_.c_lflag &= to ? ECHO : ~ECHO;
+            return *this;
+        }
+
+        /** Set canonical mode
+         *
+         * In Canonical mode:
+         * - Input is made available line by line
+         * - Line editing is enabled
+         * - The maximum line length is limited
+         *
+         * In noncanonical mode:
+         * - input is available immediately
+         * - no input processing is avaiable
+         */
+        TerminalSettings &set_canonical(bool to) {
+            current_.c_lflag &= to ? ICANON : ~ICANON;
+            return *this;
+        }
+
+        /** Ctrl-S and Ctrl-Q pause and resume the output
+         *
+         * It has to be disabled, so the keys reach the application.
+         */
+        TerminalSettings &set_flow_control(bool to) {
+            if (to) {
+                current_.c_iflag |= IXON;
+            } else {
+                current_.c_iflag &= ~IXON;
+            }
+
+            return *this;
+        }
+
+        /** Minimum number of characters for noncanonical read */
+        TerminalSettings &set_min_chars_for_non_canonical_read(size_t n) {
+            current_.c_cc[VMIN] = n;
+            return *this;
+        }
+
+        /** Timeout in deciseconds (1/10s) for noncanonical read */
+        TerminalSettings &set_timeout_for_non_canonical_read(size_t n) {
+            current_.c_cc[VTIME] = n;
+            return *this;
+        }
+
+        /** When any of INTR (ctrl+c), QUIT (ctrl+q), SUSP (ctrl+z) are received,
+         * generate correspending signal
+         */
+        TerminalSettings &set_ctrlc_ctrlz_as_characters(bool to) {
+            current_.c_lflag &= to ? ~ISIG : ISIG;
+            return *this;
+        }
+
+        /** Set implementation-defined output processing
+         *
+         *  If OPOST is set output characters are post-processed as indicated by
+         *  the remaining flags otherwise characters are transmitted without change.
+         **/
+        TerminalSettings &set_output_processing(bool to) {
+            current_.c_oflag &= to ? ~OPOST : OPOST;
+            return *this;
+        }
+
+};
+
+/** This class represents software terminal
+ *
+ * It provides functions like moving the cursor and graphics rendering
+ */
+class Terminal {
+    private:
+        TerminalSettings settings_;
+
+        TerminalCapabilities capabilities_{};
+
+        /** Output file descriptor, used when no output stream is set */
+        int fd_{STDOUT_FILENO};
+
+        /** The descriptor is a socket, it's written without SIGPIPE */
+        bool socket_{false};
+
+        /** Transforms the output before it's written, e.g. to encode a protocol */
+        std::function<void(std::string &)> output_filter_{};
+
+        /** Takes the output instead of the descriptor, e.g. to queue it for asynchronous writes */
+        std::function<void(std::string &)> output_sink_{};
+
+        /** Output stream */
+        std::ostream *stream_{nullptr};
+
+        /** Output which wasn't flushed yet */
+        std::string pending_{};
+
+        /** Width of the terminal */
+        size_t columns_{80};
+
+        /** Width was set explicitly, don't query it */
+        bool fixed_columns_{false};
+
+        /** Settings were applied, so they have to be reset */
+        bool settings_applied_{false};
+
+        /** Settings were applied before the terminal was suspended */
+        bool resume_settings_{false};
+
+        /** Keyboard flags pushed to the terminal's stack */
+        std::vector<KeyboardFlags> keyboard_flags_{};
+
+        /** Largest text passed to the clipboard, see `default_clipboard_limit` */
+        size_t clipboard_limit_{default_clipboard_limit()};
+
+        /** Bytes of the clipboard text encoded at once */
+        static constexpr size_t clipboard_chunk_ = 48 << 10;
+
+        /** Capacity of the output kept between flushes, a larger one is released */
+        static constexpr size_t retained_output_ = 64 << 10;
+
+    public:
+        size_t memory_usage() const {
+            return MemoryUsage::of(pending_) + MemoryUsage::of(keyboard_flags_);
+        }
+
+        /** Flush the output and free its buffer */
+        void release() {
+            flush();
+            std::string{}.swap(pending_);
+        }
+
+    private:
+        /** Writes control sequence to the output
+         *
+         * It's expected that terminal will read it and interpret the sequence
+         */
+        void write_sequence(const std::string &sequence) {
+            pending_ += sequence;
+        }
+
+        void write_to_fd(const char *data, size_t size) {
+            while (size) {
+                // a closed connection is reported as EPIPE instead of killing the process
+                ssize_t written = socket_ ? ::send(fd_, data, size, MSG_NOSIGNAL) : ::write(fd_, data, size);
+
+                if (written == -1 && errno == EINTR) {
+                    continue;
+                }
+
+                if (written == -1) {
+                    throw std::system_error{errno, std::generic_category()};
+                }
+
+                data += written;
+                size -= written;
+            }
+        }
+
+    public:
+
+        Terminal() {}
+
+        Terminal(const TerminalSettings &settings): settings_{settings} {}
+        Terminal(const Terminal &t): settings_{t.settings_},
+                                     capabilities_{t.capabilities_},
+                                     fd_{t.fd_},
+                                     socket_{t.socket_},
+                                     output_filter_{t.output_filter_},
+                                     output_sink_{t.output_sink_},
+                                     stream_{t.stream_},
+                                     columns_{t.columns_},
+                                     fixed_columns_{t.fixed_columns_},
+                                     clipboard_limit_{t.clipboard_limit_} {}
+
+        /** Writes text to the output */
+        void write(std::string_view text) {
+            pending_.append(text);
+        }
+
+        /** Largest clipboard text the terminal accepts
+         *
+         * Terminals drop longer OSC 52 sequences: xterm limits the encoded
+         * data, screen and tmux their buffers. Kitty accepts any size.
+         */
+        static size_t default_clipboard_limit() {
+            const char *term = std::getenv("TERM");
+            const std::string_view name{term ? term : ""};
+
+            if (name == "xterm-kitty") {
+                return std::numeric_limits<size_t>::max();
+            }
+
+            if (name.substr(0, 6) == "screen" || name.substr(0, 4) == "tmux") {
+                return 768 << 10;
+            }
+
+            return 74994;
+        }
+
+        void set_clipboard_limit(size_t limit) {
+            clipboard_limit_ = limit;
+        }
+
+        /** Put the text to the system clipboard using OSC 52
+         *
+         * The text is encoded and written in bounded chunks, so no copy of
+         * the whole encoded text is made. Text over the limit isn't copied
+         * at all, it would be truncated by the terminal.
+         */
+        bool copy_to_clipboard(std::string_view text) {
+            if (text.size() > clipboard_limit_) {
+                return false;
+            }
+
+            write_sequence(ControlSequences::SetClipboard);
+
+            while (!text.empty()) {
+                const auto chunk = text.substr(0, clipboard_chunk_);
+                const auto size = pending_.size();
+
+                pending_.resize(size + Base64::encoded_size(chunk.size()));
+                Base64::encode(chunk, pending_.data() + size);
+                text.remove_prefix(chunk.size());
+
+                if (!text.empty()) {
+                    flush();
+                }
+            }
+
+            write_sequence(ControlSequences::StringTerminator);
+            flush();
+            return true;
+        }
+
+        /** Writes all pending output in one go
+         *
+         * Everything written since the last flush reaches the terminal
+         * at once, so a redraw costs a single write.
+         */
+        void flush() {
+            if (pending_.empty()) {
+                return;
+            }
+
+            READLINE_PROBE(terminal_flush, pending_.size());
+            TraceSpan span{"terminal_flush", pending_.size()};
+
+            if (output_filter_) {
+                output_filter_(pending_);
+            }
+
+            if (stream_) {
+                stream_->write(pending_.data(), pending_.size());
+                stream_->flush();
+            } else if (output_sink_) {
+                output_sink_(pending_);
+            } else {
+                write_to_fd(pending_.data(), pending_.size());
+            }
+
+            if (pending_.capacity() > retained_output_) {
+                std::string{}.swap(pending_);
+            } else {
+                pending_.clear();
+            }
+        }
+
+        void set_output_fd(int fd) {
+            struct stat st;
+
+            fd_ = fd;
+            socket_ = fstat(fd, &st) == 0 && S_ISSOCK(st.st_mode);
+            stream_ = nullptr;
+        }
+
+        template <typename F>
+        void set_output_filter(F &&f) {
+            output_filter_ = f;
+        }
+
+        /** The sink may take the output by swapping the string */
+        template <typename F>
+        void set_output_sink(F &&f) {
+            output_sink_ = f;
+        }
+
+        void set_output_stream(std::ostream &os) {
+            stream_ = &os;
+        }
+
+        /** Number of columns, see `update_size` */
+        size_t columns() const {
+            return columns_;
+        }
+
+        void set_columns(size_t n) {
+            columns_ = n;
+            fixed_columns_ = true;
+        }
+
+        /** Query the window size of the terminal */
+        void update_size() {
+            winsize size{};
+
+            if (!fixed_columns_ && !stream_ && ioctl(fd_, TIOCGWINSZ, &size) == 0 && size.ws_col) {
+                columns_ = size.ws_col;
+            }
+        }
+
+        /** Moves cursor one cell to the right */
+        void move_cursor_forward() {
+            return move_cursor_forward(1);
+        }
+
+        /** Moves cursor n cells to the right */
+        void move_cursor_forward(size_t n) {
+            auto sequence{ControlSequences::MoveCursorForward};
+            sequence.replace(sequence.find("{N}"s), 3, std::to_string(n));
+
+            write_sequence(sequence);
+        }
+
+        /** Moves cursor one cell to the left */
+        void move_cursor_backward() {
+            move_cursor_backward(1);
+        }
+
+        /** Moves cursor n cells to the left */
+        void move_cursor_backward(size_t n) {
+            auto sequence{ControlSequences::MoveCursorBackward};
+            sequence.replace(sequence.find("{N}"s), 3, std::to_string(n));
+
+            write_sequence(sequence);
+        }
+
+        /** Report a command which failed */
+        void ring_bell() {
+            write_sequence(ControlSequences::Bell);
+        }
+
+        /** Clear the entire screen */
+        void clear_the_screen() {
+            write_sequence(ControlSequences::ClearTheScreen);
+        }
+
+        /** Reverse graphics using graphic rendetion */
+        void reverse_graphics() {
+
+            auto sequence{ControlSequences::SetGraphicRendition};
+            auto param = static_cast<int>(SelectGraphicRendition::Reverse);
+
+            sequence.replace(sequence.find("{}"s), 2, std::to_string(param));
+            write_sequence(sequence);
+        }
+
+        /** Unset all graphic rendition attributes */
+        void normal_graphics() {
+
+            auto sequence{ControlSequences::SetGraphicRendition};
+            auto param = static_cast<int>(SelectGraphicRendition::Normal);
+
+            sequence.replace(sequence.find("{}"s), 2, std::to_string(param));
+            write_sequence(sequence);
+        }
+
+        /** Clear the line from the cursor to the end of the line */
+        void clear_the_line() {
+            write_sequence(ControlSequences::ClearTheLine);
+        }
+
+        /** Move cursor to the begining of the current line */
+        void move_cursor_horizontal_absolute() {
+            move_cursor_horizontal_absolute(0);
+        }
+
+        /** Move cursor to the nth position of the current line */
+        void move_cursor_horizontal_absolute(size_t n) {
+            auto sequence{ControlSequences::MoveCursorHorizonalAbsolute};
+            sequence.replace(sequence.find("{N}"s), 3, std::to_string(n));
+
+            write_sequence(sequence);
+        }
+
+        /** Send all capability queries at once
+         *
+         * Replies are parsed by `TerminalCapabilitiesReader`. The last query
+         * is DA1, which every terminal answers, so its reply terminates the
+         * probe. The ambiguous-width test prints a character and asks for
+         * the cursor position, the line is cleared afterwards.
+         */
+        void query_capabilities() {
+            auto request_mode = [](PrivateMode mode) {
+                auto sequence{ControlSequences::RequestPrivateMode};
+                sequence.replace(sequence.find("{N}"s), 3, std::to_string(static_cast<int>(mode)));
+                return sequence;
+            };
+
+            write_sequence(request_mode(PrivateMode::SynchronizedOutput) +
+                           request_mode(PrivateMode::BracketedPaste) +
+                           ControlSequences::RequestKeyboardFlags +
+                           "\r\u00a7"s + ControlSequences::RequestCursorPosition +
+                           "\r"s + ControlSequences::ClearTheLine +
+                           ControlSequences::RequestDeviceAttributes);
+            flush();
+        }
+
+        const TerminalCapabilities &capabilities() const {
+            return capabilities_;
+        }
+
+        /** Enable keyboard protocol enhancements, previous flags are saved on a stack */
+        void push_keyboard_flags(KeyboardFlags flags) {
+            auto sequence{ControlSequences::PushKeyboardFlags};
+            sequence.replace(sequence.find("{N}"s), 3, std::to_string(static_cast<int>(flags)));
+
+            write_sequence(sequence);
+            keyboard_flags_.push_back(flags);
+        }
+
+        /** Restore keyboard flags saved by `push_keyboard_flags` */
+        void pop_keyboard_flags() {
+            write_sequence(ControlSequences::PopKeyboardFlags);
+
+            if (!keyboard_flags_.empty()) {
+                keyboard_flags_.pop_back();
+            }
+        }
+
+        /** Hand the terminal over to another program
+         *
+         * Only what was changed is restored, so nothing is switched twice.
+         */
+        void suspend() {
+            for (size_t i = 0; i < keyboard_flags_.size(); i++) {
+                write_sequence(ControlSequences::PopKeyboardFlags);
+            }
+
+            flush();
+
+            resume_settings_ = settings_applied_;
+            reset_settings();
+        }
+
+        /** Take the terminal back after `suspend` */
+        void resume() {
+            if (resume_settings_) {
+                apply_settings();
+            }
+
+            for (auto flags: keyboard_flags_) {
+                auto sequence{ControlSequences::PushKeyboardFlags};
+                sequence.replace(sequence.find("{N}"s), 3, std::to_string(static_cast<int>(flags)));
+                write_sequence(sequence);
+            }
+
+            flush();
+        }
+
+        void set_capabilities(const TerminalCapabilities &c) {
+            capabilities_ = c;
+        }
+
+        void set_settings(const TerminalSettings &s) {
+            settings_ = s;
+        }
+
+        void apply_settings() {
+            settings_.apply();
+            settings_applied_ = true;
+        }
+
+        void reset_settings() {
+            if (settings_applied_) {
+                settings_.reset();
+                settings_applied_ = false;
+            }
+        }
+
+        /** Settings, capabilities, width and keyboard flags, the terminal isn't touched */
+        void save_state(SessionState &state) const {
+            std::ostringstream capabilities;
+            capabilities_.serialize(capabilities);
+
+            settings_.save_state(state);
+            state.put_number(settings_applied_);
+            state.put_text(capabilities.str());
+            state.put_number(fixed_columns_ ? columns_ : 0);
+            state.put_number(keyboard_flags_.size());
+
+            for (auto flags: keyboard_flags_) {
+                state.put_number(static_cast<size_t>(flags));
+            }
+        }
+
+        /** The terminal is expected to be in the saved state, nothing is written to it */
+        void load_state(SessionState &state) {
+            settings_.load_state(state);
+            settings_applied_ = state.number();
+
+            std::istringstream capabilities{std::string{state.text()}};
+            capabilities_ = TerminalCapabilities::deserialize(capabilities);
+
+            if (auto columns = state.number()) {
+                set_columns(columns);
+            }
+
+            keyboard_flags_.resize(state.count());
+
+            for (auto &flags: keyboard_flags_) {
+                flags = static_cast<KeyboardFlags>(state.number());
+            }
+        }
+
+        /** Leave the terminal as it is, another process took it over */
+        void detach() {
+            flush();
+            settings_applied_ = false;
+            keyboard_flags_.clear();
+        }
+};
+
+/** This class represents storage of inputs */
+class History {
+    /** File where should be history persisted */
+    std::shared_ptr<std::ostream> history_file_{};
+
+    /** Path of the file set by `set_file`, the file is rewritten by `save` */
+    std::filesystem::path history_path_{};
+
+    /** Maximum input entries */
+    size_t max_entries_{1024};
+
+    /** Stored input entries */
+    std::vector<std::string> entries_{};
+
+    /** Entries are stored one per line, so line breaks of statements are escaped */
+    static std::string escape(std::string_view line) {
+        std::string escaped;
+        escaped.reserve(line.size());
+
+        for (char ch: line) {
+            if (ch == '\\' || ch == '\n') {
+                escaped.push_back('\\');
+            }
+
+            escaped.push_back(ch == '\n' ? 'n' : ch);
+        }
+
+        return escaped;
+    }
+
+    static std::string unescape(std::string_view line) {
+        std::string unescaped;
+        unescaped.reserve(line.size());
+
+        for (size_t i = 0; i < line.size(); i++) {
+            if (line[i] == '\\' && i + 1 < line.size()) {
+                unescaped.push_back(line[++i] == 'n' ? '\n' : line[i]);
+            } else {
+                unescaped.push_back(line[i]);
+            }
+        }
+
+        return unescaped;
+    }
+
+    void push(std::string line) {
+        // the oldest entry is dropped first, so the capacity doesn't grow over the limit
+        if (entries_.size() >= max_entries_) {
+            entries_.erase(entries_.begin());
+        }
+
+        entries_.push_back(std::move(line));
+    }
+
+    void write_to_file() {
+        READLINE_PROBE(history_write, entries_.size());
+        TraceSpan span{"history_write", entries_.size()};
+
+        for (auto &entry: entries_) {
+            *history_file_ << escape(entry) << '\n';
+        }
+
+        history_file_->flush();
+    }
+
+public:
+
+    std::string get_line(const size_t n) const {
+        return entries_.at(n);
+    }
+
+    void add_line(const std::string &line) {
+        READLINE_PROBE(history_add, line.size());
+        TraceRecorder::instant("history_add", line.size());
+
+        push(line);
+
+        if (history_file_) {
+            *history_file_ << escape(line) << '\n';
+            history_file_->flush();
+        }
+    }
+
+    /** Load entries from the file and append new ones to it
+     *
+     * Every entry is appended when it's added, so nothing is lost when the
+     * program is killed. The file is rewritten when it's over twice the
+     * maximum entries.
+     */
+    void set_file(const std::filesystem::path &path) {
+        std::ifstream file{path};
+        size_t lines = 0;
+
+        entries_.clear();
+
+        for (std::string line; std::getline(file, line); lines++) {
+            push(unescape(line));
+        }
+
+        history_path_ = path;
+
+        if (lines > 2 * max_entries_) {
+            save();
+        } else {
+            history_file_ = std::make_shared<std::ofstream>(path, std::ios::app);
+        }
+    }
+
+    size_t size() const {
+        return entries_.size();
+    }
+
+    bool empty() const {
+        return !size();
+    }
+
+    size_t memory_usage() const {
+        size_t bytes = MemoryUsage::of(entries_);
+
+        for (auto &entry: entries_) {
+            bytes += MemoryUsage::of(entry);
+        }
+
+        return bytes;
+    }
+
+    void save_state(SessionState &state) const {
+        state.put_number(entries_.size());
+
+        for (auto &entry: entries_) {
+            state.put_text(entry);
+        }
+    }
+
+    void load_state(SessionState &state) {
+        entries_.resize(state.count());
+
+        for (auto &entry: entries_) {
+            entry = state.text();
+        }
+    }
+
+    /** Free the entries, they are expected to be saved */
+    void release() {
+        std::vector<std::string>{}.swap(entries_);
+    }
+
+    /** Write all entries, the file set by `set_file` is rewritten */
+    void save() {
+        if (!history_path_.empty()) {
+            history_file_ = std::make_shared<std::ofstream>(history_path_, std::ios::trunc);
+            write_to_file();
+            history_file_ = std::make_shared<std::ofstream>(history_path_, std::ios::app);
+            return;
+        }
+
+        if (history_file_) {
+            write_to_file();
+        }
+    }
+};
+
+class HistoryView {
+    History history_;
+    size_t current_line_{0};
+
+public:
+
+    void add_line(const std::string &line) {
+        const size_t current_size = history_.size();
+        history_.add_line(line);
+        if (current_size < history_.size()) {
+            current_line_++;
+        }
+
+    }
+
+    void reset_position() {
+        current_line_ = history_.size();
+    }
+
+    void set_file(const std::filesystem::path &path) {
+        history_.set_file(path);
+        reset_position();
+    }
+
+    size_t size() const {
+        return history_.size();
+    }
+
+    bool empty() const {
+        return !size();
+    }
+
+    size_t memory_usage() const {
+        return history_.memory_usage();
+    }
+
+    void save_state(SessionState &state) const {
+        history_.save_state(state);
+        state.put_number(current_line_);
+    }
+
+    void load_state(SessionState &state) {
+        history_.load_state(state);
+        current_line_ = std::min(state.number(), history_.size());
+    }
+
+    void release() {
+        history_.release();
+    }
+
+    const std::string previous() {
+
+        if (history_.empty()) {
+            return "";
+        }
+
+        if (current_line_) {
+            current_line_--;
+            return history_.get_line(current_line_);
+        } else {
+            return history_.get_line(0);
+        }
+
+    }
+
+    const std::string next() {
+
+        if (history_.empty()) {
+            return "";
+        }
+
+        if (current_line_ < history_.size()) {
+            return history_.get_line(current_line_++);
+        }
+
+        return ""; //history_.get_line(history_.size() - 1);
+    }
+};
+
+/** This class describes how the rendered prompt occupies the terminal
+ *
+ * Escape sequences (SGR colors, OSC titles, ...) and text between
+ * `\001` and `\002` markers don't occupy any cells, UTF-8 text is
+ * measured in cells rather than bytes.
+ */
+struct PromptLayout {
+
+    struct Segment {
+        /** Offset of the segment in the text */
+        size_t offset;
+        size_t length;
+        /** Segment is invisible */
+        bool escape;
+    };
+
+    /** String returned by the prompter */
+    std::string source{};
+
+    /** Text written to the terminal, `\001` and `\002` markers are stripped */
+    std::string text{};
+
+    /** Width of the last row, the buffer starts right after it */
+    size_t width{0};
+
+    size_t rows{1};
+
+    std::vector<Segment> segments{};
+
+    static PromptLayout parse(std::string source) {
+        PromptLayout layout{};
+        const std::string_view s{source};
+
+        auto add_segment = [&](std::string_view part, bool escape) {
+            if (part.empty()) {
+                return;
+            }
+
+            layout.segments.push_back({layout.text.size(), part.size(), escape});
+            layout.text.append(part);
+
+            if (escape) {
+                return;
+            }
+
+            for (size_t pos = 0, row = 0; pos <= part.size(); pos = row + 1) {
+                row = std::min(part.find('\n', pos), part.size());
+                layout.width += Utf8::width(part.substr(pos, row - pos));
+
+                if (row < part.size()) {
+                    layout.rows++;
+                    layout.width = 0;
+                }
+            }
+        };
+
+        size_t text_begin = 0, pos = 0;
+
+        while (pos < s.size()) {
+            size_t end = pos;
+
+            if (s[pos] == '\001') {
+                // readline compatible markers of invisible text
+                end = std::min(s.find('\002', pos), s.size());
+                add_segment(s.substr(text_begin, pos - text_begin), false);
+                add_segment(s.substr(pos + 1, end - pos - 1), true);
+                pos = text_begin = std::min(end + 1, s.size());
+                continue;
+            }
+
+            if (s[pos] != '\x1b' || pos + 1 == s.size()) {
+                pos++;
+                continue;
+            }
+
+            if (s[pos + 1] == '[') {
+                // CSI: parameters, intermediates and the final byte
+                end = pos + 2;
+                while (end < s.size() && (s[end] < 0x40 || s[end] > 0x7e)) {
+                    end++;
+                }
+                end = std::min(end + 1, s.size());
+            } else if (s[pos + 1] == ']') {
+                // OSC: terminated by BEL or ST
+                end = pos + 2;
+                while (end < s.size() && s[end] != '\a' && !(s[end] == '\x1b' && end + 1 < s.size() && s[end + 1] == '\\')) {
+                    end++;
+                }
+                end = std::min(end + (end < s.size() && s[end] == '\x1b' ? 2 : 1), s.size());
+            } else {
+                end = pos + 2;
+            }
+
+            add_segment(s.substr(text_begin, pos - text_begin), false);
+            add_segment(s.substr(pos, end - pos), true);
+            pos = text_begin = end;
+        }
+
+        add_segment(s.substr(text_begin), false);
+        layout.source = std::move(source);
+
+        return layout;
+    }
+};
+
+class Prompt {
+    std::function<std::string(void)> prompter_{};
+    PromptLayout layout_{};
+public:
+
+    void set_prompt(decltype(prompter_) p) {
+        prompter_ = p;
+    }
+
+    /** Render the prompt, the layout is reused when the prompt is unchanged */
+    const std::string &operator() () {
+        auto prompt = prompter_();
+
+        if (prompt != layout_.source) {
+            layout_ = PromptLayout::parse(std::move(prompt));
+        }
+
+        return layout_.text;
+    }
+
+    const PromptLayout &layout() const {
+        return layout_;
+    }
+
+    /** Number of cells occupied by the last row of the prompt */
+    size_t width() const {
+        return layout_.width;
+    }
+
+    operator bool () const {
+        return static_cast<bool>(prompter_);
+    }
+};
+
+/** Byte and substring search over UTF-8 text
+ *
+ * The text is scanned 16 bytes at a time. Substrings are found by
+ * comparing the first and the last byte of the needle at every position of
+ * the block at once and verifying only the candidates.
+ */
+struct TextSearch {
+
+    static constexpr auto npos = std::string_view::npos;
+
+    /** Position of the first byte at or after `from` */
+    static size_t find(std::string_view s, char ch, size_t from = 0) {
+        size_t pos = from;
+
+#ifdef __SSE2__
+        const auto needle = _mm_set1_epi8(ch);
+
+        for (; pos + 16 <= s.size(); pos += 16) {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + pos));
+
+            if (int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle))) {
+                return pos + __builtin_ctz(mask);
+            }
+        }
+#endif
+
+        for (; pos < s.size(); pos++) {
+            if (s[pos] == ch) {
+                return pos;
+            }
+        }
+
+        return npos;
+    }
+
+    /** Position of the last byte before `before` */
+    static size_t rfind(std::string_view s, char ch, size_t before = npos) {
+        size_t end = std::min(before, s.size());
+
+#ifdef __SSE2__
+        const auto needle = _mm_set1_epi8(ch);
+
+        for (; end >= 16; end -= 16) {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + end - 16));
+
+            if (int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle))) {
+                return end - 16 + 31 - __builtin_clz(mask);
+            }
+        }
+#endif
+
+        while (end--) {
+            if (s[end] == ch) {
+                return end;
+            }
+        }
+
+        return npos;
+    }
+
+    /** Position of the first occurrence starting at or after `from` */
+    static size_t find(std::string_view s, std::string_view needle, size_t from = 0) {
+        if (needle.size() <= 1) {
+            return needle.empty() ? (from <= s.size() ? from : npos) : find(s, needle[0], from);
+        }
+
+        if (needle.size() > s.size()) {
+            return npos;
+        }
+
+        // the last position where the needle fits
+        const auto last = s.size() - needle.size();
+        size_t pos = from;
+
+#ifdef __SSE2__
+        const auto first_byte = _mm_set1_epi8(needle.front());
+        const auto last_byte = _mm_set1_epi8(needle.back());
+
+        for (; pos + 16 <= last + 1; pos += 16) {
+            const auto begins = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + pos));
+            const auto ends = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + pos + needle.size() - 1));
+            auto mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(begins, first_byte),
+                                                        _mm_cmpeq_epi8(ends, last_byte)));
+
+            for (; mask; mask &= mask - 1) {
+                const auto candidate = pos + __builtin_ctz(mask);
+
+                if (matches(s, needle, candidate)) {
+                    return candidate;
+                }
+            }
+        }
+#endif
+
+        for (; pos <= last; pos++) {
+            if (s[pos] == needle.front() && matches(s, needle, pos)) {
+                return pos;
+            }
+        }
+
+        return npos;
+    }
+
+    /** Position of the last occurrence starting before `before` */
+    static size_t rfind(std::string_view s, std::string_view needle, size_t before = npos) {
+        if (needle.size() <= 1) {
+            return needle.empty() ? (before ? std::min(before - 1, s.size()) : npos) : rfind(s, needle[0], before);
+        }
+
+        if (needle.size() > s.size()) {
+            return npos;
+        }
+
+        // candidates are the positions in [0, end)
+        size_t end = std::min(before, s.size() - needle.size() + 1);
+
+#ifdef __SSE2__
+        const auto first_byte = _mm_set1_epi8(needle.front());
+        const auto last_byte = _mm_set1_epi8(needle.back());
+
+        for (; end >= 16; end -= 16) {
+            const auto pos = end - 16;
+            const auto begins = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + pos));
+            const auto ends = _mm_loadu_si128(reinterpret_cast<const __m128i *>(s.data() + pos + needle.size() - 1));
+            auto mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(begins, first_byte),
+                                                        _mm_cmpeq_epi8(ends, last_byte)));
+
+            while (mask) {
+                const auto bit = 31 - __builtin_clz(mask);
+
+                if (matches(s, needle, pos + bit)) {
+                    return pos + bit;
+                }
+
+                mask &= ~(1 << bit);
+            }
+        }
+#endif
+
+        while (end--) {
+            if (s[end] == needle.front() && matches(s, needle, end)) {
+                return end;
+            }
+        }
+
+        return npos;
+    }
+
+private:
+    static bool matches(std::string_view s, std::string_view needle, size_t pos) {
+        return std::memcmp(s.data() + pos, needle.data(), needle.size()) == 0;
+    }
+};
+
+enum class LetterCase {
+    Upper,
+    Lower,
+};
+
+/** Case conversion of UTF-8 text in place
+ *
+ * ASCII is converted 16 bytes at a time, other characters are decoded and
+ * mapped one by one. Characters whose converted form has a different
+ * encoded length are left unchanged and reported to the caller.
+ */
+struct CaseConversion {
+
+    static char32_t convert(char32_t cp, LetterCase to) {
+        const bool upper = to == LetterCase::Upper;
+
+        if (cp < 0x80) {
+            if (upper && cp >= 'a' && cp <= 'z') {
+                return cp - 0x20;
+            }
+            if (!upper && cp >= 'A' && cp <= 'Z') {
+                return cp + 0x20;
+            }
+            return cp;
+        }
+
+        // latin-1, greek and cyrillic letters differ by a constant offset
+        if (upper) {
+            if ((cp >= 0xe0 && cp <= 0xfe && cp != 0xf7) || (cp >= 0x3b1 && cp <= 0x3c9 && cp != 0x3c2) ||
+                (cp >= 0x430 && cp <= 0x44f)) {
+                return cp - 0x20;
+            }
+            if (cp >= 0x450 && cp <= 0x45f) {
+                return cp - 0x50;
+            }
+        } else {
+            if ((cp >= 0xc0 && cp <= 0xde && cp != 0xd7) || (cp >= 0x391 && cp <= 0x3a9 && cp != 0x3a2) ||
+                (cp >= 0x410 && cp <= 0x42f)) {
+                return cp + 0x20;
+            }
+            if (cp >= 0x400 && cp <= 0x40f) {
+                return cp + 0x50;
+            }
+        }
+
+        // letters which don't fit the rules below, e.g. dotted and dotless i inside the pairs
+        switch (cp) {
+            case 0xff:
+                return upper ? 0x178 : cp;
+            case 0x178:
+                return upper ? cp : 0xff;
+            case 0x130:
+                return upper ? cp : 'i';
+            case 0x131:
+                return upper ? 'I' : cp;
+            case 0x17f:
+                return upper ? 'S' : cp;
+            case 0x3c2:
+                return upper ? 0x3a3 : cp;
+        }
+
+        // latin extended-a letters are pairs of adjacent codepoints, the parity of the capital differs by blocks
+        if (cp >= 0x100 && cp <= 0x17f) {
+            const bool even_capital = (cp >= 0x100 && cp <= 0x137) || (cp >= 0x14a && cp <= 0x177);
+            const bool odd_capital = (cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17e);
+
+            if (even_capital || odd_capital) {
+                const bool capital = (cp % 2 == 0) == even_capital;
+                return capital == upper ? cp : upper ? cp - 1 : cp + 1;
+            }
+        }
+
+        // the rest is left to the C library and the current locale
+        return upper ? std::towupper(cp) : std::towlower(cp);
+    }
+
+    /** Convert ASCII bytes, other bytes are unchanged */
+    static void convert_ascii(char *data, size_t size, LetterCase to) {
+        const char first = to == LetterCase::Upper ? 'a' : 'A';
+        size_t pos = 0;
+
+#ifdef __SSE2__
+        // letters are shifted to the bottom of the signed range and compared at once
+        const auto shift = _mm_set1_epi8(static_cast<char>(0x80 - first));
+        const auto limit = _mm_set1_epi8(static_cast<char>(-128 + 26));
+        const auto flip = _mm_set1_epi8(0x20);
+
+        for (; pos + 16 <= size; pos += 16) {
+            auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + pos));
+            auto letters = _mm_cmplt_epi8(_mm_add_epi8(chunk, shift), limit);
+
+            chunk = _mm_xor_si128(chunk, _mm_and_si128(letters, flip));
+            _mm_storeu_si128(reinterpret_cast<__m128i *>(data + pos), chunk);
+        }
+#endif
+
+        for (; pos < size; pos++) {
+            if (static_cast<unsigned char>(data[pos] - first) < 26) {
+                data[pos] ^= 0x20;
+            }
+        }
+    }
+
+    /** Convert text in place
+     *
+     * Returns false when some characters couldn't be converted in place.
+     */
+    static bool convert(char *data, size_t size, LetterCase to) {
+        const std::string_view text{data, size};
+        bool in_place = true;
+
+        for (size_t pos = 0; pos < size;) {
+            const auto ascii = Utf8::ascii_prefix(text.substr(pos));
+            convert_ascii(data + pos, ascii, to);
+            pos += ascii;
+
+            if (pos == size) {
+                break;
+            }
+
+            const auto begin = pos;
+            const auto converted = Utf8::encode(convert(Utf8::decode(text, pos), to));
+
+            if (converted.size() == pos - begin) {
+                std::memcpy(data + begin, converted.data(), converted.size());
+            } else {
+                in_place = false;
+            }
+        }
+
+        return in_place;
+    }
+};
+
+/** This class is a contiguous storage of the buffer contents
+ *
+ * The content is kept in memory until it grows over the memory limit,
+ * then it's moved to an unlinked temporary file which is mapped into
+ * memory. Pages far from the cursor are released from the mapping, the
+ * kernel reads them back from the file when they are accessed again.
+ */
+class BufferStorage {
+    /** Content while it fits into the memory limit */
+    std::string memory_{};
+
+    /** Spill file and its mapping */
+    int fd_{-1};
+    char *mapping_{nullptr};
+    size_t capacity_{0};
+    size_t size_{0};
+
+    size_t memory_limit_{64 << 20};
+
+    /** Range which was kept resident by the last `keep_resident` */
+    size_t resident_begin_{0};
+    size_t resident_end_{0};
+
+    static int open_spill_file() {
+        const char *tmpdir = std::getenv("TMPDIR");
+        const std::string directory{tmpdir && *tmpdir ? tmpdir : "/tmp"};
+
+#ifdef O_TMPFILE
+        if (int fd = open(directory.c_str(), O_TMPFILE | O_RDWR | O_EXCL | O_CLOEXEC, 0600); fd != -1) {
+            return fd;
+        }
+#endif
+
+        std::string path{directory + "/readline-XXXXXX"};
+
+        if (int fd = mkstemp(path.data()); fd != -1) {
+            unlink(path.c_str());
+            return fd;
+        }
+
+        throw std::system_error{errno, std::generic_category()};
+    }
+
+    void map(size_t capacity) {
+        if (ftruncate(fd_, capacity) == -1) {
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        if (mapping_) {
+            munmap(mapping_, capacity_);
+        }
+
+        void *mapping = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd_, 0);
+
+        if (mapping == MAP_FAILED) {
+            mapping_ = nullptr;
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        mapping_ = static_cast<char *>(mapping);
+        capacity_ = capacity;
+
+        // the new mapping has nothing released yet
+        resident_begin_ = resident_end_ = 0;
+    }
+
+    void spill(size_t required) {
+        fd_ = open_spill_file();
+        map(std::max(required, memory_.size()) * 2);
+
+        std::memcpy(mapping_, memory_.data(), memory_.size());
+        size_ = memory_.size();
+        std::string{}.swap(memory_);
+    }
+
+    void unspill() {
+        memory_.assign(mapping_, size_);
+
+        munmap(mapping_, capacity_);
+        close(fd_);
+
+        fd_ = -1;
+        mapping_ = nullptr;
+        capacity_ = size_ = 0;
+        resident_begin_ = resident_end_ = 0;
+    }
+
+    void reserve(size_t required) {
+        if (!spilled() && required > memory_limit_) {
+            spill(required);
+        } else if (spilled() && required > capacity_) {
+            map(required * 2);
+        }
+    }
+
+public:
+    BufferStorage() {}
+
+    BufferStorage(const BufferStorage &s): memory_limit_{s.memory_limit_} {
+        assign(s.view());
+    }
+
+    BufferStorage &operator=(const BufferStorage &s) {
+        memory_limit_ = s.memory_limit_;
+        assign(s.view());
+        return *this;
+    }
+
+    ~BufferStorage() {
+        if (spilled()) {
+            munmap(mapping_, capacity_);
+            close(fd_);
+        }
+    }
+
+    /** Content is stored in the spill file */
+    bool spilled() const {
+        return fd_ != -1;
+    }
+
+    void set_memory_limit(size_t limit) {
+        memory_limit_ = limit;
+    }
+
+    size_t memory_limit() const {
+        return memory_limit_;
+    }
+
+    char *data() {
+        return spilled() ? mapping_ : memory_.data();
+    }
+
+    const char *data() const {
+        return spilled() ? mapping_ : memory_.data();
+    }
+
+    size_t size() const {
+        return spilled() ? size_ : memory_.size();
+    }
+
+    /** Memory on the heap, the spill file is mapped */
+    size_t memory_usage() const {
+        return MemoryUsage::of(memory_);
+    }
+
+    /** Clear the content and free the memory */
+    void release() {
+        clear();
+        std::string{}.swap(memory_);
+    }
+
+    std::string_view view() const {
+        return {data(), size()};
+    }
+
+    void insert(size_t pos, std::string_view s) {
+        reserve(size() + s.size());
+
+        if (!spilled()) {
+            memory_.insert(pos, s);
+            return;
+        }
+
+        std::memmove(mapping_ + pos + s.size(), mapping_ + pos, size_ - pos);
+        std::memcpy(mapping_ + pos, s.data(), s.size());
+        size_ += s.size();
+    }
+
+    void erase(size_t pos, size_t n) {
+        if (!spilled()) {
+            memory_.erase(pos, n);
+            return;
+        }
+
+        std::memmove(mapping_ + pos, mapping_ + pos + n, size_ - pos - n);
+        size_ -= n;
+
+        if (size_ < memory_limit_ / 2) {
+            unspill();
+            return;
+        }
+
+        // pages after the end hold only stale content, they are freed even from a file in memory like tmpfs
+        const size_t page = sysconf(_SC_PAGESIZE);
+        const size_t used = (size_ + page - 1) / page * page;
+        const size_t stale = std::min((size_ + n + page - 1) / page * page, capacity_);
+
+        if (used < stale) {
+            fallocate(fd_, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, used, stale - used);
+        }
+    }
+
+    void assign(std::string_view s) {
+        clear();
+        insert(0, s);
+    }
+
+    /** Take the contents of the file
+     *
+     * A file over the memory limit becomes the spill file and is mapped
+     * without copying, the storage owns the descriptor then. A smaller
+     * file is copied to the memory and the descriptor is closed.
+     */
+    void adopt(int fd) {
+        struct stat st;
+
+        if (fstat(fd, &st) == -1) {
+            close(fd);
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        const size_t size = st.st_size;
+        clear();
+
+        if (size > memory_limit_) {
+            fd_ = fd;
+            map(size * 2);
+            size_ = size;
+            return;
+        }
+
+        if (size) {
+            void *mapping = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+            if (mapping == MAP_FAILED) {
+                close(fd);
+                throw std::system_error{errno, std::generic_category()};
+            }
+
+            memory_.assign(static_cast<const char *>(mapping), size);
+            munmap(mapping, size);
+        }
+
+        close(fd);
+    }
+
+    void clear() {
+        if (spilled()) {
+            size_ = 0;
+            unspill();
+        }
+
+        memory_.clear();
+    }
+
+    /** Release pages of the spill file which are far from the position
+     *
+     * The resident window is recomputed only when the position leaves it,
+     * so moving around or typing doesn't cost a system call per key. The
+     * released pages are dropped from the mapping, their content stays in
+     * the file.
+     */
+    void keep_resident(size_t pos, size_t window = 1 << 20) {
+        if (!spilled() || (pos >= resident_begin_ && pos < resident_end_)) {
+            return;
+        }
+
+        const size_t page = sysconf(_SC_PAGESIZE);
+
+        resident_begin_ = pos > window ? (pos - window) / page * page : 0;
+        resident_end_ = std::min((pos + window + page - 1) / page * page, capacity_);
+
+        if (resident_begin_) {
+            madvise(mapping_, resident_begin_, MADV_DONTNEED);
+        }
+
+        if (resident_end_ < capacity_) {
+            madvise(mapping_ + resident_end_, capacity_ - resident_end_, MADV_DONTNEED);
+        }
+    }
+
+    /** Range of the spill file kept in the mapping by the last `keep_resident` */
+    std::pair<size_t, size_t> resident() const {
+        return {resident_begin_, resident_end_};
+    }
+};
+
+/** Index of brackets and quotes in the buffer
+ *
+ * The text is split into segments, each ending with a bracket or a quote,
+ * only the last segment has no token. Segments are nodes of an implicit
+ * treap which keeps the length, the nesting depth change, the minimal
+ * prefix depth and the count of quotes of every subtree. An edit touches
+ * only the segments around it and a matching token is found in O(log n).
+ *
+ * Brackets of all kinds share the nesting depth, a bracket closed by
+ * another kind, e.g. `(` by `]`, has no match. Quotes are paired in order
+ * of appearance.
+ */
+class BracketIndex {
+
+    struct Node {
+        uint32_t left{0}, right{0};
+        uint32_t priority{0};
+
+        /** Bytes before the token */
+        size_t gap{0};
+
+        /** The bracket or the quote ending the segment, `\0` for the last segment */
+        char token{'\0'};
+
+        /** Aggregates of the subtree */
+        size_t count{0};
+        size_t length{0};
+        long depth{0};
+        long min_depth{0};
+        size_t quotes[2]{0, 0};
+    };
+
+    /** Aggregates of the nodes before an index */
+    struct Prefix {
+        size_t length{0};
+        long depth{0};
+        size_t quotes[2]{0, 0};
+    };
+
+    /** Node pool, the node 0 is an empty subtree */
+    std::vector<Node> nodes_{1};
+    std::vector<uint32_t> free_{};
+    uint32_t root_{0};
+    uint32_t seed_{0x9e3779b9};
+
+    static constexpr auto npos = std::string_view::npos;
+
+    static long delta(char token) {
+        switch (token) {
+            case '(': case '[': case '{': return 1;
+            case ')': case ']': case '}': return -1;
+            default: return 0;
+        }
+    }
+
+    /** The bracket closing or opening the bracket, `\0` for quotes */
+    static char counterpart(char token) {
+        switch (token) {
+            case '(': return ')';
+            case ')': return '(';
+            case '[': return ']';
+            case ']': return '[';
+            case '{': return '}';
+            case '}': return '{';
+            default: return '\0';
+        }
+    }
+
+    /** Index of the quote kind, -1 for other tokens */
+    static int quote_kind(char token) {
+        return token == '"' ? 0 : token == '\'' ? 1 : -1;
+    }
+
+    static size_t segment_length(const Node &n) {
+        return n.gap + (n.token != '\0');
+    }
+
+    /** Position of the first token at or after `from`, 16 bytes are checked at once */
+    static size_t next_token(std::string_view text, size_t from) {
+        size_t pos = from;
+
+#ifdef __SSE2__
+        for (; pos + 16 <= text.size(); pos += 16) {
+            const auto chunk = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text.data() + pos));
+            auto found = _mm_setzero_si128();
+
+            for (auto token: tokens) {
+                found = _mm_or_si128(found, _mm_cmpeq_epi8(chunk, _mm_set1_epi8(token)));
+            }
+
+            if (int mask = _mm_movemask_epi8(found)) {
+                return pos + __builtin_ctz(mask);
+            }
+        }
+#endif
+
+        return text.find_first_of(tokens, pos);
+    }
+
+    uint32_t make(size_t gap, char token) {
+        seed_ ^= seed_ << 13;
+        seed_ ^= seed_ >> 17;
+        seed_ ^= seed_ << 5;
+
+        uint32_t t;
+
+        if (!free_.empty()) {
+            t = free_.back();
+            free_.pop_back();
+        } else {
+            t = nodes_.size();
+            nodes_.emplace_back();
+        }
+
+        nodes_[t] = {};
+        nodes_[t].priority = seed_;
+        nodes_[t].gap = gap;
+        nodes_[t].token = token;
+        update(t);
+        return t;
+    }
+
+    void release(uint32_t t) {
+        if (t) {
+            release(nodes_[t].left);
+            release(nodes_[t].right);
+            free_.push_back(t);
+        }
+    }
+
+    void update(uint32_t t) {
+        auto &n = nodes_[t];
+        const auto &l = nodes_[n.left];
+        const auto &r = nodes_[n.right];
+        const auto own = l.depth + delta(n.token);
+
+        n.count = l.count + 1 + r.count;
+        n.length = l.length + segment_length(n) + r.length;
+        n.depth = own + r.depth;
+        n.min_depth = own;
+
+        if (n.left) {
+            n.min_depth = std::min(n.min_depth, l.min_depth);
+        }
+
+        if (n.right) {
+            n.min_depth = std::min(n.min_depth, own + r.min_depth);
+        }
+
+        for (int q = 0; q < 2; q++) {
+            n.quotes[q] = l.quotes[q] + (quote_kind(n.token) == q) + r.quotes[q];
+        }
+    }
+
+    uint32_t merge(uint32_t a, uint32_t b) {
+        if (!a || !b) {
+            return a ? a : b;
+        }
+
+        if (nodes_[a].priority > nodes_[b].priority) {
+            nodes_[a].right = merge(nodes_[a].right, b);
+            update(a);
+            return a;
+        }
+
+        nodes_[b].left = merge(a, nodes_[b].left);
+        update(b);
+        return b;
+    }
+
+    /** Split the first k nodes to the left part */
+    void split(uint32_t t, size_t k, uint32_t &left, uint32_t &right) {
+        if (!t) {
+            left = right = 0;
+            return;
+        }
+
+        if (nodes_[nodes_[t].left].count < k) {
+            split(nodes_[t].right, k - nodes_[nodes_[t].left].count - 1, nodes_[t].right, right);
+            left = t;
+        } else {
+            split(nodes_[t].left, k, left, nodes_[t].left);
+            right = t;
+        }
+
+        update(t);
+    }
+
+    /** Build the treap of segments in linear time */
+    uint32_t build(std::string_view text) {
+        std::vector<uint32_t> spine;
+
+        auto push = [&](uint32_t t) {
+            uint32_t last = 0;
+
+            while (!spine.empty() && nodes_[spine.back()].priority < nodes_[t].priority) {
+                last = spine.back();
+                spine.pop_back();
+                update(last);
+            }
+
+            nodes_[t].left = last;
+
+            if (!spine.empty()) {
+                nodes_[spine.back()].right = t;
+            }
+
+            spine.push_back(t);
+        };
+
+        size_t begin = 0;
+
+        for (auto pos = next_token(text, 0); pos != npos; pos = next_token(text, pos + 1)) {
+            push(make(pos - begin, text[pos]));
+            begin = pos + 1;
+        }
+
+        push(make(text.size() - begin, '\0'));
+
+        while (spine.size() > 1) {
+            update(spine.back());
+            spine.pop_back();
+        }
+
+        update(spine.front());
+        return spine.front();
+    }
+
+    /** Index of the segment containing the position and the start of the segment */
+    std::pair<size_t, size_t> locate(size_t pos) const {
+        size_t index = 0, start = 0;
+
+        for (auto t = root_; t;) {
+            const auto &n = nodes_[t];
+            const auto &l = nodes_[n.left];
+
+            if (pos < l.length) {
+                t = n.left;
+                continue;
+            }
+
+            pos -= l.length;
+            index += l.count;
+            start += l.length;
+
+            if (pos < segment_length(n) || !n.token) {
+                return {index, start};
+            }
+
+            pos -= segment_length(n);
+            index++;
+            start += segment_length(n);
+            t = n.right;
+        }
+
+        return {index, start};
+    }
+
+    /** The node at the index with aggregates of the nodes before it */
+    std::pair<uint32_t, Prefix> at(size_t index) const {
+        Prefix prefix{};
+
+        for (auto t = root_; t;) {
+            const auto &n = nodes_[t];
+            const auto &l = nodes_[n.left];
+
+            if (index < l.count) {
+                t = n.left;
+                continue;
+            }
+
+            prefix.length += l.length;
+            prefix.depth += l.depth;
+            prefix.quotes[0] += l.quotes[0];
+            prefix.quotes[1] += l.quotes[1];
+
+            if (index == l.count) {
+                return {t, prefix};
+            }
+
+            index -= l.count + 1;
+            prefix.length += segment_length(n);
+            prefix.depth += delta(n.token);
+            prefix.quotes[0] += quote_kind(n.token) == 0;
+            prefix.quotes[1] += quote_kind(n.token) == 1;
+            t = n.right;
+        }
+
+        return {0, prefix};
+    }
+
+    /** Position of the token of the node at the index */
+    size_t position(size_t index) const {
+        auto [t, prefix] = at(index);
+        return prefix.length + nodes_[t].gap;
+    }
+
+    /** The first index at or after `first` where the depth drops to the threshold */
+    size_t first_at_most(uint32_t t, size_t first, long threshold, size_t base, long depth) const {
+        const auto &n = nodes_[t];
+
+        if (!t || base + n.count <= first || (base >= first && depth + n.min_depth > threshold)) {
+            return npos;
+        }
+
+        if (auto found = first_at_most(n.left, first, threshold, base, depth); found != npos) {
+            return found;
+        }
+
+        const auto index = base + nodes_[n.left].count;
+        depth += nodes_[n.left].depth + delta(n.token);
+
+        if (index >= first && depth <= threshold) {
+            return index;
+        }
+
+        return first_at_most(n.right, first, threshold, index + 1, depth);
+    }
+
+    /** The last index before `last` where the depth drops to the threshold */
+    size_t last_at_most(uint32_t t, size_t last, long threshold, size_t base, long depth) const {
+        const auto &n = nodes_[t];
+
+        if (!t || base >= last || (base + n.count <= last && depth + n.min_depth > threshold)) {
+            return npos;
+        }
+
+        const auto index = base + nodes_[n.left].count;
+        const auto own = depth + nodes_[n.left].depth + delta(n.token);
+
+        if (auto found = last_at_most(n.right, last, threshold, index + 1, own); found != npos) {
+            return found;
+        }
+
+        if (index < last && own <= threshold) {
+            return index;
+        }
+
+        return last_at_most(n.left, last, threshold, base, depth);
+    }
+
+    /** Index of the quote of the kind with the rank */
+    size_t select_quote(int kind, size_t rank) const {
+        size_t index = 0;
+
+        for (auto t = root_; t;) {
+            const auto &n = nodes_[t];
+            const auto &l = nodes_[n.left];
+
+            if (rank < l.quotes[kind]) {
+                t = n.left;
+                continue;
+            }
+
+            rank -= l.quotes[kind];
+            index += l.count;
+
+            if (quote_kind(n.token) == kind) {
+                if (!rank) {
+                    return index;
+                }
+
+                rank--;
+            }
+
+            index++;
+            t = n.right;
+        }
+
+        return npos;
+    }
+
+public:
+    static constexpr std::string_view tokens{"()[]{}\"'"};
+
+    BracketIndex() {
+        root_ = make(0, '\0');
+    }
+
+    /** Index the text from scratch */
+    void reset(std::string_view text) {
+        nodes_.resize(1);
+        free_.clear();
+        root_ = build(text);
+    }
+
+    void insert(size_t pos, std::string_view text) {
+        auto [index, start] = locate(pos);
+        const auto offset = pos - start;
+        uint32_t left, middle, right;
+
+        split(root_, index, left, right);
+        split(right, 1, middle, right);
+
+        if (next_token(text, 0) == npos) {
+            nodes_[middle].gap += text.size();
+            update(middle);
+            root_ = merge(merge(left, middle), right);
+            return;
+        }
+
+        // the first inserted segment takes the text before the position, the
+        // text after the last inserted token joins the rest of the split segment
+        const auto inserted = build(text);
+        uint32_t first, rest, tail;
+
+        split(inserted, nodes_[inserted].count - 1, rest, tail);
+        split(rest, 1, first, rest);
+
+        nodes_[first].gap += offset;
+        update(first);
+
+        nodes_[middle].gap = nodes_[middle].gap - offset + nodes_[tail].gap;
+        update(middle);
+        release(tail);
+
+        root_ = merge(merge(merge(left, first), merge(rest, middle)), right);
+    }
+
+    void erase(size_t begin, size_t end) {
+        if (begin >= end) {
+            return;
+        }
+
+        auto [first, first_start] = locate(begin);
+        auto [last, last_start] = locate(end);
+        uint32_t left, middle, right, removed, kept;
+
+        split(root_, first, left, right);
+        split(right, last - first + 1, middle, right);
+        split(middle, last - first, removed, kept);
+
+        // the rest of the first segment joins the last one
+        nodes_[kept].gap = (begin - first_start) + nodes_[kept].gap - (end - last_start);
+        update(kept);
+        release(removed);
+
+        root_ = merge(merge(left, kept), right);
+    }
+
+    /** Position of the bracket or quote matching the one at the position */
+    std::optional<size_t> match(size_t pos) const {
+        auto [index, start] = locate(pos);
+        auto [t, prefix] = at(index);
+        const auto &n = nodes_[t];
+
+        if (!n.token || start + n.gap != pos) {
+            return std::nullopt;
+        }
+
+        size_t found = npos;
+
+        if (auto kind = quote_kind(n.token); kind >= 0) {
+            const auto rank = prefix.quotes[kind];
+            found = select_quote(kind, rank % 2 ? rank - 1 : rank + 1);
+        } else if (delta(n.token) > 0) {
+            found = first_at_most(root_, index + 1, prefix.depth, 0, 0);
+        } else {
+            const auto depth = prefix.depth - 1;
+            found = last_at_most(root_, index, depth, 0, 0);
+
+            if (found != npos) {
+                found++;
+            } else if (depth >= 0) {
+                found = 0;
+            }
+        }
+
+        if (found == npos) {
+            return std::nullopt;
+        }
+
+        auto [other, other_prefix] = at(found);
+
+        if (quote_kind(n.token) < 0 && nodes_[other].token != counterpart(n.token)) {
+            return std::nullopt;
+        }
+
+        return other_prefix.length + nodes_[other].gap;
+    }
+
+    /** Number of indexed tokens */
+    size_t size() const {
+        return nodes_[root_].count - 1;
+    }
+
+    size_t memory_usage() const {
+        return MemoryUsage::of(nodes_) + MemoryUsage::of(free_);
+    }
+
+    /** Index an empty text and free the pool */
+    void release() {
+        std::vector<Node>(1).swap(nodes_);
+        std::vector<uint32_t>{}.swap(free_);
+        root_ = build({});
+    }
+};
+
+class Buffer {
+    size_t cursor_pos_{0};
+    BufferStorage data_;
+
+    /** Built on the first lookup, it's kept up to date only with `set_bracket_index` */
+    mutable BracketIndex brackets_;
+    mutable bool indexed_{false};
+    bool index_brackets_{false};
+
+    /** The other end of the region, the cursor is the first one */
+    std::optional<size_t> mark_{};
+
+    /** Keep the position at its place in the text after the range was erased */
+    static void adjust_for_erase(size_t &pos, size_t begin, size_t end) {
+        if (pos >= end) {
+            pos -= end - begin;
+        } else if (pos > begin) {
+            pos = begin;
+        }
+    }
+
+    static bool is_word_char(char ch) {
+        return std::isalnum(static_cast<unsigned char>(ch)) || (ch & 0x80);
+    }
+
+    /** The index is updated by the edit or dropped and built again by the next lookup */
+    bool update_index() {
+        if (indexed_ && !index_brackets_) {
+            brackets_.release();
+            indexed_ = false;
+        }
+
+        return indexed_;
+    }
+
+    void drop_index() {
+        if (indexed_) {
+            brackets_.release();
+            indexed_ = false;
+        }
+    }
+
+public:
+    void insert(char c) {
+        insert(std::string_view{&c, 1});
+    }
+
+    /** Insert text at the cursor and move the cursor after it */
+    void insert(std::string_view s) {
+        READLINE_PROBE(buffer_insert, cursor_pos_, s.size());
+        TraceRecorder::instant("buffer_insert", s.size());
+
+        data_.insert(cursor_pos_, s);
+
+        if (update_index()) {
+            brackets_.insert(cursor_pos_, s);
+        }
+
+        if (mark_ && *mark_ > cursor_pos_) {
+            *mark_ += s.size();
+        }
+
+        cursor_pos_ += s.size();
+        data_.keep_resident(cursor_pos_);
+    }
+
+    /** Position n characters (grapheme clusters) before the position */
+    size_t characters_before(size_t pos, size_t n) const {
+        for (; n && pos; n--) {
+            pos = Utf8::previous_boundary(data_.view(), pos);
+        }
+
+        return pos;
+    }
+
+    /** Position n characters (grapheme clusters) after the position */
+    size_t characters_after(size_t pos, size_t n) const {
+        for (; n && pos < data_.size(); n--) {
+            pos = Utf8::next_boundary(data_.view(), pos);
+        }
+
+        return pos;
+    }
+
+    void move_left(size_t n = 1) {
+        cursor_pos_ = characters_before(cursor_pos_, n);
+        data_.keep_resident(cursor_pos_);
+    }
+
+    void move_right(size_t n = 1) {
+        cursor_pos_ = characters_after(cursor_pos_, n);
+        data_.keep_resident(cursor_pos_);
+    }
+
+    /** Remove n characters before the cursor */
+    void remove(size_t n = 1) {
+        const auto begin = characters_before(cursor_pos_, n);
+
+        if (begin != cursor_pos_) {
+            erase(begin, cursor_pos_);
+        }
+    }
+
+    /** Remove bytes in the range, the cursor keeps its place in the text */
+    void erase(size_t begin, size_t end) {
+        end = std::min(end, data_.size());
+
+        if (begin >= end) {
+            return;
+        }
+
+        READLINE_PROBE(buffer_erase, begin, end);
+        TraceRecorder::instant("buffer_erase", end - begin);
+
+        data_.erase(begin, end - begin);
+
+        if (update_index()) {
+            brackets_.erase(begin, end);
+        }
+
+        adjust_for_erase(cursor_pos_, begin, end);
+
+        if (mark_) {
+            adjust_for_erase(*mark_, begin, end);
+        }
+
+        data_.keep_resident(cursor_pos_);
+    }
+
+    /** Place the cursor, a position inside of a character is moved to its start */
+    void set_position(size_t pos) {
+        pos = std::min(pos, data_.size());
+
+        while (pos && pos < data_.size() && Utf8::is_continuation(data_.view()[pos])) {
+            pos--;
+        }
+
+        cursor_pos_ = pos;
+        data_.keep_resident(cursor_pos_);
+    }
+
+    void clear() {
+        cursor_pos_ = 0;
+        mark_.reset();
+        data_.clear();
+        drop_index();
+    }
+
+    void reset(std::string_view s) {
+        data_.assign(s);
+        drop_index();
+        cursor_pos_ = data_.size();
+        mark_.reset();
+        data_.keep_resident(cursor_pos_);
+    }
+
+    /** Replace the contents with the file, see `BufferStorage::adopt` */
+    void load(int fd) {
+        data_.adopt(fd);
+        drop_index();
+        cursor_pos_ = data_.size();
+        mark_.reset();
+        data_.keep_resident(cursor_pos_);
+    }
+
+    /** Set the mark at the cursor */
+    void set_mark() {
+        mark_ = cursor_pos_;
+    }
+
+    bool has_mark() const {
+        return mark_.has_value();
+    }
+
+    void exchange_point_and_mark() {
+        if (mark_) {
+            std::swap(*mark_, cursor_pos_);
+            data_.keep_resident(cursor_pos_);
+        }
+    }
+
+    /** Range between the cursor and the mark */
+    std::pair<size_t, size_t> region() const {
+        if (!mark_) {
+            return {cursor_pos_, cursor_pos_};
+        }
+
+        return std::minmax(cursor_pos_, *mark_);
+    }
+
+    std::string_view region_view() const {
+        auto [begin, end] = region();
+        return view().substr(begin, end - begin);
+    }
+
+    /** Convert case of the range in place
+     *
+     * Only characters whose converted form is longer or shorter than the
+     * original (rare outside of ASCII) make the range to be rewritten.
+     */
+    void convert_case(size_t begin, size_t end, LetterCase to) {
+        end = std::min(end, data_.size());
+
+        if (begin >= end || CaseConversion::convert(data_.data() + begin, end - begin, to)) {
+            return;
+        }
+
+        std::string converted;
+        const auto text = view().substr(begin, end - begin);
+
+        for (size_t pos = 0; pos < text.size();) {
+            converted += Utf8::encode(CaseConversion::convert(Utf8::decode(text, pos), to));
+        }
+
+        replace(begin, end, converted);
+    }
+
+    /** Upcase the first letter of every word in the range and downcase the rest */
+    void capitalize(size_t begin, size_t end) {
+        end = std::min(end, data_.size());
+
+        // downcasing may change the length, e.g. of the dotted capital I
+        const auto original = data_.size();
+        convert_case(begin, end, LetterCase::Lower);
+        end += data_.size() - original;
+
+        for (size_t pos = begin; pos < end; pos++) {
+            if (is_word_char(data_.data()[pos]) && (pos == 0 || !is_word_char(data_.data()[pos - 1]))) {
+                const auto next = Utf8::next_boundary(view(), pos);
+                const auto size = data_.size();
+
+                convert_case(pos, next, LetterCase::Upper);
+                end += data_.size() - size;
+                pos = next + data_.size() - size - 1;
+            }
+        }
+    }
+
+    /** Replace the range with the text, positions after the range are shifted */
+    void replace(size_t begin, size_t end, std::string_view text) {
+        const auto cursor = cursor_pos_;
+        const auto mark = mark_;
+
+        data_.erase(begin, end - begin);
+
+        if (update_index()) {
+            brackets_.erase(begin, end);
+        }
+
+        cursor_pos_ = begin;
+        mark_.reset();
+        insert(text);
+
+        auto shift = [&](size_t pos) {
+            return pos >= end ? pos - (end - begin) + text.size() : std::min(pos, begin + text.size());
+        };
+
+        cursor_pos_ = shift(cursor);
+
+        if (mark) {
+            mark_ = shift(*mark);
+        }
+
+        data_.keep_resident(cursor_pos_);
+    }
+
+    /** Swap the word before the cursor with the word after it
+     *
+     * The words are swapped in place by rotating the text between them,
+     * the cursor is moved after both words.
+     */
+    void transpose_words() {
+        const auto text = view();
+        auto word_end = [&](size_t pos) {
+            while (pos < text.size() && !is_word_char(text[pos])) pos++;
+            while (pos < text.size() && is_word_char(text[pos])) pos++;
+            return pos;
+        };
+        auto word_begin = [&](size_t pos) {
+            while (pos && !is_word_char(text[pos - 1])) pos--;
+            while (pos && is_word_char(text[pos - 1])) pos--;
+            return pos;
+        };
+
+        // without a word after the cursor the last two words are swapped
+        auto pos = cursor_pos_;
+        while (pos < text.size() && !is_word_char(text[pos])) pos++;
+
+        const auto second_end = pos < text.size() ? word_end(cursor_pos_) : word_end(word_begin(cursor_pos_));
+
+        const auto second_begin = word_begin(second_end);
+        const auto first_begin = word_begin(second_begin);
+        const auto first_end = word_end(first_begin);
+
+        if (first_begin == second_begin || first_end > second_begin) {
+            return;
+        }
+
+        auto rotate = [this](size_t begin, size_t end) {
+            std::reverse(data_.data() + begin, data_.data() + end);
+        };
+
+        // (first gap second) reversed is (second' gap' first'), parts are reversed back
+        rotate(first_begin, second_end);
+        rotate(first_begin, first_begin + (second_end - second_begin));
+        rotate(first_begin + (second_end - second_begin), second_end - (first_end - first_begin));
+        rotate(second_end - (first_end - first_begin), second_end);
+
+        // only the text between the words moved
+        const auto gap = first_begin + (second_end - second_begin);
+        if (update_index()) {
+            brackets_.erase(first_end, second_begin);
+            brackets_.insert(gap, view().substr(gap, second_begin - first_end));
+        }
+
+        cursor_pos_ = second_end;
+        data_.keep_resident(cursor_pos_);
+    }
+
+    size_t position() const {
+        return cursor_pos_;
+    }
+
+    /** Range of the content kept in memory when it's spilled, see `BufferStorage::keep_resident` */
+    std::pair<size_t, size_t> resident() const {
+        return data_.resident();
+    }
+
+    /** Position of the bracket or quote matching the one at the position
+     *
+     * The first lookup after an edit which dropped the index scans the whole
+     * text, see `set_bracket_index`.
+     */
+    std::optional<size_t> matching_bracket(size_t pos) const {
+        if (!indexed_) {
+            brackets_.reset(data_.view());
+            indexed_ = true;
+        }
+
+        return brackets_.match(pos);
+    }
+
+    /** Keep the index of brackets up to date on edits instead of dropping it */
+    void set_bracket_index(bool to) {
+        index_brackets_ = to;
+
+        if (!to) {
+            drop_index();
+        }
+    }
+
+    std::string data() const {
+        return std::string{data_.view()};
+    }
+
+    /** Contents of the buffer without copying */
+    std::string_view view() const {
+        return data_.view();
+    }
+
+    bool empty() const {
+        return !data_.size();
+    }
+
+    size_t size() const {
+        return data_.size();
+    }
+
+    size_t memory_usage() const {
+        return data_.memory_usage() + brackets_.memory_usage();
+    }
+
+    /** Text, cursor and mark, a spilled text is saved too */
+    void save_state(SessionState &state) const {
+        state.put_text(data_.view());
+        state.put_number(cursor_pos_);
+        state.put_number(mark_ ? *mark_ + 1 : 0);
+    }
+
+    void load_state(SessionState &state) {
+        reset(state.text());
+        set_position(state.number());
+
+        if (auto mark = state.number(); mark && mark <= data_.size() + 1) {
+            mark_ = mark - 1;
+        }
+    }
+
+    /** Clear the buffer and free its memory */
+    void release() {
+        cursor_pos_ = 0;
+        mark_.reset();
+        data_.release();
+        drop_index();
+    }
+
+    /** Size over which the content is moved from memory to a temporary file */
+    void set_memory_limit(size_t limit) {
+        data_.set_memory_limit(limit);
+    }
+
+    /** Content is stored in a temporary file */
+    bool spilled() const {
+        return data_.spilled();
+    }
+
+    friend std::ostream &operator<<(std::ostream &, const Buffer &);
+};
+
+std::ostream &operator<<(std::ostream &os, const Buffer &b) {
+    return os << b.view();
+}
+
+//class TerminalBuffer {
+//
+//    size_t prompt_end_{0};
+//    Buffer &buffer_;
+//    Terminal &terminal_;
+//
+//public:
+//    void set_prompt_end(const size_t end) {
+//        prompt_end_ = end;
+//    }
+//};
+
+const auto CTRL_C = 3;
+const auto CTRL_D = 4;
+const auto CTRL_U = 21;
+const auto CTRL_X = '\x18';
+const auto CTRL_SPACE = '\0';
+const auto CTRL_W = '\x17';
+const auto CTRL_Y = '\x19';
+const auto CTRL_R = '\x12';
+const auto CTRL_S = '\x13';
+const auto CTRL_RIGHT_BRACKET = '\x1d';
+const auto ESC = '\x1b';
+const auto BACKSPACE = '\x7f';
+const auto NEWLINE = '\n';
+const auto TAB = '\t';
+
+const auto CSI = {ESC, '['};
+
+const auto MOVE_LEFT = {ESC, '[', 'D'};
+const auto MOVE_RIGHT = {ESC, '[', 'C'};
+const auto MOVE_DOWN = {ESC, '[', 'A'};
+const auto MOVE_UP = {ESC, '[', 'B'};
+
+const auto START_MACRO = {CTRL_X, '('};
+const auto END_MACRO = {CTRL_X, ')'};
+const auto CALL_MACRO = {CTRL_X, 'e'};
+
+const auto EXCHANGE_POINT_AND_MARK = {CTRL_X, CTRL_X};
+const auto COPY_REGION = {ESC, 'w'};
+const auto UPCASE_REGION = {CTRL_X, '\x15'};
+const auto DOWNCASE_REGION = {CTRL_X, '\x0c'};
+const auto CAPITALIZE_REGION = {CTRL_X, 'c'};
+const auto TRANSPOSE_WORDS = {ESC, 't'};
+
+const auto CHARACTER_SEARCH = {CTRL_RIGHT_BRACKET};
+const auto CHARACTER_SEARCH_BACKWARD = {ESC, CTRL_RIGHT_BRACKET};
+const auto SEARCH_FORWARD = {CTRL_S};
+const auto SEARCH_BACKWARD = {CTRL_R};
+
+const auto MATCHING_BRACKET = {CTRL_X, '%'};
+const auto EDIT_IN_EDITOR = {CTRL_X, '\x05'};
+
+struct CommandSequences {
+
+    using SequenceChar = char;
+    using SubSequence = std::shared_ptr<CommandSequences>;
+    using Command = std::function<void(void)>;
+
+    std::unordered_map<SequenceChar, SubSequence> sequences;
+    Command command;
+
+    /** Parameter bytes (0x20-0x3f) following this sequence are collected
+     * instead of matched, e.g. `1;5` in `ESC [ 1 ; 5 D`
+     */
+    bool accepts_parameters{false};
+
+    /** Immediately repeated sequences are executed once, see `CommandReader::repeat_count` */
+    bool repeatable{false};
+
+    /** Returns node for the sequence, missing nodes are created */
+    template <typename It>
+    CommandSequences *node(It begin, It end) {
+
+        CommandSequences *sequence = this;
+
+        while (begin != end) {
+
+            if (!sequence->contains(*begin)) {
+                sequence->sequences[*begin].reset(new CommandSequences());
+            }
+
+            sequence = sequence->sequences[*begin].get();
+
+            begin = std::next(begin);
+        }
+
+        return sequence;
+    }
+
+    template <typename It>
+    void insert(It begin, It end, const Command &command) {
+        node(begin, end)->command = command;
+    }
+
+    template <typename CharType>
+    void insert(const std::initializer_list<CharType> &sequence, const Command &command) {
+        insert(std::begin(sequence), std::end(sequence), command);
+    }
+
+    void insert(const SequenceChar &ch, const Command &command) {
+        auto && sequence = std::initializer_list<SequenceChar>{ch};
+        insert(std::begin(sequence), std::end(sequence), command);
+    }
+
+    bool contains(const SequenceChar &k) const {
+        return sequences.count(k) >= 1;
+    }
+
+    bool empty() const {
+        return sequences.empty();
+    }
+
+    const CommandSequences &operator[](const SequenceChar &k) const {
+        return *sequences.at(k);
+    }
+
+    const CommandSequences &operator[](const std::initializer_list<SequenceChar> &sequence) const {
+        const CommandSequences *subsequence = this;
+
+        for (auto &&key: sequence) {
+            subsequence = subsequence->sequences.at(key).get();
+        }
+
+        return *subsequence;
+    }
+
+    void operator() () const {
+        command();
+    }
+
+    /** Buckets and nodes of the maps and the subsequences with their control blocks */
+    size_t memory_usage() const {
+        size_t bytes = sequences.bucket_count() * sizeof(void *);
+
+        for (auto &[ch, subsequence]: sequences) {
+            bytes += sizeof(void *) + sizeof(std::pair<const SequenceChar, SubSequence>);
+            bytes += sizeof(CommandSequences) + 2 * sizeof(void *) + subsequence->memory_usage();
+        }
+
+        return bytes;
+    }
+};
+
+
+/** This class is an input stream reading a file descriptor
+ *
+ * Unlike `std::cin`, which is synchronized with stdio and reads byte by
+ * byte, it reads everything what is available at once and reports the
+ * available bytes, so `readsome` works on terminals, pipes and sockets.
+ */
+class FdInputStream: public std::istream {
+
+    class Buffer: public std::streambuf {
+        int fd_;
+        size_t size_;
+
+        /** Allocated by the first read, a session reading another stream doesn't need it */
+        std::vector<char> data_{};
+
+    protected:
+        int_type underflow() override {
+            data_.resize(size_);
+
+            while (true) {
+                const auto n = ::read(fd_, data_.data(), data_.size());
+
+                if (n > 0) {
+                    setg(data_.data(), data_.data(), data_.data() + n);
+                    return traits_type::to_int_type(data_[0]);
+                }
+
+                if (n == -1 && errno == EINTR) {
+                    continue;
+                }
+
+                return traits_type::eof();
+            }
+        }
+
+        std::streamsize showmanyc() override {
+            int available = 0;
+
+            if (ioctl(fd_, FIONREAD, &available) == -1) {
+                return 0;
+            }
+
+            return available;
+        }
+
+    public:
+        Buffer(int fd, size_t size): fd_{fd}, size_{size} {}
+    };
+
+    Buffer buffer_;
+
+public:
+    explicit FdInputStream(int fd, size_t buffer_size = 4096): std::istream{nullptr}, buffer_{fd, buffer_size} {
+        rdbuf(&buffer_);
+    }
+};
+
+/** This class is a recorded keyboard macro
+ *
+ * The input isn't stored as bytes, every step holds the resolved command
+ * with its already decoded arguments, so playing a macro doesn't touch
+ * the command sequences at all.
+ */
+struct KeyboardMacro {
+
+    struct Step {
+        CommandSequences::Command command;
+        char current_char;
+        std::string text;
+        std::string parameters;
+        size_t repeat_count;
+    };
+
+    std::vector<Step> steps;
+
+    bool empty() const {
+        return steps.empty();
+    }
+
+    size_t memory_usage() const {
+        size_t bytes = MemoryUsage::of(steps);
+
+        for (auto &step: steps) {
+            bytes += MemoryUsage::of(step.text) + MemoryUsage::of(step.parameters);
+        }
+
+        return bytes;
+    }
+};
+
+struct CommandReader {
+
+    /**
+     * All defined commands
+     */
+    CommandSequences commands_;
+
+    /**
+     * Default command
+     *
+     * It's called when no command matches the input sequence
+     */
+    typename CommandSequences::Command default_;
+
+    /** Data source */
+    std::reference_wrapper<std::istream> input_;
+
+    /** Does EOF occured */
+    bool should_stop_{false};
+
+    /** Reading stopped because the input was exhausted */
+    bool exhausted_{false};
+
+    /** Last readed character */
+    char curchar_{'\0'};
+
+    /** Node of the sequence being matched, null when none is */
+    const CommandSequences *sequence_{nullptr};
+
+    /** Parameters of the control sequence being matched */
+    std::string parameters_;
+
+    /** Bytes of the sequence being matched, including parameters */
+    std::string matched_;
+
+    /** Input which was already read, but not processed yet */
+    std::string pending_;
+    size_t pending_pos_{0};
+
+    /** Command for runs of bytes which don't start any command */
+    typename CommandSequences::Command self_insert_;
+
+    /** Text passed to the self insert command */
+    std::string_view text_;
+
+    /** Storage for text with replaced invalid sequences */
+    std::string sanitized_text_;
+
+    /** How many times was the executed command repeated */
+    size_t repeat_count_{1};
+
+    /** Executed commands are recorded to the macro */
+    bool recording_{false};
+    KeyboardMacro macro_;
+
+    /** The running command asked not to be recorded */
+    bool unrecorded_{false};
+
+    /** A macro is being played, a nested play is ignored */
+    bool playing_{false};
+
+    /** Depth of nested commands, only top level commands are recorded */
+    size_t depth_{0};
+
+    /** Number of executed top level commands, including played macro steps */
+    size_t serial_{0};
+
+    /** Called with the duration of every top level command */
+    std::function<void(std::chrono::steady_clock::duration)> observer_{};
+
+    /** Transforms the input as it's read, e.g. to decode a protocol */
+    std::function<void(std::string &)> input_filter_{};
+
+    /** Upper bound of bytes read ahead at once */
+    static constexpr size_t read_ahead_ = 64 << 10;
+
+    CommandReader(std::istream &is): input_{is} {}
+
+    void set_input(std::istream &is) { input_ = is; }
+
+    static bool is_parameter_byte(char ch) {
+        return ch >= 0x20 && ch <= 0x3f;
+    }
+
+    static bool is_final_byte(char ch) {
+        return ch >= 0x40 && ch <= 0x7e;
+    }
+
+    /** Sequences starting with the prefix can carry parameters
+     *
+     * Control sequences with parameters unknown to the reader are
+     * discarded as a whole instead of being passed to the default command.
+     */
+    template <typename CharType>
+    void add_parameterized_prefix(const std::initializer_list<CharType> &prefix) {
+        commands_.node(std::begin(prefix), std::end(prefix))->accepts_parameters = true;
+    }
+
+    template <typename CharType, typename F>
+    void add_command(const std::initializer_list<CharType> &key, F &&f) {
+        commands_.insert(key, f);
+    }
+
+    template <typename CharType, typename F>
+    void add_command(const CharType &key, F &&f) {
+        commands_.insert(key, f);
+    }
+
+    /** Add command which handles its repetitions at once
+     *
+     * When the sequence is repeated in the input which was already read
+     * (e.g. queued backspaces from key repeat), the command is called once
+     * and `repeat_count` tells how many times it was pressed.
+     */
+    template <typename CharType, typename F>
+    void add_repeatable_command(const std::initializer_list<CharType> &key, F &&f) {
+        auto sequence = commands_.node(std::begin(key), std::end(key));
+        sequence->command = f;
+        sequence->repeatable = true;
+    }
+
+    template <typename CharType, typename F>
+    void add_repeatable_command(const CharType &key, F &&f) {
+        add_repeatable_command(std::initializer_list<CharType>{key}, f);
+    }
+
+    template <typename F>
+    void set_default(F &&f) {
+        default_ = f;
+    }
+
+    /** Set command for text
+     *
+     * When set, runs of already read bytes which don't start any command
+     * are passed to the command at once as `current_text`, instead of
+     * calling the default command for every byte.
+     */
+    template <typename F>
+    void set_self_insert(F &&f) {
+        self_insert_ = f;
+    }
+
+    /** Observe how long every top level command takes */
+    template <typename F>
+    void set_command_observer(F &&f) {
+        observer_ = f;
+    }
+
+    /** Set filter of the input
+     *
+     * The filter gets every chunk of input when it's read, before any
+     * command is matched. It can change the chunk in place, a chunk which
+     * becomes empty is skipped.
+     */
+    template <typename F>
+    void set_input_filter(F &&f) {
+        input_filter_ = f;
+    }
+
+    void stop_reading() { should_stop_ = true; }
+    void start_reading() { should_stop_ = false; }
+    char current_char() const { return curchar_; }
+    std::string_view current_text() const { return text_; }
+    size_t repeat_count() const { return repeat_count_; }
+    const std::string &parameters() const { return parameters_; }
+    size_t serial() const { return serial_; }
+    bool exhausted() const { return exhausted_; }
+
+    /** Buffers of the input, the command sequences are counted separately */
+    size_t memory_usage() const {
+        return MemoryUsage::of(parameters_) + MemoryUsage::of(matched_) + MemoryUsage::of(pending_)
+             + MemoryUsage::of(sanitized_text_) + macro_.memory_usage();
+    }
+
+    /** Take the input which wasn't executed yet, including an incomplete sequence */
+    std::string take_unprocessed() {
+        std::string input = matched_ + pending_.substr(pending_pos_);
+
+        pending_.clear();
+        pending_pos_ = 0;
+        reset_sequence();
+
+        return input;
+    }
+
+    /** Free the buffers and the command sequences, commands have to be added again */
+    void release() {
+        reset_sequence();
+        commands_ = {};
+        std::string{}.swap(parameters_);
+        std::string{}.swap(matched_);
+        std::string{}.swap(pending_);
+        std::string{}.swap(sanitized_text_);
+        pending_pos_ = 0;
+    }
+
+    /** Read the next character
+     *
+     * When the input is exhausted, everything what can be read without
+     * blocking is read at once, so runs of text and repeated commands can
+     * be recognized.
+     */
+    bool next_char(char &ch) {
+        while (pending_pos_ == pending_.size()) {
+            pending_.clear();
+            pending_pos_ = 0;
+
+            auto &input = input_.get();
+
+            if (auto first = input.get(); first != EOF) {
+                pending_.push_back(static_cast<char>(first));
+            } else {
+                return false;
+            }
+
+            char chunk[4096];
+
+            while (pending_.size() < read_ahead_) {
+                auto n = input.readsome(chunk, sizeof(chunk));
+
+                if (n <= 0) {
+                    break;
+                }
+
+                pending_.append(chunk, n);
+            }
+
+            if (input_filter_) {
+                input_filter_(pending_);
+            }
+
+            READLINE_PROBE(input_read, pending_.size());
+            TraceRecorder::instant("input_read", pending_.size());
+        }
+
+        ch = pending_[pending_pos_++];
+        return true;
+    }
+
+    void unget_char() {
+        pending_pos_--;
+    }
+
+    /** Input which was read ahead, but not processed */
+    std::string_view unprocessed() const {
+        return std::string_view{pending_}.substr(pending_pos_);
+    }
+
+    /** Put input back, it's processed before anything else */
+    void unread(std::string_view input) {
+        pending_.replace(0, pending_pos_, input);
+        pending_pos_ = 0;
+    }
+
+    /** Numeric parameters separated by semicolons, prefixes like `?` are skipped */
+    std::vector<int> numeric_parameters() const {
+        std::vector<int> numbers;
+        std::istringstream fields{parameters_};
+
+        for (std::string field; std::getline(fields, field, ';');) {
+            auto digits = field.find_first_of("0123456789");
+            numbers.push_back(digits == std::string::npos ? 0 : std::atoi(field.c_str() + digits));
+        }
+
+        return numbers;
+    }
+
+    /** Run the command, it's recorded when a macro is being defined */
+    void run(const CommandSequences::Command &command) {
+        const bool record = recording_ && !depth_;
+        const bool observe = observer_ && !depth_;
+
+        if (!depth_) {
+            serial_++;
+            unrecorded_ = false;
+        }
+
+        const auto start = observe ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{};
+
+        READLINE_PROBE(command_start, serial_, depth_);
+
+        {
+            TraceSpan span{"command", serial_};
+
+            depth_++;
+            command();
+            depth_--;
+        }
+
+        READLINE_PROBE(command_done, serial_, depth_);
+
+        // the command could start or end the recording
+        if (record && recording_ && !unrecorded_) {
+            macro_.steps.push_back({command, curchar_, std::string{text_}, parameters_, repeat_count_});
+        }
+
+        if (observe) {
+            observer_(std::chrono::steady_clock::now() - start);
+        }
+    }
+
+    void start_recording() {
+        macro_ = {};
+        recording_ = true;
+    }
+
+    KeyboardMacro stop_recording() {
+        recording_ = false;
+        return std::move(macro_);
+    }
+
+    bool recording() const {
+        return recording_;
+    }
+
+    /** Don't record the running command, e.g. one which would play the macro being recorded */
+    void skip_recording() {
+        unrecorded_ = true;
+    }
+
+    /** Play the macro n times
+     *
+     * Playing stops when a command stops reading (e.g. the line is accepted).
+     */
+    void play(const KeyboardMacro &macro, size_t times = 1) {
+        // a macro which calls a macro would play forever
+        if (playing_) {
+            return;
+        }
+
+        const auto parameters = parameters_;
+        playing_ = true;
+
+        // also a command which throws ends the playing
+        struct Played {
+            bool &playing;
+            ~Played() { playing = false; }
+        } played{playing_};
+
+        for (size_t i = 0; i < times && !should_stop_; i++) {
+            for (auto &&step: macro.steps) {
+
+                if (should_stop_) {
+                    break;
+                }
+
+                curchar_ = step.current_char;
+                text_ = step.text;
+                parameters_ = step.parameters;
+                repeat_count_ = step.repeat_count;
+
+                serial_++;
+                step.command();
+            }
+        }
+
+        text_ = {};
+        parameters_ = parameters;
+        repeat_count_ = 1;
+    }
+
+    void run_default() {
+        if (self_insert_) {
+            run_self_insert();
+        } else if (default_) {
+            run(default_);
+        } else {
+            throw std::runtime_error("Unknown command: " + std::to_string((int)curchar_));
+        }
+    }
+
+    /** Read n more bytes to the pending input, blocks until they arrive */
+    size_t read_more(size_t n) {
+        size_t read = 0;
+
+        for (; read < n; read++) {
+            auto ch = input_.get().get();
+
+            if (ch == EOF) {
+                break;
+            }
+
+            pending_.push_back(static_cast<char>(ch));
+        }
+
+        return read;
+    }
+
+    /** Pass text to the self insert command
+     *
+     * Only complete UTF-8 sequences are passed, a sequence split by the end
+     * of the read input is completed first. Ill-formed sequences are
+     * replaced by U+FFFD.
+     */
+    void insert_text(std::string_view text) {
+        if (Utf8::valid_prefix(text) == text.size()) {
+            text_ = text;
+        } else {
+            sanitized_text_ = Utf8::sanitize(text);
+            text_ = sanitized_text_;
+        }
+
+        run(self_insert_);
+        text_ = {};
+    }
+
+    /** Pass the current character with the following text to the self insert command */
+    void run_self_insert() {
+        const auto begin = pending_pos_ - 1;
+        auto end = pending_pos_;
+
+        for (;;) {
+            while (end < pending_.size() && !commands_.contains(pending_[end])) {
+                end++;
+            }
+
+            if (end < pending_.size()) {
+                break;
+            }
+
+            const auto missing = Utf8::missing_bytes(std::string_view{pending_}.substr(begin, end - begin));
+
+            if (!missing || !read_more(missing)) {
+                break;
+            }
+        }
+
+        pending_pos_ = end;
+        insert_text(std::string_view{pending_}.substr(begin, end - begin));
+    }
+
+    /** Execute matched command, immediate repetitions of repeatable commands are merged */
+    void execute(const CommandSequences *sequence, bool merge_repetitions = true) {
+        repeat_count_ = 1;
+
+        if (merge_repetitions && sequence->repeatable && !matched_.empty()) {
+            while (pending_.compare(pending_pos_, matched_.size(), matched_) == 0) {
+                pending_pos_ += matched_.size();
+                repeat_count_++;
+            }
+        }
+
+        run(sequence->command);
+        repeat_count_ = 1;
+    }
+
+    /** Execute command for a complete key
+     *
+     * Unlike `read_and_execute` it doesn't wait for longer sequences, so a
+     * key which is a prefix of other sequences (e.g. ESC) is executed
+     * immediately. An unbound prefix is dropped.
+     */
+    void execute_key(const std::string &key) {
+
+        const CommandSequences *sequence = &commands_;
+
+        for (auto &ch: key) {
+
+            curchar_ = ch;
+
+            if (sequence->contains(ch)) {
+                sequence = &(*sequence)[ch];
+                continue;
+            }
+
+            if (sequence != &commands_ && sequence->command) {
+                execute(sequence, false);
+            }
+
+            sequence = &commands_;
+
+            if (sequence->contains(ch)) {
+                sequence = &(*sequence)[ch];
+            } else if (self_insert_) {
+                // the rest of the key is a single character
+                insert_text(std::string_view{key}.substr(&ch - key.data()));
+                return;
+            } else if (default_) {
+                run(default_);
+            }
+        }
+
+        if (sequence != &commands_ && sequence->command) {
+            execute(sequence, false);
+        }
+    }
+
+    /** Decode `CSI code ; modifiers u` of the kitty keyboard protocol
+     *
+     * The key is translated to its legacy encoding (ctrl+c to 0x03, alt+x to
+     * ESC x, ...) and executed with `execute_key`, so bindings don't have to
+     * know which protocol is in use.
+     */
+    void execute_key_event() {
+        const auto parameters = numeric_parameters();
+
+        if (parameters.empty() || parameters[0] <= 0) {
+            return;
+        }
+
+        char32_t code = parameters[0];
+        const int modifiers = parameters.size() > 1 && parameters[1] ? parameters[1] - 1 : 0;
+
+        const bool shift = modifiers & 1,
+                   alt = modifiers & 2,
+                   ctrl = modifiers & 4;
+
+        // functional keys are encoded in the private use area
+        if (code >= 57344 && code <= 63743) {
+            return;
+        }
+
+        if (shift && code >= 'a' && code <= 'z') {
+            code -= 'a' - 'A';
+        }
+
+        if (ctrl && (code == ' ' || (code >= '@' && code <= 0x7f))) {
+            code &= 0x1f;
+        }
+
+        execute_key((alt ? std::string(1, ESC) : ""s) + Utf8::encode(code));
+    }
+
+    /** Decode kitty keyboard protocol events */
+    void enable_key_events() {
+        add_parameterized_prefix(CSI);
+        add_command({ESC, '[', 'u'}, [this] { execute_key_event(); });
+    }
+
+    void reset_sequence() {
+        sequence_ = nullptr;
+        parameters_.clear();
+        matched_.clear();
+    }
+
+    /** Execute commands until reading is stopped or the input is exhausted
+     *
+     * With `resume` a sequence which was incomplete when the input was
+     * exhausted is continued, e.g. when the input is pushed in chunks.
+     */
+    void read_and_execute(bool resume = false) {
+
+        if (!resume) {
+            reset_sequence();
+        }
+
+        exhausted_ = false;
+
+        auto is_longest_sequence = [&] {
+            return sequence_->empty() && // sequence doesn't have subsequences
+                   sequence_->command;   // sequence has assigned command
+        };
+
+        while (!should_stop_) {
+
+            if (!sequence_) {
+                sequence_ = &commands_;
+            }
+
+            if (!next_char(curchar_)) {
+                curchar_ = EOF;
+                should_stop_ = true;
+                exhausted_ = true;
+                break;
+            }
+
+            if (!sequence_->contains(curchar_) && sequence_->accepts_parameters) {
+
+                if (is_parameter_byte(curchar_)) {
+                    parameters_.push_back(curchar_);
+                    matched_.push_back(curchar_);
+                    continue;
+                }
+
+                if (is_final_byte(curchar_)) {
+                    // unknown control sequence
+                    reset_sequence();
+                    continue;
+                }
+            }
+
+            if (!sequence_->contains(curchar_)) {
+
+                if (!sequence_->command) {
+                    run_default();
+                } else {
+                    unget_char();
+                    execute(sequence_);
+                }
+
+                reset_sequence();
+
+            } else {
+
+                sequence_ = &(*sequence_)[curchar_];
+                matched_.push_back(curchar_);
+
+                if (is_longest_sequence()) {
+                    execute(sequence_);
+                    reset_sequence();
+                }
+            }
+        }
+
+    }
+
+};
+
+/** This class parses replies to `Terminal::query_capabilities` */
+class TerminalCapabilitiesReader {
+    TerminalCapabilities capabilities_{};
+    std::istream &input_;
+    CommandReader reader_;
+
+    /** Replies read from a descriptor */
+    std::istringstream chunk_{};
+
+    void on_mode_report() {
+        // ESC [ ? mode ; value $ y, value 1/2 is set/reset, 3 is permanently set
+        auto parameters = reader_.numeric_parameters();
+
+        if (parameters.size() != 2) {
+            return;
+        }
+
+        const bool supported = parameters[1] >= 1 && parameters[1] <= 3;
+
+        switch (static_cast<PrivateMode>(parameters[0])) {
+            case PrivateMode::SynchronizedOutput:
+                capabilities_.synchronized_output = supported;
+                break;
+            case PrivateMode::BracketedPaste:
+                capabilities_.bracketed_paste = supported;
+                break;
+        }
+    }
+
+    void on_cursor_position_report() {
+        // the probe character was printed at the first column
+        auto parameters = reader_.numeric_parameters();
+
+        if (parameters.size() == 2) {
+            capabilities_.ambiguous_wide = parameters[1] == 3;
+        }
+    }
+
+public:
+    TerminalCapabilitiesReader(std::istream &is): input_{is}, reader_{is} {
+        reader_.add_parameterized_prefix(CSI);
+        reader_.add_command({ESC, '[', 'y'}, [this] { on_mode_report(); });
+        reader_.add_command({ESC, '[', 'u'}, [this] { capabilities_.kitty_keyboard = true; });
+        reader_.add_command({ESC, '[', 'R'}, [this] { on_cursor_position_report(); });
+        reader_.add_command({ESC, '[', 'c'}, [this] { reader_.stop_reading(); });
+        // input typed during the probe is dropped
+        reader_.set_default([] {});
+    }
+
+    /** Replies which don't arrive within this time aren't waited for */
+    static constexpr std::chrono::milliseconds default_timeout{300};
+
+    /** Read replies until the device attributes report arrives */
+    TerminalCapabilities read() {
+        capabilities_ = TerminalCapabilities{};
+        capabilities_.true_color = TerminalCapabilities::true_color_from_environment();
+
+        reader_.set_input(input_);
+        reader_.start_reading();
+        reader_.read_and_execute();
+
+        return capabilities_;
+    }
+
+    /** Read replies from the descriptor until the device attributes report arrives
+     *
+     * A terminal which doesn't answer, e.g. one which ignores DA1, would
+     * block forever, so nothing is returned when the report doesn't arrive
+     * before the timeout.
+     */
+    std::optional<TerminalCapabilities> read(int fd, std::chrono::milliseconds timeout = default_timeout) {
+        capabilities_ = TerminalCapabilities{};
+        capabilities_.true_color = TerminalCapabilities::true_color_from_environment();
+
+        const auto deadline = std::chrono::steady_clock::now() + timeout;
+        char data[4096];
+        bool resume = false;
+
+        reader_.set_input(chunk_);
+
+        while (true) {
+            const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                deadline - std::chrono::steady_clock::now());
+            pollfd ready{fd, POLLIN, 0};
+            const int n = left.count() > 0 ? poll(&ready, 1, left.count()) : 0;
+
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                return std::nullopt;
+            }
+
+            const auto size = ::read(fd, data, sizeof(data));
+
+            if (size == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (size <= 0) {
+                return std::nullopt;
+            }
+
+            chunk_.clear();
+            chunk_.str(std::string{data, static_cast<size_t>(size)});
+
+            reader_.start_reading();
+            reader_.read_and_execute(resume);
+            resume = true;
+
+            if (!reader_.exhausted()) {
+                return capabilities_;
+            }
+        }
+    }
+
+    /** Input which arrived after the replies */
+    std::string_view unprocessed() const {
+        return reader_.unprocessed();
+    }
+};
+
+using Completion = std::function<std::string(std::string)>;
+
+/** How much work is spent on rendering, see `Readline::set_latency_budget` */
+enum class RenderQuality {
+    /** Everything is rendered */
+    Full,
+    /** Optional decorations like bracket highlighting are skipped */
+    Reduced,
+    /** Typing and deleting redraw only the text after the cursor */
+    Minimal,
+};
+
+/** This class passes live sessions to another process over a Unix socket
+ *
+ * Every session is a descriptor, e.g. the connection of the session,
+ * passed with `SCM_RIGHTS` and the state saved by `Readline::save_state`.
+ * The old process sends its sessions and closes the socket, the new
+ * process receives them until the end and restores them.
+ */
+struct SessionHandoff {
+
+    struct Session {
+        int fd;
+        std::string state;
+    };
+
+    static int listen(const std::string &path) {
+        int fd = socket_at(path);
+        unlink(path.c_str());
+
+        if (bind(fd, address(path), sizeof(sockaddr_un)) == -1 || ::listen(fd, 1) == -1) {
+            const int error = errno;
+            close(fd);
+            throw std::system_error{error, std::generic_category()};
+        }
+
+        return fd;
+    }
+
+    static int connect(const std::string &path) {
+        int fd = socket_at(path);
+
+        if (::connect(fd, address(path), sizeof(sockaddr_un)) == -1) {
+            const int error = errno;
+            close(fd);
+            throw std::system_error{error, std::generic_category()};
+        }
+
+        return fd;
+    }
+
+    static int accept(int listener) {
+        int fd;
+
+        do {
+            fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+        } while (fd == -1 && errno == EINTR);
+
+        if (fd == -1) {
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        return fd;
+    }
+
+    /** Send the session, the descriptor stays open in this process too */
+    static void send(int socket, int fd, std::string_view state) {
+        uint64_t size = state.size();
+        iovec header{&size, sizeof(size)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+
+        msghdr message{};
+        message.msg_iov = &header;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        auto *rights = CMSG_FIRSTHDR(&message);
+        rights->cmsg_level = SOL_SOCKET;
+        rights->cmsg_type = SCM_RIGHTS;
+        rights->cmsg_len = CMSG_LEN(sizeof(int));
+        std::memcpy(CMSG_DATA(rights), &fd, sizeof(int));
+
+        ssize_t n;
+
+        do {
+            n = sendmsg(socket, &message, MSG_NOSIGNAL);
+        } while (n == -1 && errno == EINTR);
+
+        if (n != sizeof(size)) {
+            throw std::system_error{n == -1 ? errno : EPIPE, std::generic_category()};
+        }
+
+        transfer(state.size(), [&](size_t done) {
+            return ::send(socket, state.data() + done, state.size() - done, MSG_NOSIGNAL);
+        });
+    }
+
+    /** Receive the next session, nothing when the sender closed the socket */
+    static std::optional<Session> receive(int socket) {
+        uint64_t size = 0;
+        iovec header{&size, sizeof(size)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))]{};
+
+        msghdr message{};
+        message.msg_iov = &header;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+
+        ssize_t n;
+
+        do {
+            n = recvmsg(socket, &message, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+        } while (n == -1 && errno == EINTR);
+
+        if (n == 0) {
+            return std::nullopt;
+        }
+
+        auto *rights = CMSG_FIRSTHDR(&message);
+
+        if (n != sizeof(size) || !rights || rights->cmsg_type != SCM_RIGHTS) {
+            throw std::system_error{n == -1 ? errno : EPROTO, std::generic_category()};
+        }
+
+        Session session{-1, std::string(size, '\0')};
+        std::memcpy(&session.fd, CMSG_DATA(rights), sizeof(int));
+
+        try {
+            transfer(size, [&](size_t done) {
+                return recv(socket, session.state.data() + done, size - done, 0);
+            });
+        } catch (...) {
+            close(session.fd);
+            throw;
+        }
+
+        return session;
+    }
+
+private:
+    static int socket_at(const std::string &path) {
+        if (path.size() >= sizeof(sockaddr_un::sun_path)) {
+            throw std::system_error{ENAMETOOLONG, std::generic_category()};
+        }
+
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+        if (fd == -1) {
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        return fd;
+    }
+
+    static const sockaddr *address(const std::string &path) {
+        static thread_local sockaddr_un address;
+
+        address = {};
+        address.sun_family = AF_UNIX;
+        path.copy(address.sun_path, sizeof(address.sun_path) - 1);
+
+        return reinterpret_cast<const sockaddr *>(&address);
+    }
+
+    /** Call `f` with the transferred size until all is transferred */
+    template <typename F>
+    static void transfer(size_t size, F &&f) {
+        for (size_t done = 0; done < size;) {
+            const auto n = f(done);
+
+            if (n > 0) {
+                done += n;
+            } else if (n == 0) {
+                throw std::system_error{EPIPE, std::generic_category()};
+            } else if (errno != EINTR) {
+                throw std::system_error{errno, std::generic_category()};
+            }
+        }
+    }
+};
+
+/** This class edits text in an external editor
+ *
+ * The text is written to a file on tmpfs when it's available, so neither
+ * writing nor reading it back touches the disk.
+ */
+struct ExternalEditor {
+
+    /** Directory for the edited file */
+    static std::string directory() {
+        if (access("/dev/shm", W_OK) == 0) {
+            return "/dev/shm";
+        }
+
+        const char *tmpdir = std::getenv("TMPDIR");
+        return tmpdir && *tmpdir ? tmpdir : "/tmp";
+    }
+
+    /** Create a file with the text, returns its path */
+    static std::string create_file(std::string_view text) {
+        std::string path{directory() + "/readline-edit-XXXXXX"};
+        int fd = mkstemp(path.data());
+
+        if (fd == -1) {
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        while (!text.empty()) {
+            ssize_t written = ::write(fd, text.data(), text.size());
+
+            if (written == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (written == -1) {
+                const auto error = errno;
+                close(fd);
+                unlink(path.c_str());
+                throw std::system_error{error, std::generic_category()};
+            }
+
+            text.remove_prefix(written);
+        }
+
+        close(fd);
+        return path;
+    }
+
+    /** Run `$VISUAL` or `$EDITOR` on the file, returns whether it succeeded
+     *
+     * Interrupts are ignored while the editor is running, like `system` does.
+     */
+    static bool run(const std::string &path) {
+        struct sigaction ignore{}, interrupt{}, quit{};
+        ignore.sa_handler = SIG_IGN;
+        sigemptyset(&ignore.sa_mask);
+
+        sigaction(SIGINT, &ignore, &interrupt);
+        sigaction(SIGQUIT, &ignore, &quit);
+
+        pid_t pid = fork();
+
+        if (pid == 0) {
+            sigaction(SIGINT, &interrupt, nullptr);
+            sigaction(SIGQUIT, &quit, nullptr);
+
+            execl("/bin/sh", "sh", "-c", "${VISUAL:-${EDITOR:-vi}} \"$1\"", "sh", path.c_str(), nullptr);
+            _exit(127);
+        }
+
+        int status = 0;
+
+        while (pid != -1 && waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+        }
+
+        sigaction(SIGINT, &interrupt, nullptr);
+        sigaction(SIGQUIT, &quit, nullptr);
+
+        return pid != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    }
+};
+
+/** Decides whether the statement is complete, it's given the statement line by line */
+using Continuation = std::function<bool(std::string_view)>;
+
+/** This class decides whether an SQL-like statement is complete
+ *
+ * Lines are given one by one and only the new line is scanned, the state
+ * at the end of the previous line is kept. The statement is complete when
+ * it's outside of quotes and comments, parentheses are balanced and it's
+ * terminated by `;`. An empty statement is complete too.
+ */
+class StatementLexer {
+    enum class State {
+        Code,
+        SingleQuote,
+        DoubleQuote,
+        BlockComment,
+    };
+
+    State state_{State::Code};
+
+    /** Depth of parentheses */
+    long depth_{0};
+
+    /** The last token is `;` */
+    bool terminated_{false};
+
+    /** Nothing but whitespace and comments was seen */
+    bool empty_{true};
+
+public:
+    /** Scan the line, returns whether the statement is complete */
+    bool operator()(std::string_view line) {
+        for (size_t i = 0; i < line.size(); i++) {
+            const auto ch = line[i];
+            const auto next = i + 1 < line.size() ? line[i + 1] : '\0';
+
+            switch (state_) {
+                case State::SingleQuote:
+                    state_ = ch == '\'' ? State::Code : state_;
+                    continue;
+                case State::DoubleQuote:
+                    state_ = ch == '"' ? State::Code : state_;
+                    continue;
+                case State::BlockComment:
+                    if (ch == '*' && next == '/') {
+                        state_ = State::Code;
+                        i++;
+                    }
+                    continue;
+                case State::Code:
+                    break;
+            }
+
+            if (ch == '-' && next == '-') {
+                break;
+            }
+
+            if (ch == '/' && next == '*') {
+                state_ = State::BlockComment;
+                i++;
+                continue;
+            }
+
+            if (std::isspace(static_cast<unsigned char>(ch))) {
+                continue;
+            }
+
+            empty_ = false;
+            terminated_ = ch == ';';
+
+            if (ch == '\'') {
+                state_ = State::SingleQuote;
+            } else if (ch == '"') {
+                state_ = State::DoubleQuote;
+            } else if (ch == '(') {
+                depth_++;
+            } else if (ch == ')') {
+                depth_--;
+            }
+        }
+
+        return complete();
+    }
+
+    bool complete() const {
+        return empty_ || (state_ == State::Code && depth_ <= 0 && terminated_);
+    }
+};
+
+/** This class stores killed text */
+class KillRing {
+    std::vector<std::string> entries_{};
+
+    /** Maximum killed entries */
+    size_t max_entries_{16};
+
+public:
+    void push(std::string_view text) {
+        if (entries_.size() >= max_entries_) {
+            entries_.erase(entries_.begin());
+        }
+
+        entries_.emplace_back(text);
+    }
+
+    /** The most recently killed text */
+    std::string_view top() const {
+        return entries_.empty() ? std::string_view{} : std::string_view{entries_.back()};
+    }
+
+    bool empty() const {
+        return entries_.empty();
+    }
+
+    size_t memory_usage() const {
+        size_t bytes = MemoryUsage::of(entries_);
+
+        for (auto &entry: entries_) {
+            bytes += MemoryUsage::of(entry);
+        }
+
+        return bytes;
+    }
+
+    void save_state(SessionState &state) const {
+        state.put_number(entries_.size());
+
+        for (auto &entry: entries_) {
+            state.put_text(entry);
+        }
+    }
+
+    void load_state(SessionState &state) {
+        entries_.resize(state.count());
+
+        for (auto &entry: entries_) {
+            entry = state.text();
+        }
+    }
+
+    void release() {
+        std::vector<std::string>{}.swap(entries_);
+    }
+};
+
+/** Edits which can be applied to the line with `Readline::edit` */
+struct Edit {
+    /** Insert text at the cursor */
+    struct InsertText {
+        std::string text;
+    };
+
+    /** Move the cursor by characters, negative count moves to the left */
+    struct MoveCursor {
+        long characters;
+    };
+
+    /** Delete bytes in the range [begin, end) */
+    struct DeleteRange {
+        size_t begin;
+        size_t end;
+    };
+
+    /** Replace the whole line, the cursor is placed at the end */
+    struct ReplaceBuffer {
+        std::string text;
+    };
+
+    /** Place the cursor at the byte position */
+    struct SetCursor {
+        size_t position;
+    };
+};
+
+using EditAction = std::variant<Edit::InsertText,
+                                Edit::MoveCursor,
+                                Edit::DeleteRange,
+                                Edit::ReplaceBuffer,
+                                Edit::SetCursor>;
+
+class Readline {
+    private:
+        Buffer buffer_;
+
+        /** The standard input read directly, see `FdInputStream` */
+        FdInputStream standard_input_{STDIN_FILENO};
+
+        std::reference_wrapper<std::istream> input_{standard_input_};
+
+        HistoryView history_{};
+
+        TerminalSettings settings_{};
+        Terminal terminal_{};
+
+        Prompt prompter_{};
+
+        /** Prompt of continuation lines */
+        Prompt continuation_prompter_{};
+        Completion completion_{};
+
+        CommandReader command_reader_{input_.get()};
+
+        /** Render only the part of the buffer around the cursor in a single row */
+        bool horizontal_scroll_{false};
+
+        /** Position of the first visible byte when scrolling horizontally */
+        size_t scroll_offset_{0};
+
+        /** Commands don't redraw the line, e.g. while a macro is played */
+        bool render_suspended_{false};
+
+        /** The last defined keyboard macro */
+        KeyboardMacro macro_{};
+
+        KillRing kill_ring_{};
+
+        /** Killed and copied text is put to the system clipboard too */
+        bool clipboard_{false};
+
+        /** Search within the line */
+        struct LineSearch {
+            bool forward;
+
+            /** Incremental search, otherwise search for the next typed character */
+            bool incremental;
+
+            std::string pattern;
+
+            /** Cursor position where the search started */
+            size_t origin;
+
+            /** Serial of the last command which belongs to the search */
+            size_t serial;
+        };
+
+        std::optional<LineSearch> search_{};
+
+        /** Decides whether the statement is complete, copied for every read */
+        Continuation complete_{};
+        Continuation continuation_{};
+
+        /** Lines of an incomplete statement, the buffer holds the last one */
+        std::string statement_{};
+
+        /** Longest acceptable processing of a key, zero disables degradation */
+        std::chrono::steady_clock::duration latency_budget_{};
+
+        RenderQuality quality_{RenderQuality::Full};
+
+        /** Size of the line when the quality was lowered */
+        size_t degraded_size_{0};
+
+        /** Highlight the bracket matching the one at the cursor */
+        bool bracket_matching_{false};
+
+        /** Position of the highlighted bracket */
+        std::optional<size_t> highlighted_{};
+
+        /** Input pushed by `feed` */
+        std::istringstream fed_{};
+
+        /** A line was started in the push mode */
+        bool line_started_{false};
+
+        /** Kitty keyboard flags were pushed for the current line */
+        bool key_events_{false};
+
+        /** The line was accepted, otherwise the input ended */
+        bool accepted_{false};
+
+        /** Saved state of a hibernated session */
+        std::optional<std::string> hibernated_{};
+
+        /** Version of the hibernated state */
+        static constexpr size_t state_version_ = 1;
+
+    protected:
+        /** The prompt of the current line */
+        Prompt &prompt() {
+            return statement_.empty() || !continuation_prompter_ ? prompter_ : continuation_prompter_;
+        }
+
+        const Prompt &prompt() const {
+            return statement_.empty() || !continuation_prompter_ ? prompter_ : continuation_prompter_;
+        }
+
+        /** Column where the buffer starts */
+        size_t buffer_column() const {
+            return prompt().width() + 1;
+        }
+
+        /** Number of columns available for the buffer
+         *
+         * The last column is kept free for the cursor at the end of the line.
+         */
+        size_t text_columns() const {
+            const auto used = prompt().width() + 1;
+            return terminal_.columns() > used ? terminal_.columns() - used : 1;
+        }
+
+        /** Only a window of the buffer is drawn
+         *
+         * A line spilled to a file is always scrolled, writing all of it
+         * would read it back on every key.
+         */
+        bool scrolling() const {
+            return horizontal_scroll_ || buffer_.spilled();
+        }
+
+        /** Whether the cursor is inside the visible part of the buffer */
+        bool cursor_in_window() const {
+            if (!scrolling()) {
+                return true;
+            }
+
+            const auto cursor = buffer_.position();
+
+            if (cursor < scroll_offset_) {
+                return false;
+            }
+
+            const auto before_cursor = buffer_.view().substr(scroll_offset_, cursor - scroll_offset_);
+            return Utf8::prefix_by_width(before_cursor, text_columns()) == before_cursor.size();
+        }
+
+        /** Scroll, so the cursor is visible */
+        void scroll_to_cursor() {
+            const auto cursor = buffer_.position();
+
+            if (cursor < scroll_offset_) {
+                scroll_offset_ = cursor;
+            } else if (!cursor_in_window()) {
+                scroll_offset_ = cursor - Utf8::suffix_by_width(buffer_.view().substr(0, cursor), text_columns());
+            }
+        }
+
+        /** Move the terminal cursor to the buffer position */
+        void place_cursor() {
+            const auto begin = scrolling() ? scroll_offset_ : 0;
+            const auto before_cursor = buffer_.view().substr(begin, buffer_.position() - begin);
+
+            terminal_.move_cursor_horizontal_absolute(buffer_column() + Utf8::width(before_cursor));
+        }
+
+        /** Redraw the buffer and place the cursor
+         *
+         * When scrolling horizontally only the visible window is written,
+         * so the cost is bounded by the terminal width.
+         */
+        void refresh_line() {
+            if (render_suspended_) {
+                return;
+            }
+
+            terminal_.move_cursor_horizontal_absolute(buffer_column());
+
+            if (scrolling()) {
+                scroll_to_cursor();
+
+                const auto visible = buffer_.view().substr(scroll_offset_);
+                terminal_.write(visible.substr(0, Utf8::prefix_by_width(visible, text_columns())));
+            } else {
+                terminal_.write(buffer_.view());
+            }
+
+            terminal_.clear_the_line();
+
+            highlighted_.reset();
+            update_match();
+
+            place_cursor();
+            terminal_.flush();
+        }
+
+        /** The bracket matching the one at the cursor or the closing one before it */
+        std::optional<size_t> matching_bracket() const {
+            const auto text = buffer_.view();
+            const auto pos = buffer_.position();
+
+            if (pos < text.size() && BracketIndex::tokens.find(text[pos]) != std::string_view::npos) {
+                return buffer_.matching_bracket(pos);
+            }
+
+            if (pos && std::string_view{")]}"}.find(text[pos - 1]) != std::string_view::npos) {
+                return buffer_.matching_bracket(pos - 1);
+            }
+
+            return std::nullopt;
+        }
+
+        /** Draw the single byte character at the position, if it's visible */
+        void draw_char(size_t pos, bool highlight) {
+            const auto begin = scrolling() ? scroll_offset_ : 0;
+
+            if (pos < begin) {
+                return;
+            }
+
+            const auto before = buffer_.view().substr(begin, pos - begin);
+
+            if (scrolling() && Utf8::prefix_by_width(before, text_columns() - 1) != before.size()) {
+                return;
+            }
+
+            terminal_.move_cursor_horizontal_absolute(buffer_column() + Utf8::width(before));
+
+            if (highlight) {
+                terminal_.reverse_graphics();
+            }
+
+            terminal_.write(buffer_.view().substr(pos, 1));
+
+            if (highlight) {
+                terminal_.normal_graphics();
+            }
+        }
+
+        /** Move the highlight to the bracket matching the one at the cursor
+         *
+         * Returns whether anything was drawn, the cursor has to be placed then.
+         */
+        bool update_match() {
+            if (!bracket_matching_) {
+                return false;
+            }
+
+            // indexing a spilled line would read all of it back
+            const auto match = quality_ == RenderQuality::Full && !buffer_.spilled() ? matching_bracket() : std::nullopt;
+
+            if (match == highlighted_) {
+                return false;
+            }
+
+            if (highlighted_) {
+                draw_char(*highlighted_, false);
+            }
+
+            if (match) {
+                draw_char(*match, true);
+            }
+
+            highlighted_ = match;
+            return true;
+        }
+
+        /** Update the terminal cursor after the buffer cursor moved
+         *
+         * The cursor is moved relatively, the line is redrawn only when the
+         * cursor leaves the visible window.
+         */
+        void cursor_moved(size_t previous) {
+            const auto position = buffer_.position();
+
+            if (render_suspended_ || position == previous) {
+                return;
+            }
+
+            if (!cursor_in_window()) {
+                return refresh_line();
+            }
+
+            // a zero count moves by one cell, zero width characters don't move the cursor
+            if (position < previous) {
+                if (auto width = Utf8::width(buffer_.view().substr(position, previous - position))) {
+                    terminal_.move_cursor_backward(width);
+                }
+            } else if (auto width = Utf8::width(buffer_.view().substr(previous, position - previous))) {
+                terminal_.move_cursor_forward(width);
+            }
+
+            if (update_match()) {
+                place_cursor();
+            }
+
+            terminal_.flush();
+        }
+
+        /** Whether the previous command belongs to a search */
+        bool searching() const {
+            return search_ && search_->serial + 1 == command_reader_.serial();
+        }
+
+        /** Move the cursor to the match of the search pattern
+         *
+         * Forward search finds a match starting at or after `from`, backward
+         * search a match starting at or before it.
+         */
+        bool find_pattern(size_t from) {
+            const auto text = buffer_.view();
+            const auto &pattern = search_->pattern;
+            const auto found = search_->forward ? TextSearch::find(text, pattern, from)
+                                                : TextSearch::rfind(text, pattern, from + 1);
+
+            if (found == TextSearch::npos) {
+                return false;
+            }
+
+            const auto previous = buffer_.position();
+            buffer_.set_position(found);
+            cursor_moved(previous);
+            return true;
+        }
+
+        /** Typed text is the search pattern while searching
+         *
+         * Returns the rest of the text, which is inserted to the buffer.
+         */
+        std::string_view search_text(std::string_view text) {
+            if (!searching()) {
+                search_.reset();
+                return text;
+            }
+
+            const auto position = buffer_.position();
+
+            if (search_->incremental) {
+                search_->pattern.append(text);
+                search_->serial = command_reader_.serial();
+                find_pattern(position);
+                return {};
+            }
+
+            const auto length = Utf8::sequence_length(text[0]);
+            search_->pattern = text.substr(0, length);
+
+            if (search_->forward) {
+                find_pattern(position + 1);
+            } else if (position) {
+                find_pattern(position - 1);
+            }
+
+            search_.reset();
+            return text.substr(length);
+        }
+
+        /** Typing and deleting redraw only the text after the cursor */
+        bool suffix_redraw() const {
+            return quality_ == RenderQuality::Minimal && !scrolling() && !render_suspended_;
+        }
+
+        /** Redraw the text after the position, the terminal cursor must be there
+         *
+         * The cost depends only on the text after the cursor, not on the
+         * length of the line.
+         */
+        void refresh_suffix(size_t from) {
+            terminal_.write(buffer_.view().substr(from));
+            terminal_.clear_the_line();
+
+            if (auto after = Utf8::width(buffer_.view().substr(buffer_.position()))) {
+                terminal_.move_cursor_backward(after);
+            }
+
+            terminal_.flush();
+        }
+
+        /** Lower the rendering quality when a key took longer than the budget
+         *
+         * The quality is restored step by step when the line shrinks to the
+         * half of its size at the time it was lowered, and for every new line.
+         */
+        void on_command_finished(std::chrono::steady_clock::duration elapsed) {
+            if (latency_budget_ == std::chrono::steady_clock::duration::zero()) {
+                return;
+            }
+
+            if (elapsed > latency_budget_ && quality_ != RenderQuality::Minimal) {
+                quality_ = static_cast<RenderQuality>(static_cast<int>(quality_) + 1);
+                degraded_size_ = buffer_.size();
+            } else if (quality_ != RenderQuality::Full && buffer_.size() < degraded_size_ / 2) {
+                quality_ = static_cast<RenderQuality>(static_cast<int>(quality_) - 1);
+                degraded_size_ = buffer_.size();
+            }
+        }
+
+        void do_write_char() {
+            const char ch = command_reader_.current_char();
+
+            if (search_text(std::string_view{&ch, 1}).empty()) {
+                return;
+            }
+
+            buffer_.insert(ch);
+            refresh_line();
+        }
+
+        /** Insert a run of text with a single redraw */
+        void do_insert_text() {
+            const auto text = search_text(command_reader_.current_text());
+
+            if (text.empty()) {
+                return;
+            }
+
+            const auto position = buffer_.position();
+            buffer_.insert(text);
+
+            if (suffix_redraw()) {
+                return refresh_suffix(position);
+            }
+
+            refresh_line();
+        }
+
+        void do_backspace() {
+            if (searching() && search_->incremental) {
+                auto &pattern = search_->pattern;
+
+                for (size_t i = 0; i < command_reader_.repeat_count() && !pattern.empty(); i++) {
+                    pattern.resize(Utf8::previous_codepoint(pattern, pattern.size()));
+                }
+
+                search_->serial = command_reader_.serial();
+
+                const auto previous = buffer_.position();
+                buffer_.set_position(search_->origin);
+
+                if (!pattern.empty()) {
+                    find_pattern(search_->origin);
+                }
+
+                cursor_moved(previous);
+                return;
+            }
+
+            if (buffer_.position()) {
+                const auto position = buffer_.position();
+                const auto begin = buffer_.characters_before(position, command_reader_.repeat_count());
+
+                if (suffix_redraw()) {
+                    if (auto width = Utf8::width(buffer_.view().substr(begin, position - begin))) {
+                        terminal_.move_cursor_backward(width);
+                    }
+
+                    buffer_.erase(begin, position);
+                    return refresh_suffix(begin);
+                }
+
+                buffer_.erase(begin, position);
+                refresh_line();
+            }
+        }
+
+        void do_clear_line() {
+            buffer_.clear();
+            scroll_offset_ = 0;
+            refresh_line();
+        }
+
+        void do_accept_command() {
+            if (render_suspended_) {
+                render_suspended_ = false;
+                refresh_line();
+            }
+
+            if (highlighted_) {
+                draw_char(*highlighted_, false);
+                highlighted_.reset();
+            }
+
+            // only the new line is scanned, the continuation keeps its state
+            if (continuation_ && !continuation_(buffer_.view())) {
+                return do_continue_statement();
+            }
+
+            terminal_.write("\n");
+            add_history();
+            history_.reset_position();
+            terminal_.move_cursor_horizontal_absolute();
+            terminal_.flush();
+            accepted_ = true;
+            command_reader_.stop_reading();
+        }
+
+        /** Keep the incomplete line and continue the statement on the next one */
+        void do_continue_statement() {
+            statement_.append(buffer_.view());
+            statement_.push_back('\n');
+
+            buffer_.clear();
+            scroll_offset_ = 0;
+
+            terminal_.write("\n");
+            terminal_.move_cursor_horizontal_absolute();
+            do_print_prompt();
+            terminal_.flush();
+        }
+
+        void do_control_d() {
+            if (buffer_.empty()) {
+                command_reader_.stop_reading();
+            }
+        }
+
+        void do_move_left() {
+            if (buffer_.position()) {
+                const auto position = buffer_.position();
+                buffer_.move_left(command_reader_.repeat_count());
+                cursor_moved(position);
+            }
+        }
+
+        void do_move_right() {
+            if (buffer_.position() < buffer_.size()) {
+                const auto position = buffer_.position();
+                buffer_.move_right(command_reader_.repeat_count());
+                cursor_moved(position);
+            }
+        }
+
+        void do_history_up() {
+            if (history_.size()) {
+                buffer_.reset(history_.previous());
+                scroll_offset_ = 0;
+                refresh_line();
+            }
+        }
+
+        void do_history_down() {
+            if (history_.size()) {
+                buffer_.reset(history_.next());
+                scroll_offset_ = 0;
+                refresh_line();
+            }
+        }
+
+        void do_autocomplete() {
+            if (completion_) {
+                // assign to the buffer string from the completion function
+                buffer_.reset(completion_(buffer_.data()));
+                scroll_offset_ = 0;
+                refresh_line();
+            }
+        }
+
+
+        /** Ill-formed sequences are replaced like in typed text */
+        void apply(const Edit::InsertText &action) {
+            if (Utf8::valid_prefix(action.text) == action.text.size()) {
+                buffer_.insert(action.text);
+            } else {
+                buffer_.insert(Utf8::sanitize(action.text));
+            }
+        }
+
+        void apply(const Edit::MoveCursor &action) {
+            if (action.characters < 0) {
+                buffer_.move_left(-action.characters);
+            } else {
+                buffer_.move_right(action.characters);
+            }
+        }
+
+        /** Both ends are clamped to the line and moved to the start of the character they are in */
+        void apply(const Edit::DeleteRange &action) {
+            const auto text = buffer_.view();
+
+            auto snap = [&](size_t pos) {
+                pos = std::min(pos, text.size());
+
+                while (pos && pos < text.size() && Utf8::is_continuation(text[pos])) {
+                    pos--;
+                }
+
+                return pos;
+            };
+
+            const auto end = snap(action.end);
+            buffer_.erase(std::min(snap(action.begin), end), end);
+        }
+
+        void apply(const Edit::ReplaceBuffer &action) {
+            if (Utf8::valid_prefix(action.text) == action.text.size()) {
+                buffer_.reset(action.text);
+            } else {
+                buffer_.reset(Utf8::sanitize(action.text));
+            }
+        }
+
+        void apply(const Edit::SetCursor &action) {
+            buffer_.set_position(action.position);
+        }
+
+        void do_set_mark() {
+            buffer_.set_mark();
+        }
+
+        void do_exchange_point_and_mark() {
+            buffer_.exchange_point_and_mark();
+            refresh_line();
+        }
+
+        void kill(std::string_view text) {
+            kill_ring_.push(text);
+
+            if (clipboard_) {
+                terminal_.copy_to_clipboard(text);
+            }
+        }
+
+        void do_copy_region() {
+            if (buffer_.has_mark()) {
+                kill(buffer_.region_view());
+            }
+        }
+
+        void do_kill_region() {
+            if (buffer_.has_mark()) {
+                auto [begin, end] = buffer_.region();
+
+                kill(buffer_.region_view());
+                buffer_.erase(begin, end);
+                refresh_line();
+            }
+        }
+
+        void do_yank() {
+            if (!kill_ring_.empty()) {
+                buffer_.set_mark();
+                buffer_.insert(kill_ring_.top());
+                refresh_line();
+            }
+        }
+
+        void do_convert_region(LetterCase to) {
+            if (buffer_.has_mark()) {
+                auto [begin, end] = buffer_.region();
+
+                buffer_.convert_case(begin, end, to);
+                refresh_line();
+            }
+        }
+
+        void do_capitalize_region() {
+            if (buffer_.has_mark()) {
+                auto [begin, end] = buffer_.region();
+
+                buffer_.capitalize(begin, end);
+                refresh_line();
+            }
+        }
+
+        void do_transpose_words() {
+            buffer_.transpose_words();
+            refresh_line();
+        }
+
+        /** The next typed character is searched for */
+        void do_character_search(bool forward) {
+            search_ = LineSearch{forward, false, {}, buffer_.position(), command_reader_.serial()};
+        }
+
+        /** Start incremental search, or jump to the next match when searching */
+        void do_search(bool forward) {
+            const auto serial = command_reader_.serial();
+
+            if (!searching() || !search_->incremental) {
+                search_ = LineSearch{forward, true, {}, buffer_.position(), serial};
+                return;
+            }
+
+            search_->forward = forward;
+            search_->serial = serial;
+
+            const auto position = buffer_.position();
+
+            if (search_->pattern.empty()) {
+                return;
+            }
+
+            if (forward) {
+                find_pattern(position + 1);
+            } else if (position) {
+                find_pattern(position - 1);
+            }
+        }
+
+        void do_jump_to_matching_bracket() {
+            if (auto match = matching_bracket()) {
+                const auto previous = buffer_.position();
+                buffer_.set_position(*match);
+                cursor_moved(previous);
+            }
+        }
+
+        /** Edit the line in the external editor
+         *
+         * The edited file is opened again by its path, because editors
+         * often replace the file instead of writing to it. When the file
+         * can't be written or read back, or the editor fails, the line is
+         * kept and the bell rings.
+         */
+        void do_edit_in_editor() {
+            std::string path;
+
+            try {
+                path = ExternalEditor::create_file(buffer_.view());
+            } catch (const std::system_error &) {
+                terminal_.ring_bell();
+                return;
+            }
+
+            terminal_.suspend();
+            const bool edited = ExternalEditor::run(path);
+            terminal_.resume();
+
+            bool loaded = false;
+
+            if (int fd = edited ? open(path.c_str(), O_RDWR | O_CLOEXEC) : -1; fd != -1) {
+                const std::string original{buffer_.view()};
+                const auto position = buffer_.position();
+
+                try {
+                    buffer_.load(fd);
+                    loaded = true;
+                } catch (const std::system_error &) {
+                    buffer_.reset(original);
+                    buffer_.set_position(position);
+                }
+
+                // editors end the file with a newline
+                if (loaded && !buffer_.empty() && buffer_.view().back() == '\n') {
+                    buffer_.erase(buffer_.size() - 1, buffer_.size());
+                }
+            }
+
+            unlink(path.c_str());
+
+            if (!loaded) {
+                terminal_.ring_bell();
+            }
+
+            scroll_offset_ = 0;
+            terminal_.move_cursor_horizontal_absolute();
+            do_print_prompt();
+            refresh_line();
+        }
+
+        void do_start_macro() {
+            command_reader_.start_recording();
+        }
+
+        void do_end_macro() {
+            if (command_reader_.recording()) {
+                macro_ = command_reader_.stop_recording();
+            }
+        }
+
+        /** Play the last macro, repeated calls are merged and drawn once */
+        void do_call_macro() {
+            // the call does nothing while recording, so it isn't recorded either
+            if (command_reader_.recording()) {
+                command_reader_.skip_recording();
+                return;
+            }
+
+            if (macro_.empty()) {
+                return;
+            }
+
+            render_suspended_ = true;
+            command_reader_.play(macro_, command_reader_.repeat_count());
+
+            // the line could be accepted by the macro
+            if (render_suspended_) {
+                render_suspended_ = false;
+                refresh_line();
+            }
+        }
+
+        void do_print_prompt() {
+            if (auto &p = prompt()) {
+                terminal_.write(p());
+            }
+        }
+
+        void add_history() {
+            if (!statement_.empty()) {
+                history_.add_line(statement_ + buffer_.data());
+                return;
+            }
+
+            // a line which didn't fit into memory isn't worth keeping
+            if (!buffer_.spilled()) {
+                history_.add_line(buffer_.data());
+            }
+        }
+        /** Add the commands to the command reader, the sequences are released by hibernation */
+        void bind_commands() {
+            command_reader_.set_command_observer([this](auto elapsed) { on_command_finished(elapsed); });
+            command_reader_.enable_key_events();
+            command_reader_.add_command(CTRL_U, [this] { do_clear_line(); });
+            command_reader_.add_command(CTRL_C, [this] { do_clear_line(); });
+            command_reader_.add_repeatable_command(BACKSPACE, [this] { do_backspace(); });
+            command_reader_.add_command(CTRL_D, [this] { do_control_d(); });
+            command_reader_.add_command(NEWLINE, [this] { do_accept_command(); });
+            command_reader_.add_command(TAB, [this] { do_autocomplete(); });
+            command_reader_.add_repeatable_command(MOVE_LEFT, [this] { do_move_left(); });
+            command_reader_.add_repeatable_command(MOVE_RIGHT, [this] { do_move_right(); });
+            command_reader_.add_command(MOVE_DOWN, [this] { do_history_up(); });
+            command_reader_.add_command(MOVE_UP, [this] { do_history_down(); });
+            command_reader_.add_command(START_MACRO, [this] { do_start_macro(); });
+            command_reader_.add_command(END_MACRO, [this] { do_end_macro(); });
+            command_reader_.add_repeatable_command(CALL_MACRO, [this] { do_call_macro(); });
+            command_reader_.add_command(CTRL_SPACE, [this] { do_set_mark(); });
+            command_reader_.add_command(EXCHANGE_POINT_AND_MARK, [this] { do_exchange_point_and_mark(); });
+            command_reader_.add_command(CTRL_W, [this] { do_kill_region(); });
+            command_reader_.add_command(COPY_REGION, [this] { do_copy_region(); });
+            command_reader_.add_command(CTRL_Y, [this] { do_yank(); });
+            command_reader_.add_command(UPCASE_REGION, [this] { do_convert_region(LetterCase::Upper); });
+            command_reader_.add_command(DOWNCASE_REGION, [this] { do_convert_region(LetterCase::Lower); });
+            command_reader_.add_command(CAPITALIZE_REGION, [this] { do_capitalize_region(); });
+            command_reader_.add_command(TRANSPOSE_WORDS, [this] { do_transpose_words(); });
+            command_reader_.add_command(CHARACTER_SEARCH, [this] { do_character_search(true); });
+            command_reader_.add_command(CHARACTER_SEARCH_BACKWARD, [this] { do_character_search(false); });
+            command_reader_.add_command(SEARCH_FORWARD, [this] { do_search(true); });
+            command_reader_.add_command(SEARCH_BACKWARD, [this] { do_search(false); });
+            command_reader_.add_command(MATCHING_BRACKET, [this] { do_jump_to_matching_bracket(); });
+            command_reader_.add_command(EDIT_IN_EDITOR, [this] { do_edit_in_editor(); });
+            command_reader_.set_default([this] { do_write_char(); });
+            command_reader_.set_self_insert([this] { do_insert_text(); });
+        }
+
+        /** Line, history, kill ring and the input which wasn't executed yet */
+        void save_session(SessionState &state) {
+            state.put_number(state_version_);
+            buffer_.save_state(state);
+            state.put_text(statement_);
+            history_.save_state(state);
+            kill_ring_.save_state(state);
+            state.put_text(command_reader_.take_unprocessed());
+        }
+
+        void load_session(SessionState &state) {
+            if (state.number() != state_version_) {
+                throw std::runtime_error("Unknown session state version");
+            }
+
+            buffer_.load_state(state);
+            statement_ = state.text();
+            history_.load_state(state);
+            kill_ring_.load_state(state);
+            command_reader_.unread(state.text());
+        }
+
+        void begin_line() {
+            accepted_ = false;
+            buffer_.clear();
+            statement_.clear();
+            continuation_ = complete_;
+            quality_ = RenderQuality::Full;
+            scroll_offset_ = 0;
+            command_reader_.start_reading();
+            terminal_.update_size();
+            terminal_.move_cursor_horizontal_absolute();
+            do_print_prompt();
+
+            // ESC is reported as a complete sequence, so no key is ambiguous
+            key_events_ = terminal_.capabilities().kitty_keyboard;
 
-    void insert(const SequenceChar &ch, const Command &command) {
-        auto && sequence = std::initializer_list<SequenceChar>{ch};
-        insert(std::begin(sequence), std::end(sequence), command);
-    }
+            if (key_events_) {
+                terminal_.push_keyboard_flags(KeyboardFlags::DisambiguateEscapeCodes);
+            }
 
-    bool contains(const SequenceChar &k) const {
-        return sequences.count(k) >= 1;
-    }
+            terminal_.flush();
+        }
 
-    bool empty() const {
-        return sequences.empty();
-    }
+        std::string_view finish_line() {
+            if (key_events_) {
+                terminal_.pop_keyboard_flags();
+                key_events_ = false;
+            }
 
-    const CommandSequences &operator[](const SequenceChar &k) const {
-        return *sequences.at(k);
-    }
+            terminal_.flush();
 
-    const CommandSequences &operator[](const std::initializer_list<SequenceChar> &sequence) const {
-        const CommandSequences *subsequence = this;
+            if (!statement_.empty()) {
+                statement_.append(buffer_.view());
+                return statement_;
+            }
 
-        for (auto &&key: sequence) {
-            subsequence = subsequence->sequences.at(key).get();
+            return buffer_.view();
         }
 
-        return *subsequence;
-    }
+    public:
+        Readline() {
+            bind_commands();
+        }
 
-    void operator() () const {
-        command();
-    }
-};
+//        Readline(const Readline &) = default;
+//        Readline(Readline &&) = default;
 
+        ~Readline() { terminal_.reset_settings(); }
 
-struct CommandReader {
+        std::string read(void) {
+            return std::string{read_view()};
+        }
 
-    /**
-     * All defined commands
-     */
-    CommandSequences commands_;
+        /** Read a line without copying it
+         *
+         * The view is valid until the next call, it's the only way to get
+         * a line which was spilled to the disk without loading it to memory.
+         */
+        std::string_view read_view(void) {
+            wake();
+            begin_line();
+            command_reader_.read_and_execute();
+            return finish_line();
+        }
 
-    /**
-     * Default command
-     *
-     * It's called when no command matches the input sequence
-     */
-    typename CommandSequences::Command default_;
+        /** Start a line in the push mode, see `feed` */
+        void start_line() {
+            wake();
 
-    /** Data source */
-    std::istream &input_;
+            if (!line_started_) {
+                line_started_ = true;
+                begin_line();
+            }
+        }
 
-    /** Does EOF occured */
-    bool should_stop_{false};
+        /** Process the input in the push mode
+         *
+         * Instead of reading the input stream, the caller passes the input
+         * as it arrives, e.g. from a socket. A sequence split between calls
+         * is continued. `on_line` is called with every accepted line, as it
+         * would be returned by `read_view`, and the next line is started.
+         */
+        template <typename F>
+        void feed(std::string_view input, F &&on_line) {
+            start_line();
 
-    /** Last readed character */
-    char curchar_{'\0'};
+            fed_.clear();
+            fed_.str(std::string{input});
+            command_reader_.set_input(fed_);
 
-    CommandReader(std::istream &is): input_{is} {}
+            while (true) {
+                command_reader_.start_reading();
+                command_reader_.read_and_execute(true);
 
-    template <typename CharType, typename F>
-    void add_command(const std::initializer_list<CharType> &key, F &&f) {
-        commands_.insert(key, f);
-    }
+                if (command_reader_.exhausted()) {
+                    break;
+                }
 
-    template <typename CharType, typename F>
-    void add_command(const CharType &key, F &&f) {
-        commands_.insert(key, f);
-    }
+                line_started_ = false;
+                on_line(finish_line());
+                start_line();
+            }
 
-    template <typename F>
-    void set_default(F &&f) {
-        default_ = f;
-    }
+            fed_.str({});
+            command_reader_.set_input(input_.get());
+        }
 
-    void stop_reading() { should_stop_ = true; }
-    void start_reading() { should_stop_ = false; }
-    char current_char() const { return curchar_; }
+        /** Save the session to a compact state and free its memory
+         *
+         * It's meant for idle sessions, the session is restored by the next
+         * `feed`, `start_line`, `read` or `edit`. The line, history, kill ring
+         * and input which wasn't executed yet are saved, the command
+         * sequences are added again when the session is restored. A line
+         * which was moved to a temporary file isn't hibernated. Returns
+         * whether the session was hibernated.
+         */
+        bool hibernate() {
+            if (hibernated_) {
+                return true;
+            }
 
-    void read_and_execute() {
+            if (buffer_.spilled()) {
+                return false;
+            }
 
-        const CommandSequences *sequence = &commands_;
+            SessionState state{};
+            save_session(state);
 
-        auto reset_sequence = [&] {
-            sequence = &commands_;
-        };
+            buffer_.release();
+            std::string{}.swap(statement_);
+            history_.release();
+            kill_ring_.release();
+            command_reader_.release();
+            terminal_.release();
 
-        auto run_default = [&] {
-            if (default_) {
-                default_();
-            } else {
-                throw std::runtime_error("Unknown command: " + std::to_string((int)curchar_));
+            hibernated_ = state.release();
+            hibernated_->shrink_to_fit();
+            return true;
+        }
+
+        bool hibernated() const {
+            return hibernated_.has_value();
+        }
+
+        /** Restore a hibernated session, nothing is drawn */
+        void wake() {
+            if (!hibernated_) {
+                return;
             }
-        };
 
-        auto is_longest_sequence = [&] {
-            return sequence->empty() && // sequence doesn't have subsequences
-                   sequence->command;   // sequence has assigned command
-        };
+            SessionState state{std::move(*hibernated_)};
+            hibernated_.reset();
 
-        while (!should_stop_) {
+            load_session(state);
+            bind_commands();
+        }
 
-            curchar_ = input_.get();
+        /** Save the session to be restored by another process, see `SessionHandoff`
+         *
+         * Unlike `hibernate` also the terminal modes and the state of the
+         * current line are saved. The terminal is left as it is, so the
+         * session shouldn't be used afterwards.
+         */
+        std::string save_state() {
+            wake();
 
-            if (curchar_ == EOF) {
-                should_stop_ = true;
-                break;
-            }
+            SessionState state{};
+            save_session(state);
+            terminal_.save_state(state);
+            state.put_number(line_started_);
+            state.put_number(key_events_);
+            state.put_number(scroll_offset_);
 
-            if (!sequence->contains(curchar_)) {
+            terminal_.detach();
+            key_events_ = false;
 
-                if (!sequence->command) {
-                    run_default();
-                } else {
-                    sequence->command();
-                    input_.unget();
-                }
+            return state.release();
+        }
 
-                reset_sequence();
+        /** Restore a session saved by `save_state` and redraw its line */
+        Readline &restore_state(std::string_view data) {
+            SessionState state{std::string{data}};
 
-            } else {
+            wake();
+            load_session(state);
+            terminal_.load_state(state);
+            line_started_ = state.number();
+            key_events_ = state.number();
+            scroll_offset_ = std::min(state.number(), buffer_.size());
 
-                sequence = &(*sequence)[curchar_];
+            // the continuation scans only new lines, the lines of the statement are scanned again
+            continuation_ = complete_;
 
-                if (is_longest_sequence()) {
-                    sequence->command();
-                    reset_sequence();
-                }
+            for (size_t begin = 0, end; continuation_ && (end = statement_.find('\n', begin)) != std::string::npos; begin = end + 1) {
+                continuation_(std::string_view{statement_}.substr(begin, end - begin));
+            }
+
+            if (line_started_) {
+                redraw();
             }
+
+            return *this;
         }
 
-    }
+        /** Draw the prompt and the line again, e.g. after other output overwrote them */
+        Readline &redraw() {
+            wake();
+            terminal_.move_cursor_horizontal_absolute();
+            do_print_prompt();
+            refresh_line();
 
-};
+            return *this;
+        }
 
-using Completion = std::function<std::string(std::string)>;
+        /** The last line was accepted by Enter, otherwise the input ended, e.g. by Ctrl-D
+         *
+         * In the push mode it's valid in the `on_line` callback of `feed`.
+         */
+        bool line_accepted() const {
+            return accepted_;
+        }
 
-class Readline {
-    private:
-        Buffer buffer_;
+        /** Load the history from the file and append accepted lines to it */
+        Readline &set_history_file(const std::filesystem::path &path) {
+            history_.set_file(path);
+            return *this;
+        }
 
-        std::reference_wrapper<std::istream> input_{std::cin};
-        std::reference_wrapper<std::ostream> output_{std::cout};
+        Readline &set_terminal_settings(const TerminalSettings &s) {
+            settings_ = s;
+            terminal_.set_settings(s);
+            terminal_.apply_settings();
+            return *this;
+        }
 
-        HistoryView history_{};
+        /** Discover terminal capabilities
+         *
+         * Cached capabilities are used when available, otherwise the terminal
+         * is probed and the result is cached. A terminal which doesn't answer
+         * within `TerminalCapabilitiesReader::default_timeout` keeps the
+         * default capabilities. The terminal must be already in the
+         * noncanonical mode.
+         */
+        Readline &detect_terminal_capabilities() {
+            TerminalCapabilitiesCache cache{};
+            const auto identity = TerminalCapabilitiesCache::identity();
 
-        TerminalSettings settings_{};
-        Terminal terminal_{};
+            if (auto capabilities = cache.load(identity)) {
+                terminal_.set_capabilities(*capabilities);
+                return *this;
+            }
 
-        Prompt prompter_{};
-        Completion completion_{};
+            if (!isatty(STDIN_FILENO) || !isatty(STDOUT_FILENO)) {
+                return *this;
+            }
 
-        CommandReader command_reader_{input_.get()};
+            terminal_.query_capabilities();
 
-    protected:
-        void do_write_char() {
-            const size_t position_after_prompt_ = prompter_.size() + 1;
+            TerminalCapabilitiesReader reader{input_.get()};
+            auto capabilities = reader.read(STDIN_FILENO);
+            // keys typed during the probe
+            command_reader_.unread(reader.unprocessed());
 
-            terminal_.move_cursor_horizontal_absolute(position_after_prompt_);
+            // a terminal which didn't answer in time keeps the defaults, it's probed again next time
+            if (!capabilities) {
+                return *this;
+            }
 
-            buffer_.insert(command_reader_.current_char());
-            output_.get() << buffer_ << std::flush;
+            terminal_.set_capabilities(*capabilities);
+            cache.store(identity, *capabilities);
+            return *this;
+        }
 
-            terminal_.move_cursor_horizontal_absolute(position_after_prompt_ + buffer_.position());
+        const TerminalCapabilities &terminal_capabilities() const {
+            return terminal_.capabilities();
         }
 
-        void do_backspace() {
-            if (buffer_.position()) {
-                auto pos = buffer_.position();
-                // clear the line
-                terminal_.move_cursor_horizontal_absolute(prompter_.size() + 1);
-                terminal_.clear_the_line();
-                // remove char from the buffer
-                buffer_.remove();
-                // write buffer to the output
-                output_.get() << buffer_ << std::flush;
-                // restore and adjust position
-                terminal_.move_cursor_horizontal_absolute(prompter_.size() + buffer_.position() + 1);
-            }
+        Readline &set_output_stream(std::ostream &os) {
+            terminal_.set_output_stream(os);
+            return *this;
         }
 
-        void do_clear_line() {
-            buffer_.clear();
-            terminal_.move_cursor_horizontal_absolute(prompter_.size() + 1);
-            terminal_.clear_the_line();
+        /** Write the output to the descriptor, e.g. a connection of a remote session */
+        Readline &set_output_fd(int fd) {
+            terminal_.set_output_fd(fd);
+            return *this;
         }
 
-        void do_accept_command() {
-            output_.get() << std::endl;
-            add_history();
-            history_.reset_position();
-            terminal_.move_cursor_horizontal_absolute();
-            command_reader_.stop_reading();
+        /** Transform the input before it's decoded, see `CommandReader::set_input_filter` */
+        Readline &set_input_filter(std::function<void(std::string &)> f) {
+            command_reader_.set_input_filter(std::move(f));
+            return *this;
         }
 
-        void do_control_d() {
-            if (buffer_.empty()) {
-                command_reader_.stop_reading();
-            }
+        /** Transform every batch of the output before it's written */
+        Readline &set_output_filter(std::function<void(std::string &)> f) {
+            terminal_.set_output_filter(std::move(f));
+            return *this;
         }
 
-        void do_move_left() {
-            if (buffer_.position()) {
-                buffer_.move_left();
-                terminal_.move_cursor_backward();
-            }
+        /** Pass the flushed output to the sink instead of writing it, it may take the string by swapping */
+        Readline &set_output_sink(std::function<void(std::string &)> f) {
+            terminal_.set_output_sink(std::move(f));
+            return *this;
         }
 
-        void do_move_right() {
-            if (buffer_.position() < buffer_.size()) {
-                buffer_.move_right();
-                terminal_.move_cursor_forward();
-            }
+        Readline &set_input_stream(std::istream &is) {
+            input_ = is;
+            command_reader_.set_input(is);
+            return *this;
         }
 
-        void do_history_up() {
-            if (history_.size()) {
-                do_clear_line();
-                buffer_.reset(history_.previous());
-                output_.get() << buffer_;
-            }
+        /** Keep the line in a single row and scroll it horizontally
+         *
+         * Redraws write only the part of the buffer that fits the terminal,
+         * so very long lines are as cheap to edit as short ones.
+         */
+        Readline &set_horizontal_scroll(bool to) {
+            horizontal_scroll_ = to;
+            return *this;
         }
 
-        void do_history_down() {
-            if (history_.size()) {
-                do_clear_line();
-                buffer_.reset(history_.next());
-                output_.get() << buffer_;
-            }
+        /** Keep keys responsive on huge lines
+         *
+         * Processing and rendering of every key is measured. When it takes
+         * longer than the budget, rendering of the line is degraded, see
+         * `RenderQuality`. Zero disables the degradation.
+         */
+        Readline &set_latency_budget(std::chrono::steady_clock::duration budget) {
+            latency_budget_ = budget;
+            return *this;
         }
 
-        void do_autocomplete() {
-            if (completion_) {
-                // clear the line
-                terminal_.move_cursor_horizontal_absolute(prompter_.size() + 1);
-                terminal_.clear_the_line();
-                // assign to the buffer string from the completion function
-                buffer_.reset(completion_(buffer_.data()));
-                // write buffer to the output
-                output_.get() << buffer_ << std::flush;
-                // restore and adjust position
-                terminal_.move_cursor_horizontal_absolute(prompter_.size() + buffer_.position() + 1);
-            }
+        RenderQuality render_quality() const {
+            return quality_;
         }
 
+        /** Heap bytes held by the instance, broken down by its parts */
+        MemoryUsage memory_usage() const {
+            MemoryUsage usage{};
 
-        void do_print_prompt() {
-            if (prompter_) {
-                output_.get() << prompter_();
-            }
-        }
+            usage.buffer = buffer_.memory_usage();
+            usage.history = history_.memory_usage();
+            usage.key_bindings = command_reader_.commands_.memory_usage();
+            usage.input = command_reader_.memory_usage() + macro_.memory_usage();
+            usage.output = terminal_.memory_usage();
+            usage.editing = kill_ring_.memory_usage() + MemoryUsage::of(statement_)
+                          + (search_ ? MemoryUsage::of(search_->pattern) : 0);
+            usage.hibernated = hibernated_ ? MemoryUsage::of(*hibernated_) : 0;
 
-        void add_history() {
-            history_.add_line(buffer_.data());
+            return usage;
         }
-    public:
-        Readline() {
-            command_reader_.add_command(CTRL_U, [this] { do_clear_line(); });
-            command_reader_.add_command(CTRL_C, [this] { do_clear_line(); });
-            command_reader_.add_command(BACKSPACE, [this] { do_backspace(); });
-            command_reader_.add_command(CTRL_D, [this] { do_control_d(); });
-            command_reader_.add_command(NEWLINE, [this] { do_accept_command(); });
-            command_reader_.add_command(TAB, [this] { do_autocomplete(); });
-            command_reader_.add_command(MOVE_LEFT, [this] { do_move_left(); });
-            command_reader_.add_command(MOVE_RIGHT, [this] { do_move_right(); });
-            command_reader_.add_command(MOVE_DOWN, [this] { do_history_up(); });
-            command_reader_.add_command(MOVE_UP, [this] { do_history_down(); });
-            command_reader_.set_default([this] { do_write_char(); });
+
+        /** Put killed and copied text to the system clipboard using OSC 52
+         *
+         * It works over SSH too, the terminal must allow it. Longer text
+         * than the limit (which depends on the terminal by default) isn't
+         * put to the clipboard.
+         */
+        Readline &set_clipboard(bool to, std::optional<size_t> limit = std::nullopt) {
+            clipboard_ = to;
+
+            if (limit) {
+                terminal_.set_clipboard_limit(*limit);
+            }
+
+            return *this;
         }
 
-//        Readline(const Readline &) = default;
-//        Readline(Readline &&) = default;
+        /** Highlight the bracket or quote matching the one at the cursor
+         *
+         * Matching uses an index maintained by the buffer, so it's cheap
+         * even for very long lines. The index is kept only while matching is
+         * on and a line spilled to a file isn't highlighted.
+         */
+        Readline &set_bracket_matching(bool to) {
+            bracket_matching_ = to;
+            buffer_.set_bracket_index(to);
+            return *this;
+        }
 
-        ~Readline() { terminal_.reset_settings(); }
+        /** Apply edits to the line and redraw it once
+         *
+         * The edits are applied directly to the buffer, no input is decoded
+         * and nothing is drawn until all of them are applied.
+         */
+        Readline &edit(const std::vector<EditAction> &actions) {
+            wake();
 
-        std::string read(void) {
+            for (auto &&action: actions) {
+                std::visit([this](auto &&a) { apply(a); }, action);
+            }
 
-            buffer_.clear();
-            command_reader_.start_reading();
-            terminal_.move_cursor_horizontal_absolute();
-            do_print_prompt();
+            // the window is recomputed from the cursor
+            scroll_offset_ = 0;
+            refresh_line();
 
-            command_reader_.read_and_execute();
+            return *this;
+        }
 
-            return buffer_.data();
+        /** Contents of the line being edited */
+        std::string_view line() const {
+            return buffer_.view();
         }
 
-        Readline &set_terminal_settings(const TerminalSettings &s) {
-            settings_ = s;
-            terminal_.set_settings(s);
-            terminal_.apply_settings();
-            return *this;
+        /** Position of the cursor in the line */
+        size_t cursor() const {
+            return buffer_.position();
         }
 
-        Readline &set_output_stream(std::ostream &os) {
-            output_ = os;
+        /** Lines longer than the limit are moved from memory to a temporary file
+         *
+         * Such a line is scrolled horizontally, see `set_horizontal_scroll`.
+         */
+        Readline &set_buffer_memory_limit(size_t limit) {
+            buffer_.set_memory_limit(limit);
             return *this;
         }
 
-        Readline &set_input_stream(std::istream &is) {
-            input_ = is;
+        /** Override the terminal width, it's queried on every `read` otherwise */
+        Readline &set_columns(size_t n) {
+            terminal_.set_columns(n);
             return *this;
         }
 
@@ -813,4 +6200,20 @@ class Readline {
             return *this;
         }
 
+        /** Accept only complete statements, Enter starts a new line otherwise
+         *
+         * The function is given the statement line by line, it's copied
+         * before every read, so it can keep state between the lines.
+         */
+        Readline &set_continuation(Continuation c) {
+            complete_ = c;
+            return *this;
+        }
+
+        /** Prompt of the continuation lines, the main prompt is used without it */
+        Readline &set_continuation_prompter(std::function<std::string(void)> p) {
+            continuation_prompter_.set_prompt(p);
+            return *this;
+        }
+
 };
@@ -0,0 +1,273 @@
+#include <pty.h>
+#include <poll.h>
+#include <cerrno>
+#include <cstdio>
+#include "readline.hh"
+
+/** Runs a command under a pty and edits its input, e.g. `readline-wrap -H ~/.bc_history bc`
+ *
+ * Output of the command is copied to the terminal as it arrives, the edited
+ * line is hidden before it and drawn again only when the output stalls. The
+ * output after the last line break is used as the prompt. When the command
+ * switches its terminal to the noncanonical mode, the input is passed
+ * through unchanged.
+ */
+
+/** Output which doesn't continue within this time is considered complete */
+static constexpr int stall_ms = 30;
+
+/** Longest output which is kept as the prompt */
+static constexpr size_t max_prompt = 1024;
+
+static volatile sig_atomic_t resized = 0;
+
+static void write_all(int fd, const char *data, size_t size) {
+    while (size) {
+        const ssize_t n = write(fd, data, size);
+
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (n < 0) {
+            throw std::system_error(errno, std::generic_category(), "write");
+        }
+
+        data += n;
+        size -= n;
+    }
+}
+
+/** Number of rows the text occupies above its last one when the terminal wraps it */
+static size_t rows_above(std::string_view text, size_t columns) {
+    const auto width = Utf8::width(text);
+    return width && columns ? (width - 1) / columns : 0;
+}
+
+static int run(int master, pid_t child, const std::filesystem::path &history) {
+    auto settings = TerminalSettings()
+        .set_echo(false)
+        .set_canonical(false)
+        .set_flow_control(false)
+        .set_output_processing(false)
+        .set_ctrlc_ctrlz_as_characters(true)
+        .set_timeout_for_non_canonical_read(0)
+        .set_min_chars_for_non_canonical_read(1);
+
+    std::string prompt;
+    Readline readline{};
+
+    winsize window{};
+    ioctl(STDIN_FILENO, TIOCGWINSZ, &window);
+
+    readline.set_terminal_settings(settings);
+    readline.set_prompter([&] { return prompt; });
+    readline.set_history_file(history);
+
+    // the edited line is on the screen
+    bool shown = false;
+    bool started = false;
+    bool input_open = true;
+
+    auto show = [&] {
+        if (!started) {
+            started = true;
+            readline.start_line();
+        } else {
+            readline.redraw();
+        }
+
+        shown = true;
+    };
+
+    std::vector<char> chunk(1 << 16);
+    pollfd fds[2] = {{STDIN_FILENO, POLLIN, 0}, {master, POLLIN, 0}};
+
+    while (true) {
+        if (resized) {
+            resized = 0;
+            if (ioctl(STDIN_FILENO, TIOCGWINSZ, &window) == 0) {
+                ioctl(master, TIOCSWINSZ, &window);
+            }
+        }
+
+        termios child_settings{};
+        const bool canonical = tcgetattr(master, &child_settings) == 0 && (child_settings.c_lflag & ICANON);
+
+        fds[0].fd = input_open ? STDIN_FILENO : -1;
+        const int ready = poll(fds, 2, shown || !canonical ? -1 : stall_ms);
+
+        if (ready < 0 && errno == EINTR) {
+            continue;
+        }
+
+        if (ready < 0) {
+            throw std::system_error(errno, std::generic_category(), "poll");
+        }
+
+        if (ready == 0) {
+            show();
+            continue;
+        }
+
+        if (fds[1].revents) {
+            const ssize_t n = read(master, chunk.data(), chunk.size());
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            // EIO when the last process holding the pty exited
+            if (n <= 0) {
+                break;
+            }
+
+            // the line may be wrapped over several rows, the cursor is on the last one
+            if (shown) {
+                auto erase = "\r\x1b[J" + prompt;
+
+                if (const auto up = rows_above(prompt + std::string{readline.line()}, window.ws_col)) {
+                    erase.insert(0, "\x1b[" + std::to_string(up) + "A");
+                }
+
+                write_all(STDOUT_FILENO, erase.data(), erase.size());
+                shown = false;
+            }
+
+            write_all(STDOUT_FILENO, chunk.data(), n);
+
+            const std::string_view output{chunk.data(), static_cast<size_t>(n)};
+            const auto line_break = output.rfind('\n');
+
+            if (line_break != std::string_view::npos) {
+                prompt.assign(output.substr(line_break + 1));
+            } else {
+                prompt.append(output);
+            }
+
+            if (prompt.size() > max_prompt) {
+                prompt.erase(0, prompt.size() - max_prompt);
+            }
+        }
+
+        if (fds[0].revents) {
+            const ssize_t n = read(STDIN_FILENO, chunk.data(), chunk.size());
+
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+
+            if (n <= 0) {
+                input_open = false;
+                write_all(master, reinterpret_cast<const char *>(&child_settings.c_cc[VEOF]), 1);
+                continue;
+            }
+
+            if (!canonical) {
+                write_all(master, chunk.data(), n);
+                continue;
+            }
+
+            if (!shown) {
+                show();
+            }
+
+            // signal characters go to the command, the line discipline of the pty raises the signal
+            const auto is_signal = [&](char ch) {
+                return ch && (ch == static_cast<char>(child_settings.c_cc[VINTR]) ||
+                              ch == static_cast<char>(child_settings.c_cc[VQUIT]) ||
+                              ch == static_cast<char>(child_settings.c_cc[VSUSP]));
+            };
+
+            auto on_line = [&](std::string_view line) {
+                if (readline.line_accepted()) {
+                    std::string input{line};
+                    input.push_back('\n');
+                    write_all(master, input.data(), input.size());
+                } else {
+                    write_all(master, reinterpret_cast<const char *>(&child_settings.c_cc[VEOF]), 1);
+                }
+
+                prompt.clear();
+            };
+
+            std::string_view input{chunk.data(), static_cast<size_t>(n)};
+
+            while (!input.empty()) {
+                const auto end = std::find_if(input.begin(), input.end(), is_signal);
+                const auto length = static_cast<size_t>(end - input.begin());
+
+                readline.feed(input.substr(0, length), on_line);
+
+                if (length == input.size()) {
+                    break;
+                }
+
+                write_all(master, &input[length], 1);
+                input.remove_prefix(length + 1);
+            }
+        }
+    }
+
+    int status = 0;
+    waitpid(child, &status, 0);
+
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+int main(int argc, char **argv) {
+    int first = 1;
+    std::filesystem::path history;
+
+    if (argc > 2 && std::string_view{argv[1]} == "-H") {
+        history = argv[2];
+        first = 3;
+    }
+
+    if (first >= argc) {
+        std::fprintf(stderr, "usage: %s [-H history-file] command [argument...]\n", argv[0]);
+        return 2;
+    }
+
+    if (history.empty()) {
+        const char *home = std::getenv("HOME");
+        history = std::filesystem::path{home ? home : "."} /
+                  ("." + std::filesystem::path{argv[first]}.filename().string() + "_history");
+    }
+
+    // nothing to edit, the command gets the input as it is
+    if (!isatty(STDIN_FILENO)) {
+        execvp(argv[first], argv + first);
+        std::perror(argv[first]);
+        return 127;
+    }
+
+    winsize size{};
+    ioctl(STDIN_FILENO, TIOCGWINSZ, &size);
+
+    int master = -1;
+    const pid_t child = forkpty(&master, nullptr, nullptr, &size);
+
+    if (child < 0) {
+        std::perror("forkpty");
+        return 1;
+    }
+
+    if (child == 0) {
+        // the line is echoed by the editor
+        termios settings{};
+        tcgetattr(STDIN_FILENO, &settings);
+        settings.c_lflag &= ~ECHO;
+        tcsetattr(STDIN_FILENO, TCSANOW, &settings);
+
+        execvp(argv[first], argv + first);
+        std::perror(argv[first]);
+        _exit(127);
+    }
+
+    struct sigaction action{};
+    action.sa_handler = [](int) { resized = 1; };
+    sigaction(SIGWINCH, &action, nullptr);
+
+    return run(master, child, history);
+}
@@ -0,0 +1,363 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include "readline.hh"
+
+/** This class runs the work of many `Readline` sessions on a pool of threads
+ *
+ * Work posted to a session, e.g. its input to decode, edit and render, is
+ * queued in its mailbox. A session with work is put to the queue of its
+ * home worker, which is picked round robin when the session is added, so a
+ * session is mostly handled by one thread and its data stays in the caches
+ * of one core. Idle workers steal sessions from the others, so a burst in a
+ * few sessions is spread over all of them. A session is in at most one
+ * queue and the worker which took it runs all of its queued work in order,
+ * so the work of a session is serialized and needs no locking.
+ *
+ * Workers are pinned to the CPUs the process may run on. Tracing isn't
+ * supported with more than one worker, `TraceRecorder` is process wide.
+ */
+class SessionScheduler {
+public:
+    using Work = std::function<void(Readline &)>;
+
+    class Session {
+        friend class SessionScheduler;
+
+        Readline readline_{};
+
+        std::mutex mutex_{};
+
+        /** Posted work which didn't run yet */
+        std::vector<Work> mailbox_{};
+
+        /** The session is in a queue or it's running */
+        bool scheduled_{false};
+
+        /** The session is removed after its queued work */
+        bool removed_{false};
+
+        size_t home_;
+
+        explicit Session(size_t home): home_{home} {}
+
+    public:
+        Session(const Session &) = delete;
+        Session &operator=(const Session &) = delete;
+
+        /** Worker which handles the session unless its queue is stolen */
+        size_t home() const {
+            return home_;
+        }
+    };
+
+private:
+    struct Worker {
+        std::mutex mutex{};
+        std::condition_variable wake{};
+        std::deque<Session *> ready{};
+        bool sleeping{false};
+        std::thread thread{};
+    };
+
+    std::vector<std::unique_ptr<Worker>> workers_{};
+
+    std::mutex sessions_mutex_{};
+    std::unordered_map<Session *, std::unique_ptr<Session>> sessions_{};
+    size_t next_home_{0};
+
+    /** Sessions in the queues of all workers */
+    std::atomic<size_t> ready_{0};
+
+    /** Posted work which didn't complete yet, see `wait` */
+    std::mutex pending_mutex_{};
+    std::condition_variable idle_{};
+    size_t pending_{0};
+
+    /** The first exception thrown by the work, it's rethrown by `wait` */
+    std::exception_ptr error_{};
+
+    std::atomic<bool> stop_{false};
+
+    /** Put the session to the queue of its home worker and wake a worker for it */
+    void enqueue(Session &session) {
+        auto &home = *workers_[session.home_];
+        bool woken = false;
+
+        ready_++;
+
+        {
+            std::lock_guard lock{home.mutex};
+            home.ready.push_back(&session);
+
+            if (home.sleeping) {
+                home.sleeping = false;
+                home.wake.notify_one();
+                woken = true;
+            }
+        }
+
+        if (woken) {
+            return;
+        }
+
+        // the home worker is busy, a sleeping one steals the session
+        for (auto &worker: workers_) {
+            std::lock_guard lock{worker->mutex};
+
+            if (worker->sleeping) {
+                worker->sleeping = false;
+                worker->wake.notify_one();
+                return;
+            }
+        }
+    }
+
+    Session *take(size_t index) {
+        auto &own = *workers_[index];
+
+        {
+            std::lock_guard lock{own.mutex};
+
+            if (!own.ready.empty()) {
+                auto session = own.ready.front();
+                own.ready.pop_front();
+                ready_--;
+                return session;
+            }
+        }
+
+        // sessions of others are taken from the back, their owners take the front
+        for (size_t i = 1; i < workers_.size(); i++) {
+            auto &victim = *workers_[(index + i) % workers_.size()];
+            std::lock_guard lock{victim.mutex};
+
+            if (!victim.ready.empty()) {
+                auto session = victim.ready.back();
+                victim.ready.pop_back();
+                ready_--;
+                return session;
+            }
+        }
+
+        return nullptr;
+    }
+
+    void complete(size_t n) {
+        std::lock_guard lock{pending_mutex_};
+        pending_ -= n;
+
+        if (!pending_) {
+            idle_.notify_all();
+        }
+    }
+
+    void run(Session &session) {
+        std::vector<Work> work;
+
+        {
+            std::lock_guard lock{session.mutex_};
+            work.swap(session.mailbox_);
+        }
+
+        for (auto &f: work) {
+            try {
+                f(session.readline_);
+            } catch (...) {
+                std::lock_guard lock{pending_mutex_};
+
+                if (!error_) {
+                    error_ = std::current_exception();
+                }
+            }
+        }
+
+        bool remove = false;
+
+        {
+            std::lock_guard lock{session.mutex_};
+
+            if (!session.mailbox_.empty()) {
+                enqueue(session);
+            } else if (session.removed_) {
+                remove = true;
+            } else {
+                session.scheduled_ = false;
+            }
+        }
+
+        if (remove) {
+            std::lock_guard lock{sessions_mutex_};
+            sessions_.erase(&session);
+        }
+
+        complete(work.size() + remove);
+    }
+
+    void work(size_t index) {
+        auto &own = *workers_[index];
+
+        while (true) {
+            if (auto session = take(index)) {
+                run(*session);
+                continue;
+            }
+
+            std::unique_lock lock{own.mutex};
+
+            if (stop_) {
+                return;
+            }
+
+            if (own.ready.empty() && !ready_) {
+                own.sleeping = true;
+                own.wake.wait(lock, [&] { return !own.sleeping || stop_; });
+            }
+        }
+    }
+
+    /** Pin the worker to one of the CPUs the process may run on */
+    static void pin(std::thread &thread, size_t index) {
+        cpu_set_t allowed;
+
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+            return;
+        }
+
+        const int count = CPU_COUNT(&allowed);
+        int n = index % count;
+
+        for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, &allowed) && n-- == 0) {
+                cpu_set_t set;
+                CPU_ZERO(&set);
+                CPU_SET(cpu, &set);
+                pthread_setaffinity_np(thread.native_handle(), sizeof(set), &set);
+                return;
+            }
+        }
+    }
+
+    void post(Session &session, Work work, bool remove) {
+        {
+            std::lock_guard lock{pending_mutex_};
+            pending_ += work ? 1 : 0;
+            pending_ += remove ? 1 : 0;
+        }
+
+        std::lock_guard lock{session.mutex_};
+
+        if (work) {
+            session.mailbox_.push_back(std::move(work));
+        }
+
+        session.removed_ |= remove;
+
+        if (!session.scheduled_) {
+            session.scheduled_ = true;
+            enqueue(session);
+        }
+    }
+
+public:
+    /** Start the workers, zero starts one per CPU */
+    explicit SessionScheduler(size_t threads = 0) {
+        if (!threads) {
+            threads = std::max(1u, std::thread::hardware_concurrency());
+        }
+
+        for (size_t i = 0; i < threads; i++) {
+            workers_.push_back(std::make_unique<Worker>());
+        }
+
+        for (size_t i = 0; i < threads; i++) {
+            workers_[i]->thread = std::thread{[this, i] { work(i); }};
+            pin(workers_[i]->thread, i);
+        }
+    }
+
+    /** Queued work is completed first */
+    ~SessionScheduler() {
+        {
+            std::unique_lock lock{pending_mutex_};
+            idle_.wait(lock, [&] { return !pending_; });
+        }
+
+        stop_ = true;
+
+        for (auto &worker: workers_) {
+            {
+                std::lock_guard lock{worker->mutex};
+                worker->sleeping = false;
+                worker->wake.notify_one();
+            }
+
+            worker->thread.join();
+        }
+    }
+
+    SessionScheduler(const SessionScheduler &) = delete;
+    SessionScheduler &operator=(const SessionScheduler &) = delete;
+
+    /** Add a session, `setup` configures its `Readline`, e.g. its output */
+    Session &add(const Work &setup = {}) {
+        std::lock_guard lock{sessions_mutex_};
+
+        std::unique_ptr<Session> session{new Session{next_home_++ % workers_.size()}};
+        auto &added = *session;
+
+        if (setup) {
+            setup(added.readline_);
+        }
+
+        sessions_.emplace(&added, std::move(session));
+        return added;
+    }
+
+    /** Run the work on the session after the work posted before */
+    void post(Session &session, Work work) {
+        post(session, std::move(work), false);
+    }
+
+    /** Feed the input in the push mode, `on_line` is called by the worker, see `Readline::feed` */
+    template <typename F>
+    void feed(Session &session, std::string input, F on_line) {
+        post(session, [input = std::move(input), on_line = std::move(on_line)](Readline &readline) mutable {
+            readline.feed(input, on_line);
+        });
+    }
+
+    /** Remove the session after its queued work, it mustn't be used afterwards */
+    void remove(Session &session) {
+        post(session, {}, true);
+    }
+
+    /** Wait until all posted work completed, an exception thrown by the work is rethrown */
+    void wait() {
+        std::unique_lock lock{pending_mutex_};
+        idle_.wait(lock, [&] { return !pending_; });
+
+        if (auto error = std::exchange(error_, nullptr)) {
+            std::rethrow_exception(error);
+        }
+    }
+
+    size_t threads() const {
+        return workers_.size();
+    }
+
+    /** Number of sessions */
+    size_t size() {
+        std::lock_guard lock{sessions_mutex_};
+        return sessions_.size();
+    }
+};
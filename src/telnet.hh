@@ -0,0 +1,992 @@
+#pragma once
+
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <deque>
+#include "readline.hh"
+#include "uring.hh"
+
+/** Telnet commands and options, RFC 854 and RFC 1073 */
+struct Telnet {
+    static constexpr unsigned char SE = 240;
+    static constexpr unsigned char InterruptProcess = 244;
+    static constexpr unsigned char SB = 250;
+    static constexpr unsigned char WILL = 251;
+    static constexpr unsigned char WONT = 252;
+    static constexpr unsigned char DO = 253;
+    static constexpr unsigned char DONT = 254;
+    static constexpr unsigned char IAC = 255;
+
+    static constexpr unsigned char Echo = 1;
+    static constexpr unsigned char SuppressGoAhead = 3;
+    static constexpr unsigned char WindowSize = 31;
+    static constexpr unsigned char LineMode = 34;
+};
+
+/** This class speaks the server side of telnet
+ *
+ * The input filter strips commands from the input and answers option
+ * negotiation, the server echoes and suppresses go aheads, the client
+ * reports its window size and doesn't edit lines itself. The output
+ * filter escapes the output for the network virtual terminal.
+ */
+class TelnetFilter {
+
+    enum class State : unsigned char {
+        Data,
+        Command,
+        Option,
+        Subnegotiation,
+        SubnegotiationCommand,
+    };
+
+    State state_{State::Data};
+
+    /** The negotiation command waiting for its option */
+    unsigned char command_{0};
+
+    /** The last byte was a carriage return, a following LF or NUL is dropped */
+    bool carriage_return_{false};
+
+    /** Subnegotiation data, only the window size is parsed */
+    unsigned char subnegotiation_[5]{};
+    unsigned char subnegotiation_size_{0};
+
+    /** Enabled options of the server and the client, all supported ones are below 64 */
+    uint64_t local_{0};
+    uint64_t remote_{0};
+
+    /** Answers to the negotiation which weren't sent yet */
+    std::string replies_{};
+
+    std::function<void(size_t columns, size_t rows)> on_window_size_{};
+
+    static bool supported_locally(unsigned char option) {
+        return option == Telnet::Echo || option == Telnet::SuppressGoAhead;
+    }
+
+    static bool supported_remotely(unsigned char option) {
+        return option == Telnet::WindowSize || option == Telnet::SuppressGoAhead;
+    }
+
+    static uint64_t bit(unsigned char option) {
+        return option < 64 ? uint64_t{1} << option : 0;
+    }
+
+    void reply(unsigned char command, unsigned char option) {
+        replies_.push_back(static_cast<char>(Telnet::IAC));
+        replies_.push_back(static_cast<char>(command));
+        replies_.push_back(static_cast<char>(option));
+    }
+
+    /** Only changes are answered, so the peers don't loop (RFC 1143) */
+    void negotiate(unsigned char option) {
+        switch (command_) {
+            case Telnet::DO:
+                if (!supported_locally(option)) {
+                    reply(Telnet::WONT, option);
+                } else if (!(local_ & bit(option))) {
+                    local_ |= bit(option);
+                    reply(Telnet::WILL, option);
+                }
+                break;
+            case Telnet::DONT:
+                if (local_ & bit(option)) {
+                    local_ &= ~bit(option);
+                    reply(Telnet::WONT, option);
+                }
+                break;
+            case Telnet::WILL:
+                if (!supported_remotely(option)) {
+                    reply(Telnet::DONT, option);
+                } else if (!(remote_ & bit(option))) {
+                    remote_ |= bit(option);
+                    reply(Telnet::DO, option);
+                }
+                break;
+            case Telnet::WONT:
+                if (remote_ & bit(option)) {
+                    remote_ &= ~bit(option);
+                    reply(Telnet::DONT, option);
+                }
+                break;
+        }
+    }
+
+    void end_subnegotiation() {
+        const auto *data = subnegotiation_;
+
+        if (subnegotiation_size_ == 5 && data[0] == Telnet::WindowSize && on_window_size_) {
+            on_window_size_((data[1] << 8) | data[2], (data[3] << 8) | data[4]);
+        }
+    }
+
+public:
+    /** Negotiation which opens the connection */
+    std::string start() {
+        local_ = bit(Telnet::Echo) | bit(Telnet::SuppressGoAhead);
+        remote_ = bit(Telnet::WindowSize) | bit(Telnet::SuppressGoAhead);
+
+        replies_.clear();
+        reply(Telnet::WILL, Telnet::Echo);
+        reply(Telnet::WILL, Telnet::SuppressGoAhead);
+        reply(Telnet::DO, Telnet::SuppressGoAhead);
+        reply(Telnet::DO, Telnet::WindowSize);
+        reply(Telnet::DONT, Telnet::LineMode);
+
+        return take_replies();
+    }
+
+    /** Called with the window size reported by the client */
+    template <typename F>
+    void set_window_size_handler(F &&f) {
+        on_window_size_ = f;
+    }
+
+    bool local_enabled(unsigned char option) const {
+        return local_ & bit(option);
+    }
+
+    bool remote_enabled(unsigned char option) const {
+        return remote_ & bit(option);
+    }
+
+    /** Answers to the negotiation, they have to be sent to the client */
+    std::string take_replies() {
+        return std::move(replies_);
+    }
+
+    /** Decode the input in place, commands may be split between chunks */
+    void operator()(std::string &input) {
+        size_t out = 0;
+
+        for (char ch: input) {
+            const auto byte = static_cast<unsigned char>(ch);
+
+            switch (state_) {
+                case State::Data:
+                    if (byte == Telnet::IAC) {
+                        state_ = State::Command;
+                    } else if (carriage_return_ && (byte == '\n' || byte == '\0')) {
+                        carriage_return_ = false;
+                    } else {
+                        // CR LF and CR NUL end a line, the editor expects LF
+                        carriage_return_ = byte == '\r';
+                        input[out++] = carriage_return_ ? '\n' : ch;
+                    }
+                    break;
+
+                case State::Command:
+                    state_ = State::Data;
+
+                    if (byte == Telnet::IAC) {
+                        input[out++] = ch;
+                    } else if (byte >= Telnet::WILL) {
+                        command_ = byte;
+                        state_ = State::Option;
+                    } else if (byte == Telnet::SB) {
+                        subnegotiation_size_ = 0;
+                        state_ = State::Subnegotiation;
+                    } else if (byte == Telnet::InterruptProcess) {
+                        input[out++] = CTRL_C;
+                    }
+                    break;
+
+                case State::Option:
+                    negotiate(byte);
+                    state_ = State::Data;
+                    break;
+
+                case State::Subnegotiation:
+                    if (byte == Telnet::IAC) {
+                        state_ = State::SubnegotiationCommand;
+                    } else if (subnegotiation_size_ < sizeof(subnegotiation_)) {
+                        subnegotiation_[subnegotiation_size_++] = byte;
+                    } else {
+                        // longer than anything parsed, only its end is looked for
+                        subnegotiation_[0] = 0;
+                    }
+                    break;
+
+                case State::SubnegotiationCommand:
+                    if (byte == Telnet::SE) {
+                        end_subnegotiation();
+                        state_ = State::Data;
+                    } else {
+                        // IAC IAC is a data byte of the subnegotiation
+                        if (subnegotiation_size_ < sizeof(subnegotiation_)) {
+                            subnegotiation_[subnegotiation_size_++] = byte;
+                        }
+
+                        state_ = State::Subnegotiation;
+                    }
+                    break;
+            }
+        }
+
+        input.resize(out);
+    }
+
+    /** Escape IAC and end lines with CR LF */
+    static void encode(std::string &output) {
+        const auto extra = std::count_if(output.begin(), output.end(), [](char ch) {
+            return ch == '\n' || static_cast<unsigned char>(ch) == Telnet::IAC;
+        });
+
+        if (!extra) {
+            return;
+        }
+
+        std::string encoded;
+        encoded.reserve(output.size() + extra);
+
+        for (char ch: output) {
+            if (ch == '\n') {
+                encoded.push_back('\r');
+            } else if (static_cast<unsigned char>(ch) == Telnet::IAC) {
+                encoded.push_back(ch);
+            }
+
+            encoded.push_back(ch);
+        }
+
+        output.swap(encoded);
+    }
+};
+
+/** This class serves line editing to telnet clients
+ *
+ * All connections are handled by one thread. Every connection has its own
+ * `Readline` fed in the push mode, its output is batched by the `Terminal`.
+ * Idle sessions are hibernated, see `Readline::hibernate`.
+ *
+ * The output of every connection is queued. With the epoll backend the
+ * sockets are nonblocking, the queue is written until the socket is full
+ * and the rest when the socket becomes writable again, so a client which
+ * doesn't read never stalls the others. With the io_uring backend every
+ * connection has a multishot receive which picks buffers from a provided
+ * ring, the output is sent by linked sends, and everything prepared in one
+ * `poll` is submitted together with waiting for the next completions. The ring has to be polled by the
+ * thread which created the server, epoll is used when io_uring isn't
+ * available.
+ */
+class TelnetServer {
+public:
+    enum class Backend {
+        Epoll,
+        IoUring,
+    };
+
+    struct Connection {
+        int fd;
+        TelnetFilter telnet{};
+        Readline readline{};
+        std::chrono::steady_clock::time_point active{std::chrono::steady_clock::now()};
+
+        /** Queued output, every flush of the terminal is one string
+         *
+         * Written strings are taken from the front without moving the rest.
+         */
+        std::deque<std::string> outgoing{};
+
+        /** The epoll backend waits until the socket is writable */
+        bool waiting_for_output{false};
+
+        /** Output being sent, `sent` of these are completed */
+        std::vector<std::string> sending{};
+        size_t sent{0};
+
+        /** Requests in the ring which refer to the connection */
+        size_t operations{0};
+
+        /** The connection was closed, it's freed when its requests complete */
+        bool closing{false};
+
+        explicit Connection(int socket): fd{socket} {
+            telnet.set_window_size_handler([this](size_t columns, size_t) {
+                if (columns) {
+                    readline.set_columns(columns);
+                }
+            });
+
+            readline.set_output_sink([this](std::string &output) { outgoing.emplace_back().swap(output); })
+                    .set_input_filter([this](std::string &input) { telnet(input); })
+                    .set_output_filter(TelnetFilter::encode);
+        }
+
+        Connection(const Connection &) = delete;
+        Connection &operator=(const Connection &) = delete;
+
+        /** Write the text escaped for the client */
+        void send(std::string text) {
+            TelnetFilter::encode(text);
+            send_raw(text);
+        }
+
+        void send_raw(std::string_view data) {
+            outgoing.emplace_back(data);
+        }
+
+        /** Bytes of the queued output */
+        size_t queued() const {
+            size_t size = 0;
+
+            for (auto &output: outgoing) {
+                size += output.size();
+            }
+
+            return size;
+        }
+    };
+
+    /** Called with every accepted line, the result is sent to the client,
+     * nothing closes the connection */
+    using LineHandler = std::function<std::optional<std::string>(Connection &, std::string_view)>;
+
+private:
+    int listener_{-1};
+    int epoll_{-1};
+
+    std::unique_ptr<IoUring> ring_{};
+
+    std::unordered_map<int, std::unique_ptr<Connection>> connections_{};
+
+    /** Closed connections with requests in the ring, their descriptors are still open */
+    std::unordered_map<int, std::unique_ptr<Connection>> closing_{};
+
+    /** Connections which may have output to send */
+    std::vector<int> ready_{};
+
+    LineHandler on_line_{};
+
+    /** Configures the `Readline` of a new connection, e.g. its prompt */
+    std::function<void(Readline &)> setup_{};
+
+    /** Sessions without input for so long are hibernated, zero disables it */
+    std::chrono::steady_clock::duration idle_timeout_{};
+    std::chrono::steady_clock::time_point last_sweep_{};
+
+    /** Closing the server waits at most so long for the requests in the ring */
+    static constexpr int close_timeout_ms_ = 1000;
+
+    /** Entries of the submission ring and the provided receive buffers */
+    static constexpr unsigned ring_entries_ = 512;
+    static constexpr uint16_t receive_buffers_ = 256;
+    static constexpr unsigned receive_buffer_size_ = 4096;
+
+    /** A client which doesn't read is disconnected when its queued output grows over this */
+    static constexpr size_t max_queued_output_ = 1 << 20;
+
+    /** Requests in the ring, the descriptor is in the upper bits of their user data */
+    enum Operation : uint8_t {
+        Accept,
+        Receive,
+        Send,
+    };
+
+    static uint64_t user_data(int fd, Operation operation) {
+        return uint64_t{static_cast<uint32_t>(fd)} << 8 | operation;
+    }
+
+    static void check(int result) {
+        if (result == -1) {
+            throw std::system_error{errno, std::generic_category()};
+        }
+    }
+
+    void close_all() {
+        if (ring_) {
+            // the multishot accept fails, so no connection is added meanwhile
+            shutdown(listener_, SHUT_RDWR);
+
+            while (!connections_.empty()) {
+                close(connections_.begin()->first);
+            }
+
+            // sent and received data is in memory of the connections, so their requests are completed first
+            while (!closing_.empty() && ring_->submit_and_wait(close_timeout_ms_)) {
+                ring_->complete([this](const io_uring_cqe &cqe) { complete(cqe); });
+            }
+
+            for (auto &[fd, connection]: closing_) {
+                ::close(fd);
+            }
+
+            closing_.clear();
+            ring_.reset();
+        }
+
+        for (auto &[fd, connection]: connections_) {
+            ::close(fd);
+        }
+
+        connections_.clear();
+
+        for (int fd: {listener_, epoll_}) {
+            if (fd != -1) {
+                ::close(fd);
+            }
+        }
+
+        listener_ = epoll_ = -1;
+    }
+
+    void watch(int fd, int operation = EPOLL_CTL_ADD, uint32_t events = EPOLLIN) {
+        epoll_event event{};
+        event.events = events;
+        event.data.fd = fd;
+
+        check(epoll_ctl(epoll_, operation, fd, &event));
+    }
+
+    void add_connection(int fd) {
+        const int on = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        auto connection = std::make_unique<Connection>(fd);
+
+        try {
+            if (setup_) {
+                setup_(connection->readline);
+            }
+
+            connection->send_raw(connection->telnet.start());
+            connection->readline.start_line();
+
+            if (ring_) {
+                receive_from(*connection);
+            } else {
+                watch(fd);
+            }
+
+            ready_.push_back(fd);
+        } catch (const std::system_error &) {
+            ::close(fd);
+            return;
+        }
+
+        connections_.emplace(fd, std::move(connection));
+    }
+
+    void accept_connections() {
+        while (true) {
+            const int fd = accept4(listener_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+            if (fd == -1) {
+                if (errno == EINTR || errno == ECONNABORTED) {
+                    continue;
+                }
+
+                return;
+            }
+
+            add_connection(fd);
+        }
+    }
+
+    /** Returns whether the connection remains open */
+    bool receive(Connection &connection) {
+        char chunk[receive_buffer_size_];
+        const auto n = recv(connection.fd, chunk, sizeof(chunk), MSG_DONTWAIT);
+
+        if (n == -1) {
+            return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+        }
+
+        if (n == 0) {
+            return false;
+        }
+
+        return process(connection, {chunk, static_cast<size_t>(n)});
+    }
+
+    /** Feed the received data to the session, returns whether the connection remains open */
+    bool process(Connection &connection, std::string_view input) {
+        bool open = true;
+        connection.active = std::chrono::steady_clock::now();
+
+        connection.readline.feed(input, [&](std::string_view line) {
+            if (!open) {
+                return;
+            }
+
+            auto response = on_line_ ? on_line_(connection, line) : std::optional<std::string>{""};
+
+            if (!response) {
+                open = false;
+            } else if (!response->empty()) {
+                connection.send(std::move(*response));
+            }
+        });
+
+        if (auto replies = connection.telnet.take_replies(); !replies.empty()) {
+            connection.send_raw(replies);
+        }
+
+        return open;
+    }
+
+    void hibernate_idle() {
+        const auto now = std::chrono::steady_clock::now();
+
+        // sessions are checked a few times per timeout, not for every event
+        if (now - last_sweep_ < idle_timeout_ / 4) {
+            return;
+        }
+
+        last_sweep_ = now;
+
+        for (auto &[fd, connection]: connections_) {
+            if (now - connection->active >= idle_timeout_) {
+                connection->readline.hibernate();
+                ready_.push_back(fd);
+            }
+        }
+    }
+
+    void accept_from_ring() {
+        auto &sqe = ring_->prepare(IORING_OP_ACCEPT, listener_, user_data(listener_, Accept));
+        sqe.ioprio = IORING_ACCEPT_MULTISHOT;
+        sqe.accept_flags = SOCK_CLOEXEC;
+    }
+
+    void receive_from(Connection &connection) {
+        auto &sqe = ring_->prepare(IORING_OP_RECV, connection.fd, user_data(connection.fd, Receive));
+        sqe.ioprio = IORING_RECV_MULTISHOT;
+        sqe.flags = IOSQE_BUFFER_SELECT;
+        sqe.buf_group = 0;
+
+        connection.operations++;
+    }
+
+    /** Write the queued output until the socket is full, returns whether the connection remains open
+     *
+     * The socket is watched for writability while output remains queued.
+     */
+    bool write_queued(Connection &connection) {
+        auto &outgoing = connection.outgoing;
+
+        while (!outgoing.empty()) {
+            iovec vectors[64];
+            msghdr message{};
+            message.msg_iov = vectors;
+
+            for (size_t i = 0; i < outgoing.size() && message.msg_iovlen < std::size(vectors); i++) {
+                vectors[message.msg_iovlen++] = {outgoing[i].data(), outgoing[i].size()};
+            }
+
+            auto n = sendmsg(connection.fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+
+            if (n == -1 && errno == EINTR) {
+                continue;
+            }
+
+            if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+
+            if (n == -1) {
+                return false;
+            }
+
+            for (; !outgoing.empty() && static_cast<size_t>(n) >= outgoing.front().size(); outgoing.pop_front()) {
+                n -= outgoing.front().size();
+            }
+
+            if (n) {
+                outgoing.front().erase(0, n);
+            }
+        }
+
+        if (connection.queued() > max_queued_output_) {
+            return false;
+        }
+
+        if (connection.waiting_for_output != !outgoing.empty()) {
+            connection.waiting_for_output = !outgoing.empty();
+            watch(connection.fd, EPOLL_CTL_MOD, EPOLLIN | (connection.waiting_for_output ? uint32_t{EPOLLOUT} : 0u));
+        }
+
+        return true;
+    }
+
+    /** Write the queued output of ready connections */
+    void write_ready() {
+        for (int fd: ready_) {
+            auto found = connections_.find(fd);
+
+            if (found == connections_.end()) {
+                continue;
+            }
+
+            bool open;
+
+            try {
+                open = write_queued(*found->second);
+            } catch (const std::system_error &) {
+                open = false;
+            }
+
+            if (!open) {
+                close(fd);
+            }
+        }
+
+        ready_.clear();
+    }
+
+    /** Send the queued output of ready connections, every connection by one chain of linked sends */
+    void send_queued() {
+        for (int fd: ready_) {
+            auto found = connections_.find(fd);
+
+            if (found == connections_.end()) {
+                continue;
+            }
+
+            auto &connection = *found->second;
+
+            if (connection.outgoing.empty()) {
+                continue;
+            }
+
+            // the next chain is sent when the previous one completes, so the output stays in order
+            if (!connection.sending.empty()) {
+                if (connection.queued() > max_queued_output_) {
+                    close(fd);
+                }
+
+                continue;
+            }
+
+            const size_t n = std::min<size_t>(connection.outgoing.size(), ring_->capacity() / 2);
+            const auto end = connection.outgoing.begin() + n;
+
+            connection.sending.assign(std::make_move_iterator(connection.outgoing.begin()),
+                                      std::make_move_iterator(end));
+            connection.outgoing.erase(connection.outgoing.begin(), end);
+            connection.sent = 0;
+
+            ring_->reserve(n);
+
+            for (size_t i = 0; i < n; i++) {
+                const auto &output = connection.sending[i];
+                auto &sqe = ring_->prepare(IORING_OP_SEND, fd, user_data(fd, Send));
+
+                sqe.addr = reinterpret_cast<uint64_t>(output.data());
+                sqe.len = output.size();
+                sqe.msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+
+                if (i + 1 < n) {
+                    sqe.flags = IOSQE_IO_LINK;
+                }
+            }
+
+            connection.operations += n;
+        }
+
+        ready_.clear();
+    }
+
+    void complete(const io_uring_cqe &cqe) {
+        const int fd = static_cast<int>(cqe.user_data >> 8);
+        const auto operation = static_cast<Operation>(cqe.user_data & 0xff);
+
+        if (operation == Accept) {
+            if (cqe.res >= 0) {
+                add_connection(cqe.res);
+            }
+
+            // the listener fails with EINVAL after it's shut down
+            if (!(cqe.flags & IORING_CQE_F_MORE) && cqe.res != -EINVAL) {
+                accept_from_ring();
+            }
+
+            return;
+        }
+
+        Connection *connection = nullptr;
+
+        if (auto found = connections_.find(fd); found != connections_.end()) {
+            connection = found->second.get();
+        } else if (auto found = closing_.find(fd); found != closing_.end()) {
+            connection = found->second.get();
+        }
+
+        bool open = operation == Receive ? complete_receive(connection, cqe) : complete_send(connection, cqe);
+
+        if (!connection) {
+            return;
+        }
+
+        if (connection->closing) {
+            if (!connection->operations) {
+                closing_.erase(fd);
+                ::close(fd);
+            }
+        } else if (!open) {
+            close(fd);
+        }
+    }
+
+    /** Returns whether the connection remains open */
+    bool complete_receive(Connection *connection, const io_uring_cqe &cqe) {
+        const bool armed = cqe.flags & IORING_CQE_F_MORE;
+        bool open = cqe.res > 0 || cqe.res == -ENOBUFS;
+
+        if (cqe.flags & IORING_CQE_F_BUFFER) {
+            const uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+
+            if (connection && !connection->closing && cqe.res > 0) {
+                try {
+                    open = process(*connection, ring_->buffer(id, cqe.res));
+                } catch (const std::system_error &) {
+                    open = false;
+                }
+
+                ready_.push_back(connection->fd);
+            }
+
+            ring_->return_buffer(id);
+        }
+
+        if (!connection || armed) {
+            return open;
+        }
+
+        connection->operations--;
+
+        // the kernel stops a multishot receive e.g. when the buffers run out
+        if (open && !connection->closing) {
+            receive_from(*connection);
+        }
+
+        return open;
+    }
+
+    /** Returns whether the connection remains open */
+    bool complete_send(Connection *connection, const io_uring_cqe &cqe) {
+        if (!connection) {
+            return true;
+        }
+
+        connection->operations--;
+
+        // a short send breaks the chain, the rest of it is canceled and sent again
+        auto &output = connection->sending[connection->sent++];
+        bool open = true;
+
+        if (cqe.res >= 0) {
+            output.erase(0, cqe.res);
+        } else if (cqe.res != -ECANCELED) {
+            open = false;
+        }
+
+        if (connection->sent == connection->sending.size()) {
+            auto unsent = std::remove_if(connection->sending.begin(), connection->sending.end(),
+                                         [](const std::string &s) { return s.empty(); });
+
+            connection->outgoing.insert(connection->outgoing.begin(),
+                                        std::make_move_iterator(connection->sending.begin()),
+                                        std::make_move_iterator(unsent));
+            connection->sending.clear();
+            ready_.push_back(connection->fd);
+        }
+
+        return open;
+    }
+
+    void poll_epoll(int timeout_ms) {
+        epoll_event events[64];
+        int n;
+
+        do {
+            n = epoll_wait(epoll_, events, std::size(events), timeout_ms);
+        } while (n == -1 && errno == EINTR);
+
+        check(n);
+
+        for (int i = 0; i < n; i++) {
+            const int fd = events[i].data.fd;
+
+            if (fd == listener_) {
+                accept_connections();
+                continue;
+            }
+
+            auto connection = connections_.find(fd);
+
+            if (connection == connections_.end()) {
+                continue;
+            }
+
+            bool open = !(events[i].events & (EPOLLERR | EPOLLHUP)) || (events[i].events & EPOLLIN);
+
+            if (open && (events[i].events & EPOLLIN)) {
+                try {
+                    open = receive(*connection->second);
+                } catch (const std::system_error &) {
+                    open = false;
+                }
+            }
+
+            if (!open) {
+                close(fd);
+                continue;
+            }
+
+            ready_.push_back(fd);
+        }
+    }
+
+    void poll_ring(int timeout_ms) {
+        send_queued();
+        ring_->submit_and_wait(timeout_ms);
+        ring_->complete([this](const io_uring_cqe &cqe) { complete(cqe); });
+    }
+
+public:
+    /** Listen on the address, the port 0 picks a free one */
+    explicit TelnetServer(uint16_t port = 0, const std::string &address = "127.0.0.1",
+                          Backend backend = Backend::Epoll) {
+        sockaddr_in socket_address{};
+        socket_address.sin_family = AF_INET;
+        socket_address.sin_port = htons(port);
+
+        if (inet_pton(AF_INET, address.c_str(), &socket_address.sin_addr) != 1) {
+            throw std::system_error{EINVAL, std::generic_category()};
+        }
+
+        try {
+            const int on = 1;
+
+            check(listener_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+            check(setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)));
+            check(bind(listener_, reinterpret_cast<const sockaddr *>(&socket_address), sizeof(socket_address)));
+            check(listen(listener_, SOMAXCONN));
+
+            if (backend == Backend::IoUring) {
+                try {
+                    ring_ = std::make_unique<IoUring>(ring_entries_);
+                    ring_->provide_buffers(0, receive_buffers_, receive_buffer_size_);
+                    accept_from_ring();
+                } catch (const std::system_error &) {
+                    // older kernels and io_uring disabled by the system
+                    ring_.reset();
+                }
+            }
+
+            if (!ring_) {
+                check(epoll_ = epoll_create1(EPOLL_CLOEXEC));
+                watch(listener_);
+            }
+        } catch (...) {
+            close_all();
+            throw;
+        }
+    }
+
+    ~TelnetServer() {
+        close_all();
+    }
+
+    TelnetServer(const TelnetServer &) = delete;
+    TelnetServer &operator=(const TelnetServer &) = delete;
+
+    uint16_t port() const {
+        sockaddr_in address{};
+        socklen_t size = sizeof(address);
+
+        check(getsockname(listener_, reinterpret_cast<sockaddr *>(&address), &size));
+        return ntohs(address.sin_port);
+    }
+
+    /** The backend in use, it differs from the requested one when io_uring isn't available */
+    Backend backend() const {
+        return ring_ ? Backend::IoUring : Backend::Epoll;
+    }
+
+    TelnetServer &set_line_handler(LineHandler f) {
+        on_line_ = std::move(f);
+        return *this;
+    }
+
+    TelnetServer &set_session_setup(std::function<void(Readline &)> f) {
+        setup_ = std::move(f);
+        return *this;
+    }
+
+    TelnetServer &set_idle_timeout(std::chrono::steady_clock::duration timeout) {
+        idle_timeout_ = timeout;
+        return *this;
+    }
+
+    /** Number of open connections */
+    size_t size() const {
+        return connections_.size();
+    }
+
+    /** Number of hibernated sessions */
+    size_t hibernated() const {
+        return std::count_if(connections_.begin(), connections_.end(), [](auto &entry) {
+            return entry.second->readline.hibernated();
+        });
+    }
+
+    void close(int fd) {
+        auto found = connections_.find(fd);
+
+        if (found == connections_.end()) {
+            return;
+        }
+
+        if (!ring_) {
+            // e.g. the answer to the line which closed the connection, what doesn't fit the socket is dropped
+            try {
+                write_queued(*found->second);
+            } catch (const std::system_error &) {
+            }
+
+            epoll_ctl(epoll_, EPOLL_CTL_DEL, fd, nullptr);
+            connections_.erase(found);
+            ::close(fd);
+            return;
+        }
+
+        auto connection = std::move(found->second);
+        connections_.erase(found);
+
+        if (!connection->operations) {
+            ::close(fd);
+            return;
+        }
+
+        // the requests fail after the shutdown, the descriptor is closed when they complete
+        connection->closing = true;
+        shutdown(fd, SHUT_RDWR);
+        closing_.emplace(fd, std::move(connection));
+    }
+
+    /** Wait at most the timeout for events and handle them, -1 waits without limit */
+    void poll(int timeout_ms) {
+        if (ring_) {
+            poll_ring(timeout_ms);
+        } else {
+            poll_epoll(timeout_ms);
+        }
+
+        if (idle_timeout_ != std::chrono::steady_clock::duration::zero()) {
+            hibernate_idle();
+        }
+
+        // the output of handled events is sent before returning
+        if (ring_) {
+            send_queued();
+            ring_->submit();
+        } else {
+            write_ready();
+        }
+    }
+};
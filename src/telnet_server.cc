@@ -0,0 +1,34 @@
+#include <iostream>
+#include "telnet.hh"
+
+/** Echoes lines of telnet clients, e.g. `telnet localhost 2323`, `exit` disconnects
+ *
+ * Usage: telnet-server [port [address [epoll|io_uring]]]
+ */
+int main(int argc, char **argv) {
+    const uint16_t port = argc > 1 ? std::atoi(argv[1]) : 2323;
+    const auto backend = argc > 3 && std::string_view{argv[3]} == "io_uring" ? TelnetServer::Backend::IoUring
+                                                                             : TelnetServer::Backend::Epoll;
+
+    TelnetServer server{port, argc > 2 ? argv[2] : "127.0.0.1", backend};
+
+    server.set_session_setup([](Readline &readline) {
+                readline.set_prompter([] { return "remote> "; });
+                readline.set_bracket_matching(true);
+            })
+          .set_line_handler([](TelnetServer::Connection &, std::string_view line) -> std::optional<std::string> {
+                if (line == "exit") {
+                    return std::nullopt;
+                }
+
+                return "got: " + std::string{line} + "\n";
+            })
+          .set_idle_timeout(std::chrono::minutes{1});
+
+    std::cout << "listening on port " << server.port()
+              << (server.backend() == TelnetServer::Backend::IoUring ? " with io_uring" : " with epoll") << std::endl;
+
+    while (true) {
+        server.poll(1000);
+    }
+}
@@ -0,0 +1,291 @@
+#pragma once
+
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <system_error>
+#include <string_view>
+#include <vector>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
+
+/** This class is an io_uring set up and entered by raw system calls
+ *
+ * It has only what the telnet server needs: entries are prepared in the
+ * submission ring and submitted together with waiting for completions, and
+ * receives pick their buffers from a ring of provided buffers. The ring is
+ * entered only by the thread which created it, so completions are processed
+ * only when it waits for them. That needs Linux 6.1, which has also the
+ * multishot receives, the constructor throws on older kernels or when
+ * io_uring is disabled.
+ */
+class IoUring {
+    int fd_{-1};
+
+    /** Submission and completion rings, they share one mapping */
+    void *rings_{MAP_FAILED};
+    size_t rings_size_{0};
+
+    io_uring_sqe *sqes_{static_cast<io_uring_sqe *>(MAP_FAILED)};
+    size_t sqes_size_{0};
+
+    unsigned *sq_head_{nullptr};
+    unsigned *sq_tail_{nullptr};
+    unsigned *sq_array_{nullptr};
+    unsigned sq_mask_{0};
+    unsigned sq_entries_{0};
+
+    unsigned *cq_head_{nullptr};
+    unsigned *cq_tail_{nullptr};
+    io_uring_cqe *cqes_{nullptr};
+    unsigned cq_mask_{0};
+
+    /** Provided buffers, the kernel picks one for every received chunk
+     *
+     * The ring is used as an array, the empty member declaring the flexible
+     * array of `io_uring_buf_ring` takes space in C++. Its tail overlays the
+     * reserved field of the first entry.
+     */
+    io_uring_buf *buffer_ring_{static_cast<io_uring_buf *>(MAP_FAILED)};
+    size_t buffer_ring_size_{0};
+    std::vector<char> buffers_{};
+    unsigned buffer_size_{0};
+    uint16_t buffer_mask_{0};
+
+    /** Number of `io_uring_enter` calls */
+    size_t enters_{0};
+
+    void release() {
+        if (buffer_ring_ != MAP_FAILED) {
+            munmap(buffer_ring_, buffer_ring_size_);
+        }
+
+        if (sqes_ != MAP_FAILED) {
+            munmap(sqes_, sqes_size_);
+        }
+
+        if (rings_ != MAP_FAILED) {
+            munmap(rings_, rings_size_);
+        }
+
+        if (fd_ != -1) {
+            close(fd_);
+        }
+    }
+
+    template <typename T>
+    T *ring_field(unsigned offset) const {
+        return reinterpret_cast<T *>(static_cast<char *>(rings_) + offset);
+    }
+
+    /** Returns false when the wait timed out */
+    bool enter(unsigned min_complete, unsigned flags, int timeout_ms) {
+        __kernel_timespec timeout{timeout_ms / 1000, (timeout_ms % 1000) * 1000000LL};
+        io_uring_getevents_arg argument{};
+
+        if (timeout_ms >= 0) {
+            argument.ts = reinterpret_cast<uint64_t>(&timeout);
+        }
+
+        while (true) {
+            enters_++;
+
+            const auto result = syscall(__NR_io_uring_enter, fd_, unsubmitted(), min_complete,
+                                        flags | IORING_ENTER_EXT_ARG, &argument, sizeof(argument));
+
+            if (result != -1) {
+                return true;
+            }
+
+            if (errno == ETIME) {
+                return false;
+            }
+
+            // completions which didn't fit the ring are kept by the kernel until these are processed
+            if (errno == EBUSY) {
+                return true;
+            }
+
+            if (errno != EINTR) {
+                throw std::system_error{errno, std::generic_category()};
+            }
+        }
+    }
+
+public:
+    explicit IoUring(unsigned entries) {
+        io_uring_params params{};
+        params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_CQSIZE;
+        params.cq_entries = entries * 4;
+
+        fd_ = syscall(__NR_io_uring_setup, entries, &params);
+
+        if (fd_ == -1) {
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        try {
+            if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+                throw std::system_error{ENOSYS, std::generic_category()};
+            }
+
+            rings_size_ = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                                   params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+            rings_ = mmap(nullptr, rings_size_, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          fd_, IORING_OFF_SQ_RING);
+
+            if (rings_ == MAP_FAILED) {
+                throw std::system_error{errno, std::generic_category()};
+            }
+
+            sqes_size_ = params.sq_entries * sizeof(io_uring_sqe);
+            sqes_ = static_cast<io_uring_sqe *>(mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                                                     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES));
+
+            if (sqes_ == MAP_FAILED) {
+                throw std::system_error{errno, std::generic_category()};
+            }
+        } catch (...) {
+            release();
+            throw;
+        }
+
+        sq_head_ = ring_field<unsigned>(params.sq_off.head);
+        sq_tail_ = ring_field<unsigned>(params.sq_off.tail);
+        sq_array_ = ring_field<unsigned>(params.sq_off.array);
+        sq_mask_ = *ring_field<unsigned>(params.sq_off.ring_mask);
+        sq_entries_ = params.sq_entries;
+
+        cq_head_ = ring_field<unsigned>(params.cq_off.head);
+        cq_tail_ = ring_field<unsigned>(params.cq_off.tail);
+        cqes_ = ring_field<io_uring_cqe>(params.cq_off.cqes);
+        cq_mask_ = *ring_field<unsigned>(params.cq_off.ring_mask);
+    }
+
+    ~IoUring() {
+        release();
+    }
+
+    IoUring(const IoUring &) = delete;
+    IoUring &operator=(const IoUring &) = delete;
+
+    /** Entries prepared but not submitted yet */
+    unsigned unsubmitted() const {
+        return *sq_tail_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+    }
+
+    /** Make room for entries which have to be submitted together, e.g. a linked chain */
+    void reserve(unsigned n) {
+        if (sq_entries_ - unsubmitted() < n) {
+            submit();
+        }
+    }
+
+    unsigned capacity() const {
+        return sq_entries_;
+    }
+
+    /** Get a cleared submission entry, the kernel sees it at the next enter */
+    io_uring_sqe &prepare(uint8_t opcode, int fd, uint64_t user_data) {
+        reserve(1);
+
+        const unsigned tail = *sq_tail_;
+        const unsigned index = tail & sq_mask_;
+        auto &sqe = sqes_[index];
+
+        std::memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = opcode;
+        sqe.fd = fd;
+        sqe.user_data = user_data;
+
+        sq_array_[index] = index;
+        __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+
+        return sqe;
+    }
+
+    /** Submit the prepared entries without waiting */
+    void submit() {
+        if (unsubmitted()) {
+            enter(0, 0, -1);
+        }
+    }
+
+    /** Submit the prepared entries and wait for a completion, -1 waits without limit
+     *
+     * Returns false when the wait timed out.
+     */
+    bool submit_and_wait(int timeout_ms) {
+        return enter(1, IORING_ENTER_GETEVENTS, timeout_ms);
+    }
+
+    /** Call `f` with every completion which arrived */
+    template <typename F>
+    size_t complete(F &&f) {
+        size_t n = 0;
+        unsigned head = *cq_head_;
+
+        while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+            const io_uring_cqe cqe = cqes_[head & cq_mask_];
+
+            // the slot is returned first, `f` may prepare more entries
+            __atomic_store_n(cq_head_, ++head, __ATOMIC_RELEASE);
+            f(cqe);
+            n++;
+        }
+
+        return n;
+    }
+
+    /** Register `count` buffers of the size for the group, the count is a power of two */
+    void provide_buffers(uint16_t group, uint16_t count, unsigned size) {
+        buffer_ring_size_ = count * sizeof(io_uring_buf);
+        buffer_ring_ = static_cast<io_uring_buf *>(mmap(nullptr, buffer_ring_size_, PROT_READ | PROT_WRITE,
+                                                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+
+        if (buffer_ring_ == MAP_FAILED) {
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        io_uring_buf_reg registration{};
+        registration.ring_addr = reinterpret_cast<uint64_t>(buffer_ring_);
+        registration.ring_entries = count;
+        registration.bgid = group;
+
+        if (syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PBUF_RING, &registration, 1) == -1) {
+            throw std::system_error{errno, std::generic_category()};
+        }
+
+        buffers_.resize(size_t{count} * size);
+        buffer_size_ = size;
+        buffer_mask_ = count - 1;
+
+        for (uint16_t id = 0; id < count; id++) {
+            return_buffer(id);
+        }
+    }
+
+    /** Received data in the buffer picked by the kernel */
+    std::string_view buffer(uint16_t id, size_t size) const {
+        return {buffers_.data() + size_t{id} * buffer_size_, size};
+    }
+
+    /** Give the buffer back to the kernel for further receives */
+    void return_buffer(uint16_t id) {
+        uint16_t &tail = buffer_ring_[0].resv;
+        auto &entry = buffer_ring_[tail & buffer_mask_];
+
+        entry.addr = reinterpret_cast<uint64_t>(buffers_.data() + size_t{id} * buffer_size_);
+        entry.len = buffer_size_;
+        entry.bid = id;
+
+        __atomic_store_n(&tail, static_cast<uint16_t>(tail + 1), __ATOMIC_RELEASE);
+    }
+
+    size_t enters() const {
+        return enters_;
+    }
+};
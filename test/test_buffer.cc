@@ -91,4 +91,339 @@ BOOST_AUTO_TEST_CASE(TestMovesWithEmptyBuffer) {
     BOOST_CHECK_EQUAL(buffer.position(), 0);
 }
 
+BOOST_AUTO_TEST_CASE(TestSpillToFile) {
+
+    Buffer buffer{};
+    buffer.set_memory_limit(16);
+
+    buffer.insert("0123456789"sv);
+    BOOST_CHECK_EQUAL(buffer.spilled(), false);
+
+    buffer.insert("abcdefghij"sv);
+    BOOST_CHECK_EQUAL(buffer.spilled(), true);
+    BOOST_CHECK_EQUAL(buffer.view(), "0123456789abcdefghij"sv);
+
+    for (auto i = 0; i < 10; i++) {
+        buffer.move_left();
+    }
+    buffer.insert('x');
+
+    BOOST_CHECK_EQUAL(buffer.view(), "0123456789xabcdefghij"sv);
+    BOOST_CHECK_EQUAL(buffer.position(), 11);
+
+    for (auto i = 0; i < 4; i++) {
+        buffer.remove();
+    }
+
+    BOOST_CHECK_EQUAL(buffer.view(), "0123456abcdefghij"sv);
+    BOOST_CHECK_EQUAL(buffer.position(), 7);
+}
+
+BOOST_AUTO_TEST_CASE(TestSpilledBufferIsReleasedOnClear) {
+
+    Buffer buffer{};
+    buffer.set_memory_limit(4);
+
+    buffer.reset("spilled content");
+    BOOST_CHECK_EQUAL(buffer.spilled(), true);
+
+    buffer.clear();
+    BOOST_CHECK_EQUAL(buffer.spilled(), false);
+    BOOST_CHECK_EQUAL(buffer.empty(), true);
+}
+
+BOOST_AUTO_TEST_CASE(TestMovesOverMultibyteCharacters) {
+
+    Buffer buffer{};
+    buffer.insert("a\u00e9e\u0301\U0001f600"sv);
+
+    buffer.move_left();
+    BOOST_CHECK_EQUAL(buffer.position(), 6);
+
+    buffer.move_left();
+    BOOST_CHECK_EQUAL(buffer.position(), 3);
+
+    buffer.move_left(2);
+    BOOST_CHECK_EQUAL(buffer.position(), 0);
+
+    buffer.move_right(2);
+    BOOST_CHECK_EQUAL(buffer.position(), 3);
+
+    buffer.remove();
+    BOOST_CHECK_EQUAL(buffer.view(), "ae\u0301\U0001f600"sv);
+    BOOST_CHECK_EQUAL(buffer.position(), 1);
+}
+
+BOOST_AUTO_TEST_CASE(TestMarkFollowsEdits) {
+
+    Buffer buffer{};
+    buffer.insert("hello world"sv);
+    buffer.set_position(6);
+    buffer.set_mark();
+    buffer.set_position(0);
+    buffer.insert(">> "sv);
+
+    BOOST_CHECK_EQUAL(buffer.region_view(), "hello "sv);
+
+    buffer.exchange_point_and_mark();
+    BOOST_CHECK_EQUAL(buffer.position(), 9);
+    BOOST_CHECK_EQUAL(buffer.region_view(), "hello "sv);
+}
+
+BOOST_AUTO_TEST_CASE(TestCaseConversion) {
+
+    Buffer buffer{};
+    const auto text = "The quick brown fox jumps over the lazy dog, \u017elu\u0165ou\u010dk\u00fd k\u016f\u0148 \u00e9t\u00e9 \u0434\u043e\u043c"s;
+    buffer.insert(text);
+
+    // the tests run in the "C" locale, so letters outside ASCII don't depend on the C library
+    buffer.convert_case(0, buffer.size(), LetterCase::Upper);
+    BOOST_CHECK_EQUAL(buffer.view().substr(0, 44), "THE QUICK BROWN FOX JUMPS OVER THE LAZY DOG,"sv);
+    BOOST_CHECK(buffer.view().find("\u017dLU\u0164OU\u010cK\u00dd K\u016e\u0147"sv) != std::string_view::npos);
+    BOOST_CHECK(buffer.view().find("\u00c9T\u00c9 \u0414\u041e\u041c"sv) != std::string_view::npos);
+
+    buffer.convert_case(0, buffer.size(), LetterCase::Lower);
+    BOOST_CHECK_EQUAL(buffer.view().substr(0, 44), "the quick brown fox jumps over the lazy dog,"sv);
+    BOOST_CHECK_EQUAL(buffer.view().substr(44), std::string_view{text}.substr(44));
+
+    buffer.capitalize(0, 19);
+    BOOST_CHECK_EQUAL(buffer.view().substr(0, 24), "The Quick Brown Fox jump"sv);
+
+    // the dotted and dotless i pair with ASCII letters, not with each other
+    BOOST_CHECK_EQUAL(CaseConversion::convert(0x130, LetterCase::Lower), U'i');
+    BOOST_CHECK_EQUAL(CaseConversion::convert(0x130, LetterCase::Upper), U'\u0130');
+    BOOST_CHECK_EQUAL(CaseConversion::convert(0x131, LetterCase::Upper), U'I');
+    BOOST_CHECK_EQUAL(CaseConversion::convert(0x131, LetterCase::Lower), U'\u0131');
+
+    // downcasing shortens the region, the word after it is kept
+    const auto region = "\u0130STANBUL \u0130ZM\u0130R"sv;
+    Buffer shrinking{};
+    shrinking.insert(region);
+    shrinking.insert(" ankara"sv);
+
+    shrinking.capitalize(0, region.size());
+    BOOST_CHECK_EQUAL(shrinking.view(), "Istanbul Izmir ankara"sv);
+}
+
+BOOST_AUTO_TEST_CASE(TestTransposeWords) {
+
+    Buffer buffer{};
+    buffer.insert("one, two three"sv);
+    buffer.set_position(5);
+    buffer.transpose_words();
+
+    BOOST_CHECK_EQUAL(buffer.view(), "two, one three"sv);
+    BOOST_CHECK_EQUAL(buffer.position(), 8);
+
+    buffer.set_position(buffer.size());
+    buffer.transpose_words();
+
+    BOOST_CHECK_EQUAL(buffer.view(), "two, three one"sv);
+}
+
+BOOST_AUTO_TEST_CASE(TestTextSearch) {
+
+    std::string text(100, '-');
+    text.replace(3, 3, "abc");
+    text.replace(40, 3, "abc");
+    text.replace(77, 3, "abc");
+    text[50] = 'x';
+
+    for (size_t from = 0; from <= text.size(); from++) {
+        BOOST_CHECK_EQUAL(TextSearch::find(text, 'x', from), text.find('x', from));
+        BOOST_CHECK_EQUAL(TextSearch::find(text, "abc"sv, from), text.find("abc", from));
+        BOOST_CHECK_EQUAL(TextSearch::find(text, "c-"sv, from), text.find("c-", from));
+
+        const auto before = from ? from - 1 : std::string::npos;
+        BOOST_CHECK_EQUAL(TextSearch::rfind(text, 'x', from), from ? text.rfind('x', before) : std::string::npos);
+        BOOST_CHECK_EQUAL(TextSearch::rfind(text, "abc"sv, from), from ? text.rfind("abc", before) : std::string::npos);
+    }
+
+    BOOST_CHECK_EQUAL(TextSearch::find(text, "abd"sv), TextSearch::npos);
+    BOOST_CHECK_EQUAL(TextSearch::rfind(text, "abc"sv), 77);
+}
+
+/** Matching tokens of all positions found in a single pass */
+static std::vector<std::optional<size_t>> scan_matches(std::string_view text) {
+    std::vector<std::optional<size_t>> matches(text.size());
+    std::vector<size_t> open;
+    std::optional<size_t> quote[2];
+
+    for (size_t i = 0; i < text.size(); i++) {
+        switch (text[i]) {
+            case '(': case '[': case '{':
+                open.push_back(i);
+                break;
+            case ')': case ']': case '}':
+                if (!open.empty()) {
+                    // brackets of other kinds close each other without matching
+                    if (std::string_view{"()[]{}"}.find(std::string{text[open.back()], text[i]}) % 2 == 0) {
+                        matches[i] = open.back();
+                        matches[open.back()] = i;
+                    }
+
+                    open.pop_back();
+                }
+                break;
+            case '"': case '\'': {
+                auto &pending = quote[text[i] == '"' ? 0 : 1];
+
+                if (pending) {
+                    matches[i] = *pending;
+                    matches[*pending] = i;
+                    pending.reset();
+                } else {
+                    pending = i;
+                }
+                break;
+            }
+        }
+    }
+
+    return matches;
+}
+
+BOOST_AUTO_TEST_CASE(TestMatchingBrackets) {
+
+    Buffer buffer{};
+    buffer.insert("f(a[1], {b: \"x\"})"sv);
+
+    BOOST_CHECK(buffer.matching_bracket(1) == 16u);
+    BOOST_CHECK(buffer.matching_bracket(16) == 1u);
+    BOOST_CHECK(buffer.matching_bracket(8) == 15u);
+    BOOST_CHECK(buffer.matching_bracket(12) == 14u);
+    BOOST_CHECK(!buffer.matching_bracket(0));
+
+    buffer.set_position(0);
+    buffer.insert("(("sv);
+    BOOST_CHECK(!buffer.matching_bracket(1));
+    BOOST_CHECK(buffer.matching_bracket(3) == 18u);
+
+    // brackets of different kinds don't match
+    buffer.reset("([)] (]"sv);
+    BOOST_CHECK(!buffer.matching_bracket(0));
+    BOOST_CHECK(!buffer.matching_bracket(1));
+    BOOST_CHECK(!buffer.matching_bracket(2));
+    BOOST_CHECK(!buffer.matching_bracket(3));
+    BOOST_CHECK(!buffer.matching_bracket(5));
+    BOOST_CHECK(!buffer.matching_bracket(6));
+}
+
+BOOST_AUTO_TEST_CASE(TestBracketIndexIsKeptOnlyOnRequest) {
+
+    Buffer plain{}, brackets{};
+    plain.insert(std::string(2000, 'x'));
+    brackets.insert(std::string(1000, '(') + std::string(1000, ')'));
+
+    // the index is built by a lookup and dropped by the next edit
+    BOOST_CHECK_EQUAL(brackets.memory_usage(), plain.memory_usage());
+    BOOST_CHECK(brackets.matching_bracket(0) == 1999u);
+    BOOST_CHECK_GT(brackets.memory_usage(), plain.memory_usage());
+
+    plain.insert("x"sv);
+    brackets.insert("x"sv);
+    BOOST_CHECK_EQUAL(brackets.memory_usage(), plain.memory_usage());
+
+    // kept up to date when requested
+    brackets.set_bracket_index(true);
+    BOOST_CHECK(brackets.matching_bracket(1999) == 0u);
+
+    brackets.insert("()"sv);
+    BOOST_CHECK_GT(brackets.memory_usage(), plain.memory_usage());
+    BOOST_CHECK(brackets.matching_bracket(2001) == 2002u);
+
+    brackets.set_bracket_index(false);
+    plain.insert("()"sv);
+    BOOST_CHECK_EQUAL(brackets.memory_usage(), plain.memory_usage());
+}
+
+BOOST_AUTO_TEST_CASE(TestMatchingBracketsFollowEdits) {
+
+    Buffer buffer{};
+    buffer.set_bracket_index(true);
+    const auto alphabet = "()[]{}\"'ab"sv;
+    uint32_t seed = 12345;
+
+    auto random = [&](size_t n) {
+        seed = seed * 1103515245 + 12345;
+        return (seed >> 8) % n;
+    };
+
+    for (int step = 0; step < 2000; step++) {
+        if (buffer.size() > 8 && random(3) == 0) {
+            const auto begin = random(buffer.size());
+            buffer.erase(begin, begin + random(8) + 1);
+        } else {
+            std::string text;
+
+            for (auto n = random(6) + 1; n; n--) {
+                text += alphabet[random(alphabet.size())];
+            }
+
+            buffer.set_position(random(buffer.size() + 1));
+            buffer.insert(text);
+        }
+
+        if (step % 50 == 0) {
+            buffer.reset(buffer.data());
+        }
+
+        const auto expected = scan_matches(buffer.view());
+        std::vector<std::optional<size_t>> matches;
+
+        for (size_t pos = 0; pos < buffer.size(); pos++) {
+            matches.push_back(buffer.matching_bracket(pos));
+        }
+
+        BOOST_REQUIRE(matches == expected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(TestLoadLargeFileWithoutCopying) {
+
+    const auto path = ExternalEditor::create_file(std::string(1 << 20, 'x') + "(y)");
+    int fd = open(path.c_str(), O_RDWR);
+    unlink(path.c_str());
+
+    Buffer buffer{};
+    buffer.set_memory_limit(1 << 16);
+    buffer.load(fd);
+
+    BOOST_CHECK(buffer.spilled());
+    BOOST_CHECK_EQUAL(buffer.size(), (1 << 20) + 3);
+    BOOST_CHECK_EQUAL(buffer.position(), buffer.size());
+    BOOST_CHECK(buffer.matching_bracket(1 << 20) == (1u << 20) + 2);
+}
+
+BOOST_AUTO_TEST_CASE(TestResidentWindowFollowsCursor) {
+
+    const size_t window = 1 << 20;
+
+    Buffer buffer{};
+    buffer.set_memory_limit(1 << 16);
+    buffer.insert(std::string(4 * window, 'x'));
+
+    BOOST_REQUIRE(buffer.spilled());
+    BOOST_CHECK(buffer.resident().first <= buffer.position() && buffer.position() < buffer.resident().second);
+
+    // moves far from the window and the window follows
+    buffer.set_position(0);
+    BOOST_CHECK_EQUAL(buffer.resident().first, 0);
+    BOOST_CHECK_LE(buffer.resident().second, 2 * window);
+
+    buffer.move_right(3 * window);
+    BOOST_CHECK(buffer.resident().first <= buffer.position() && buffer.position() < buffer.resident().second);
+    BOOST_CHECK_GE(buffer.resident().first, window);
+
+    // the file grows and is mapped again, the window is computed for the new mapping
+    buffer.set_position(0);
+    buffer.insert(std::string(8 * window, 'y'));
+    BOOST_CHECK(buffer.resident().first <= buffer.position() && buffer.position() < buffer.resident().second);
+
+    buffer.erase(0, 8 * window);
+    BOOST_CHECK_EQUAL(buffer.size(), 4 * window);
+    BOOST_CHECK_EQUAL(buffer.view().find('y'), std::string_view::npos);
+    BOOST_CHECK(buffer.resident().first <= buffer.position() && buffer.position() < buffer.resident().second);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
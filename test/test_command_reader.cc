@@ -5,6 +5,28 @@
 #include <sstream>
 #include "../src/readline.hh"
 
+/** Stream buffer which makes only one byte available at a time */
+class OneByteBuffer: public std::streambuf {
+    std::string data_;
+    size_t pos_{0};
+    char current_{0};
+
+protected:
+    int_type underflow() override {
+        if (pos_ == data_.size()) {
+            return traits_type::eof();
+        }
+
+        current_ = data_[pos_++];
+        setg(&current_, &current_, &current_ + 1);
+
+        return traits_type::to_int_type(current_);
+    }
+
+public:
+    OneByteBuffer(std::string data): data_{std::move(data)} {}
+};
+
 BOOST_AUTO_TEST_SUITE(TestCommandReader)
 
 BOOST_AUTO_TEST_CASE(SimpleCommandWorks) {
@@ -104,4 +126,199 @@ BOOST_AUTO_TEST_CASE(ItCanReadConsecutiveCommandsWithDefault) {
     BOOST_CHECK_EQUAL(default_called, 3);
 }
 
+BOOST_AUTO_TEST_CASE(ParametersAreCollected) {
+
+    std::stringstream input{"\x1b[1;5D"};
+    CommandReader reader{input};
+    std::string parameters;
+
+    reader.add_parameterized_prefix({'\x1b', '['});
+    reader.add_command({'\x1b', '[', 'D'}, [&] { parameters = reader.parameters(); });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    BOOST_CHECK_EQUAL(parameters, "1;5");
+}
+
+BOOST_AUTO_TEST_CASE(UnknownControlSequenceIsDiscarded) {
+
+    std::stringstream input{"\x1b[?62;22cx"};
+    CommandReader reader{input};
+    std::string text;
+
+    reader.add_parameterized_prefix({'\x1b', '['});
+    reader.set_default([&] { text.push_back(reader.current_char()); });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    BOOST_CHECK_EQUAL(text, "x");
+}
+
+BOOST_AUTO_TEST_CASE(KeyEventEscapeIsExecutedImmediately) {
+
+    std::stringstream input{"\x1b[27u"};
+    CommandReader reader{input};
+    bool escape_called = false,
+         move_left_called = false;
+
+    reader.enable_key_events();
+    reader.add_command('\x1b', [&] { escape_called = true; });
+    reader.add_command({'\x1b', '[', 'D'}, [&] { move_left_called = true; });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    BOOST_CHECK_EQUAL(escape_called, true);
+    BOOST_CHECK_EQUAL(move_left_called, false);
+}
+
+BOOST_AUTO_TEST_CASE(KeyEventsAreTranslatedToLegacyKeys) {
+
+    std::stringstream input{"\x1b[99;5u\x1b[120;3u\x1b[97;2u\x1b[57399u"};
+    CommandReader reader{input};
+    bool ctrl_c_called = false,
+         alt_x_called = false;
+    std::string text;
+
+    reader.enable_key_events();
+    reader.add_command('\x03', [&] { ctrl_c_called = true; });
+    reader.add_command({'\x1b', 'x'}, [&] { alt_x_called = true; });
+    reader.set_default([&] { text.push_back(reader.current_char()); });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    BOOST_CHECK_EQUAL(ctrl_c_called, true);
+    BOOST_CHECK_EQUAL(alt_x_called, true);
+    BOOST_CHECK_EQUAL(text, "A");
+}
+
+BOOST_AUTO_TEST_CASE(TextRunsAreInsertedAtOnce) {
+
+    std::stringstream input{"hello\x7fworld"};
+    CommandReader reader{input};
+    std::vector<std::string> runs;
+
+    reader.add_command('\x7f', [&] { runs.push_back("<bs>"); });
+    reader.set_self_insert([&] { runs.emplace_back(reader.current_text()); });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    BOOST_REQUIRE_EQUAL(runs.size(), 3);
+    BOOST_CHECK_EQUAL(runs[0], "hello");
+    BOOST_CHECK_EQUAL(runs[1], "<bs>");
+    BOOST_CHECK_EQUAL(runs[2], "world");
+}
+
+BOOST_AUTO_TEST_CASE(TextRunsAreReadFromPipe) {
+
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+    BOOST_REQUIRE_EQUAL(write(fds[1], "hello\x7f\x7fworld", 12), 12);
+
+    FdInputStream input{fds[0]};
+    CommandReader reader{input};
+    std::vector<std::string> runs;
+
+    reader.add_repeatable_command('\x7f', [&] { runs.push_back("<bs>" + std::to_string(reader.repeat_count())); });
+    reader.set_self_insert([&] {
+        runs.emplace_back(reader.current_text());
+
+        // the rest arrives while the first run is handled
+        if (runs.size() == 1) {
+            BOOST_REQUIRE_EQUAL(write(fds[1], "!", 1), 1);
+            close(fds[1]);
+        }
+    });
+
+    reader.start_reading();
+    reader.read_and_execute();
+    close(fds[0]);
+
+    BOOST_REQUIRE_EQUAL(runs.size(), 4);
+    BOOST_CHECK_EQUAL(runs[0], "hello");
+    BOOST_CHECK_EQUAL(runs[1], "<bs>2");
+    BOOST_CHECK_EQUAL(runs[2], "world");
+    BOOST_CHECK_EQUAL(runs[3], "!");
+}
+
+BOOST_AUTO_TEST_CASE(RepeatedCommandsAreMerged) {
+
+    std::stringstream input{"\x7f\x7f\x7f\x1b[D\x1b[D\x7f"};
+    CommandReader reader{input};
+    std::vector<size_t> backspaces, moves;
+
+    reader.add_parameterized_prefix({'\x1b', '['});
+    reader.add_repeatable_command('\x7f', [&] { backspaces.push_back(reader.repeat_count()); });
+    reader.add_repeatable_command({'\x1b', '[', 'D'}, [&] { moves.push_back(reader.repeat_count()); });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    BOOST_REQUIRE_EQUAL(backspaces.size(), 2);
+    BOOST_CHECK_EQUAL(backspaces[0], 3);
+    BOOST_CHECK_EQUAL(backspaces[1], 1);
+    BOOST_REQUIRE_EQUAL(moves.size(), 1);
+    BOOST_CHECK_EQUAL(moves[0], 2);
+}
+
+BOOST_AUTO_TEST_CASE(SplitCodepointIsAssembled) {
+
+    OneByteBuffer buffer{"\xc3\xa9\xf0\x9f\x98\x80"};
+    std::istream input{&buffer};
+    CommandReader reader{input};
+    std::vector<std::string> texts;
+
+    reader.set_self_insert([&] { texts.emplace_back(reader.current_text()); });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    BOOST_REQUIRE_EQUAL(texts.size(), 2);
+    BOOST_CHECK_EQUAL(texts[0], "\xc3\xa9");
+    BOOST_CHECK_EQUAL(texts[1], "\xf0\x9f\x98\x80");
+}
+
+BOOST_AUTO_TEST_CASE(InvalidSequencesAreReplaced) {
+
+    std::stringstream input{"a\xff\xe2(b\xed\xa0\x80\xe2\x82"};
+    CommandReader reader{input};
+    std::string text;
+
+    reader.set_self_insert([&] { text.append(reader.current_text()); });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    // every maximal subpart is replaced by a single U+FFFD
+    BOOST_CHECK_EQUAL(text, "a\ufffd\ufffd(b\ufffd\ufffd\ufffd\ufffd");
+}
+
+BOOST_AUTO_TEST_CASE(MacroIsRecordedAndPlayed) {
+
+    std::stringstream input{"(ab-c)"};
+    CommandReader reader{input};
+    KeyboardMacro macro;
+    std::string text;
+
+    reader.add_command('(', [&] { reader.start_recording(); });
+    reader.add_command(')', [&] { macro = reader.stop_recording(); });
+    reader.add_command('-', [&] { text.pop_back(); });
+    reader.set_self_insert([&] { text.append(reader.current_text()); });
+
+    reader.start_reading();
+    reader.read_and_execute();
+
+    BOOST_CHECK_EQUAL(text, "ac");
+    BOOST_CHECK_EQUAL(macro.steps.size(), 3);
+
+    reader.start_reading();
+    reader.play(macro, 2);
+
+    BOOST_CHECK_EQUAL(text, "acacac");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
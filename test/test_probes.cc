@@ -0,0 +1,30 @@
+#define BOOST_TEST_MODULE CppReadline
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "../src/readline.hh"
+
+// sys/sdt.h is configured for the probes of readline only, CI builds with systemtap-sdt-dev
+#ifdef _SDT_HAS_SEMAPHORES
+#error "_SDT_HAS_SEMAPHORES is defined by readline.hh"
+#endif
+
+using namespace std::literals;
+
+BOOST_AUTO_TEST_SUITE(TestProbes)
+
+BOOST_AUTO_TEST_CASE(ProbesAreDisabledWithoutTracer) {
+
+    Buffer buffer{};
+    buffer.insert("hello"sv);
+    buffer.erase(0, 1);
+
+    BOOST_CHECK_EQUAL(buffer.view(), "ello"sv);
+
+#ifdef READLINE_USDT_SEMAPHORES
+    BOOST_CHECK_EQUAL(readline_buffer_insert_semaphore, 0);
+    BOOST_CHECK_EQUAL(readline_buffer_erase_semaphore, 0);
+#endif
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,653 @@
+#define BOOST_TEST_MODULE CppReadline
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <sstream>
+#include "../src/readline.hh"
+
+using namespace std::literals;
+
+BOOST_AUTO_TEST_SUITE(TestReadline)
+
+BOOST_AUTO_TEST_CASE(LineIsRead) {
+
+    std::stringstream input{"abc\x1b[Dx\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_prompter([] { return "$ "; });
+
+    BOOST_CHECK_EQUAL(readline.read(), "abxc"s);
+}
+
+BOOST_AUTO_TEST_CASE(PastedTextIsDrawnOnce) {
+
+    std::stringstream input{"pasted text" + std::string(5, '\x7f') + "\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output);
+
+    BOOST_CHECK_EQUAL(readline.read(), "pasted"s);
+    BOOST_CHECK(output.str().find("pasted text"s) != std::string::npos);
+    BOOST_CHECK(output.str().find("pasted tex\x1b"s) == std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(KeyboardMacroIsPlayed) {
+
+    std::stringstream input{"\x18(ab\x7f\x1b[D\x18)\x18" "e\x18" "e\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output);
+
+    BOOST_CHECK_EQUAL(readline.read(), "aaa"s);
+}
+
+BOOST_AUTO_TEST_CASE(MacroCalledWhileRecordingIsNotRecorded) {
+
+    std::stringstream input{"\x18(a\x18" "e\x18)\x18" "e\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output);
+
+    BOOST_CHECK_EQUAL(readline.read(), "aa"s);
+}
+
+BOOST_AUTO_TEST_CASE(BatchEditIsDrawnOnce) {
+
+    std::stringstream output;
+    Readline readline{};
+
+    readline.set_output_stream(output);
+    readline.edit({Edit::ReplaceBuffer{"select * from t"},
+                   Edit::SetCursor{7},
+                   Edit::DeleteRange{7, 8},
+                   Edit::InsertText{"id, name"},
+                   Edit::MoveCursor{-4},
+                   Edit::InsertText{" "},
+                   Edit::MoveCursor{100}});
+
+    BOOST_CHECK_EQUAL(readline.line(), "select id,  name from t"sv);
+    BOOST_CHECK_EQUAL(readline.cursor(), readline.line().size());
+
+    const auto frame = output.str();
+    BOOST_CHECK_EQUAL(frame.find("\x1b[K"s), frame.rfind("\x1b[K"s));
+}
+
+BOOST_AUTO_TEST_CASE(BatchEditKeepsCharactersWhole) {
+
+    std::stringstream output;
+    Readline readline{};
+
+    readline.set_output_stream(output);
+
+    // both ends are inside of two byte characters, the first one is deleted and the last one kept
+    readline.edit({Edit::ReplaceBuffer{"a\u00e9b\u00e8c"},
+                   Edit::DeleteRange{2, 5}});
+
+    BOOST_CHECK_EQUAL(readline.line(), "a\u00e8c"sv);
+    BOOST_CHECK(Utf8::valid_prefix(readline.line()) == readline.line().size());
+
+    // reversed and out of range ends
+    readline.edit({Edit::DeleteRange{100, 1}, Edit::DeleteRange{2, 100}});
+    BOOST_CHECK_EQUAL(readline.line(), "a"sv);
+
+    readline.edit({Edit::InsertText{"x\xc3y\xe2\x82"}});
+    BOOST_CHECK_EQUAL(readline.line(), "ax\ufffdy\ufffd"sv);
+}
+
+BOOST_AUTO_TEST_CASE(RegionIsKilledAndYanked) {
+
+    std::stringstream input{"select "s + '\0' + "name\x1bw from \x19\x17t \x19\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output);
+
+    BOOST_CHECK_EQUAL(readline.read(), "select name from t name"s);
+}
+
+BOOST_AUTO_TEST_CASE(KilledRegionIsPutToClipboard) {
+
+    std::stringstream input{"ab"s + '\0' + "cd\x17\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_clipboard(true, 100);
+
+    BOOST_CHECK_EQUAL(readline.read(), "ab"s);
+    BOOST_CHECK(output.str().find("\x1b]52;c;Y2Q=\x1b\\") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(CharacterSearchMovesCursor) {
+
+    std::stringstream input{"hello world\x1b\x1doX\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output);
+
+    BOOST_CHECK_EQUAL(readline.read(), "hello wXorld"s);
+}
+
+BOOST_AUTO_TEST_CASE(IncrementalSearchMovesCursor) {
+
+    std::stringstream input{"abc abd abe\x12" "ab\x12" "d\x1b[CX\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output);
+
+    BOOST_CHECK_EQUAL(readline.read(), "abc aXbd abe"s);
+}
+
+BOOST_AUTO_TEST_CASE(MatchingBracketIsHighlighted) {
+
+    std::stringstream input{"f(x)\x18%y\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_bracket_matching(true);
+
+    BOOST_CHECK_EQUAL(readline.read(), "fy(x)"s);
+    BOOST_CHECK(output.str().find("\x1b[7m(\x1b[0m") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(StatementIsContinued) {
+
+    std::stringstream input{"select (1, -- one\n'a;\nb')\n;\nnext;\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_continuation(StatementLexer{})
+            .set_continuation_prompter([] { return "-> "; });
+
+    BOOST_CHECK_EQUAL(readline.read(), "select (1, -- one\n'a;\nb')\n;"s);
+    BOOST_CHECK(output.str().find("-> ") != std::string::npos);
+    BOOST_CHECK_EQUAL(readline.read(), "next;"s);
+}
+
+BOOST_AUTO_TEST_CASE(ContinuationScansOnlyNewLines) {
+
+    std::string statement = "insert into t values\n";
+
+    for (int i = 0; i < 1000; i++) {
+        statement += "(" + std::to_string(i) + ", 'row'),\n";
+    }
+
+    statement += "(1000, 'row');\n";
+
+    std::stringstream input{statement}, output;
+    Readline readline{};
+    size_t scanned = 0;
+
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_continuation([&scanned, lexer = StatementLexer{}](std::string_view line) mutable {
+                scanned += line.size() + 1;
+                return lexer(line);
+            });
+
+    BOOST_CHECK_EQUAL(readline.read() + "\n", statement);
+    BOOST_CHECK_EQUAL(scanned, statement.size());
+}
+
+/** Set the environment variable for the scope, the previous value is restored */
+struct ScopedEnvironment {
+    std::string name;
+    std::optional<std::string> previous;
+
+    ScopedEnvironment(std::string n, const char *value): name{std::move(n)} {
+        if (const char *p = std::getenv(name.c_str())) {
+            previous = p;
+        }
+
+        setenv(name.c_str(), value, 1);
+    }
+
+    ~ScopedEnvironment() {
+        if (previous) {
+            setenv(name.c_str(), previous->c_str(), 1);
+        } else {
+            unsetenv(name.c_str());
+        }
+    }
+};
+
+BOOST_AUTO_TEST_CASE(LineIsEditedInEditor) {
+
+    std::stringstream input{"hello world\x18\x05!\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output);
+
+    {
+        // sed replaces the file, so it has to be opened again by its path
+        ScopedEnvironment visual{"VISUAL", "sed -i s/world/editor/"};
+
+        BOOST_CHECK_EQUAL(readline.read(), "hello editor!"s);
+        BOOST_CHECK(output.str().find('\a') == std::string::npos);
+    }
+
+    ScopedEnvironment visual{"VISUAL", "false"};
+    input.clear();
+    input.str("unchanged\x18\x05\n");
+    output.str({});
+
+    BOOST_CHECK_EQUAL(readline.read(), "unchanged"s);
+    BOOST_CHECK(output.str().find('\a') != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(ZeroWidthRunsAreBoundedByWidth) {
+
+    const std::string controls(10000, '\x01');
+
+    BOOST_CHECK_LE(Utf8::prefix_by_width(controls, 10), 11 * Utf8::max_bytes_per_column);
+    BOOST_CHECK_LE(Utf8::suffix_by_width(controls, 10), 11 * Utf8::max_bytes_per_column);
+    BOOST_CHECK_EQUAL(Utf8::width(controls), 0);
+    BOOST_CHECK_EQUAL(Utf8::width("e\u0301"sv), 1);
+}
+
+BOOST_AUTO_TEST_CASE(LongClustersKeepTheirWidth) {
+
+    // a tag sequence flag and a letter with stacked combining marks, both are single clusters
+    const std::string flag{"\U0001f3f4\U000e0067\U000e0062\U000e0073\U000e0063\U000e0074\U000e007f"};
+    const std::string stacked{"a\u0301\u0302\u0303\u0304\u0305\u0306\u0307\u0308\u0309\u030a\u030b\u030c"};
+    const auto text = flag + stacked + "b";
+
+    BOOST_CHECK_EQUAL(Utf8::width(flag), 2);
+    BOOST_CHECK_EQUAL(Utf8::width(stacked), 1);
+    BOOST_CHECK_EQUAL(Utf8::width(text), 4);
+    BOOST_CHECK_EQUAL(Utf8::prefix_by_width(text, 3), flag.size() + stacked.size());
+    BOOST_CHECK_EQUAL(Utf8::prefix_by_width(text, 4), text.size());
+    BOOST_CHECK_EQUAL(Utf8::suffix_by_width(text, 2), stacked.size() + 1);
+    BOOST_CHECK_EQUAL(Utf8::suffix_by_width(text, 4), text.size());
+}
+
+BOOST_AUTO_TEST_CASE(SlowKeysDegradeRendering) {
+
+    std::stringstream input{"(abc)\x1b[D\x1b[D\x1b[DX\x7f\x7fY\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_bracket_matching(true)
+            .set_latency_budget(std::chrono::nanoseconds{1});
+
+    BOOST_CHECK_EQUAL(readline.read(), "(Ybc)"s);
+    BOOST_CHECK(readline.render_quality() == RenderQuality::Minimal);
+
+    // the highlight drawn for the first key is removed by the next one
+    const auto highlight = output.str().rfind("\x1b[7m(");
+    BOOST_CHECK(output.str().find("\x1b[1G(", highlight) != std::string::npos);
+
+    // only the text after the cursor is redrawn
+    BOOST_CHECK(output.str().find("\x1b[2Dbc)\x1b[K\x1b[3DYbc)\x1b[K\x1b[3D") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(DeletedZeroWidthCharacterDoesntMoveCursor) {
+
+    std::stringstream output;
+    Readline readline{};
+
+    readline.set_output_stream(output)
+            .set_latency_budget(std::chrono::nanoseconds{1});
+
+    readline.start_line();
+
+    for (auto key: {"a", "b", "c", "\u200b"}) {
+        readline.feed(key, [](std::string_view) {});
+    }
+
+    BOOST_REQUIRE(readline.render_quality() == RenderQuality::Minimal);
+
+    output.str({});
+    readline.feed("\x7f", [](std::string_view) {});
+    BOOST_CHECK_EQUAL(readline.line(), "abc"sv);
+    BOOST_CHECK(output.str().find("\x1b[0") == std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(HorizontalScrollWritesOnlyVisibleWindow) {
+
+    const auto line = "0123456789abcdefghijklmnopqrstuvwxyz"s;
+    std::stringstream input{line + "\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_prompter([] { return "$ "; })
+            .set_columns(12)
+            .set_horizontal_scroll(true);
+
+    BOOST_CHECK_EQUAL(readline.read(), line);
+
+    // 12 columns - 2 for the prompt - 1 for the cursor
+    BOOST_CHECK(output.str().find("rstuvwxyz"s) != std::string::npos);
+    BOOST_CHECK(output.str().find("qrstuvwxyz"s) == std::string::npos);
+    BOOST_CHECK(output.str().find("0123456789"s) == std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(ZeroWidthCharacterDoesntMoveCursor) {
+
+    std::stringstream output;
+    Readline readline{};
+
+    readline.set_output_stream(output);
+    readline.start_line();
+    readline.feed("a\u200b", [](std::string_view) {});
+
+    // terminals move by one cell for the count 0
+    output.str({});
+    readline.feed("\x1b[D", [](std::string_view) {});
+    BOOST_CHECK_EQUAL(readline.cursor(), 1u);
+    BOOST_CHECK(output.str().find("\x1b[0") == std::string::npos);
+
+    output.str({});
+    readline.feed("\x1b[C", [](std::string_view) {});
+    BOOST_CHECK_EQUAL(readline.cursor(), 4u);
+    BOOST_CHECK(output.str().find("\x1b[0") == std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(SpilledLineIsScrolled) {
+
+    const std::string paste(1 << 16, 'x');
+    std::stringstream output;
+    Readline readline{};
+
+    readline.set_output_stream(output)
+            .set_columns(80)
+            .set_buffer_memory_limit(1 << 12);
+
+    readline.start_line();
+    readline.feed(paste, [](std::string_view) {});
+    output.str({});
+
+    // the line doesn't fit the memory, a key redraws only the visible window
+    readline.feed("y\x1b[D", [](std::string_view) {});
+    BOOST_CHECK_EQUAL(readline.line().size(), paste.size() + 1);
+    BOOST_CHECK_LT(output.str().size(), 200u);
+    BOOST_CHECK(output.str().find(std::string(78, 'x') + "y") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(HorizontalScrollFollowsCursorToTheLeft) {
+
+    const auto line = "0123456789abcdef"s;
+    std::stringstream output;
+    Readline readline{};
+
+    readline.set_output_stream(output)
+            .set_columns(8)
+            .set_horizontal_scroll(true);
+
+    readline.start_line();
+    readline.feed(line, [](std::string_view) {});
+
+    // 8 columns - 1 for the cursor
+    BOOST_CHECK(output.str().find("\x1b[1G9abcdef\x1b[K") != std::string::npos);
+
+    // the window stays until the cursor leaves it, then it starts at the cursor
+    for (size_t cursor = line.size() - 1, offset = 9; cursor != std::string::npos; cursor--) {
+        output.str({});
+        readline.feed("\x1b[D", [](std::string_view) {});
+        BOOST_REQUIRE_EQUAL(readline.cursor(), cursor);
+
+        if (cursor >= offset) {
+            BOOST_CHECK_EQUAL(output.str(), "\x1b[1D");
+            continue;
+        }
+
+        offset = cursor;
+        BOOST_CHECK_EQUAL(output.str(), "\x1b[1G" + line.substr(offset, 7) + "\x1b[K\x1b[1G");
+    }
+
+    std::string accepted{"none"};
+    std::string to_end_and_delete;
+
+    for (size_t i = 0; i < line.size(); i++) {
+        to_end_and_delete += "\x1b[C";
+    }
+
+    to_end_and_delete += std::string(line.size(), '\x7f') + "\n";
+    readline.feed(to_end_and_delete, [&](std::string_view l) { accepted = l; });
+
+    BOOST_CHECK_EQUAL(accepted, ""s);
+}
+
+BOOST_AUTO_TEST_CASE(PromptLayoutSkipsEscapes) {
+
+    auto layout = PromptLayout::parse("\x1b[1;32muser\x1b[0m \x1b]0;title\x07\001\x1b[1m\002\u03bb> ");
+
+    BOOST_CHECK_EQUAL(layout.width, 8);
+    BOOST_CHECK_EQUAL(layout.rows, 1);
+    BOOST_CHECK_EQUAL(layout.text.find('\001'), std::string::npos);
+    BOOST_CHECK_EQUAL(layout.segments.size(), 7);
+    BOOST_CHECK_EQUAL(layout.segments[0].escape, true);
+    BOOST_CHECK_EQUAL(layout.segments[1].escape, false);
+}
+
+BOOST_AUTO_TEST_CASE(PromptLayoutCountsRows) {
+
+    auto layout = PromptLayout::parse("[~/src]\n\xe6\x97\xa5> ");
+
+    BOOST_CHECK_EQUAL(layout.rows, 2);
+    BOOST_CHECK_EQUAL(layout.width, 4);
+}
+
+BOOST_AUTO_TEST_CASE(CursorIsPlacedAfterColoredPrompt) {
+
+    std::stringstream input{"a\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input)
+            .set_output_stream(output)
+            .set_prompter([] { return "\x1b[1;32m$ \x1b[0m"; });
+
+    BOOST_CHECK_EQUAL(readline.read(), "a"s);
+    BOOST_CHECK(output.str().find("\x1b[4G"s) != std::string::npos);
+    BOOST_CHECK(output.str().find("\x1b[15G"s) == std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(EventsAreRecordedAsChromeTrace) {
+
+    std::stringstream input{"ab\x7f\n"}, output, trace;
+    TraceRecorder recorder{};
+    Readline readline{};
+
+    readline.set_input_stream(input).set_output_stream(output);
+
+    TraceRecorder::install(&recorder);
+    BOOST_CHECK_EQUAL(readline.read(), "a"s);
+    TraceRecorder::install(nullptr);
+
+    recorder.dump(trace);
+
+    BOOST_CHECK_EQUAL(trace.str().rfind("{\"traceEvents\":[", 0), 0);
+    BOOST_CHECK(trace.str().find("{\"name\":\"command\",\"ph\":\"X\"") != std::string::npos);
+    BOOST_CHECK(trace.str().find("{\"name\":\"buffer_insert\",\"ph\":\"i\"") != std::string::npos);
+    BOOST_CHECK(trace.str().find("\"buffer_erase\"") != std::string::npos);
+    BOOST_CHECK_EQUAL(trace.str().substr(trace.str().size() - 3), "]}\n"s);
+}
+
+BOOST_AUTO_TEST_CASE(TraceKeepsRecentEvents) {
+
+    std::stringstream trace;
+    TraceRecorder recorder{2};
+
+    TraceRecorder::install(&recorder);
+    TraceRecorder::instant("first", 1);
+    TraceRecorder::instant("second", 2);
+    TraceRecorder::instant("third", 3);
+    TraceRecorder::install(nullptr);
+    TraceRecorder::instant("ignored", 4);
+
+    recorder.dump(trace);
+
+    BOOST_CHECK_EQUAL(recorder.size(), 2);
+    BOOST_CHECK(trace.str().find("first") == std::string::npos);
+    BOOST_CHECK(trace.str().find("ignored") == std::string::npos);
+    BOOST_CHECK(trace.str().find("second") < trace.str().find("third"));
+}
+
+BOOST_AUTO_TEST_CASE(MemoryUsageIsReportedPerPart) {
+
+    std::stringstream input{std::string(100000, 'a') + "\n"}, output;
+    Readline readline{};
+
+    readline.set_input_stream(input).set_output_stream(output);
+
+    const auto before = readline.memory_usage();
+
+    BOOST_CHECK_LT(before.history, 1000);
+    BOOST_CHECK_GT(before.key_bindings, 0);
+
+    BOOST_CHECK_EQUAL(readline.read().size(), 100000);
+
+    const auto after = readline.memory_usage();
+
+    BOOST_CHECK_GT(after.history, 100000);
+    BOOST_CHECK_LT(after.output, 1000);
+    BOOST_CHECK_EQUAL(after.total(), after.buffer + after.history + after.key_bindings
+                                   + after.input + after.output + after.editing);
+}
+
+BOOST_AUTO_TEST_CASE(InputIsFedInChunks) {
+
+    std::stringstream output;
+    std::vector<std::string> lines;
+    Readline readline{};
+
+    readline.set_output_stream(output);
+
+    auto on_line = [&](std::string_view line) { lines.emplace_back(line); };
+
+    readline.start_line();
+    readline.feed("ab\x1b[", on_line);
+    readline.feed("Dc\nx\ny", on_line);
+
+    BOOST_REQUIRE_EQUAL(lines.size(), 2);
+    BOOST_CHECK_EQUAL(lines[0], "acb"s);
+    BOOST_CHECK_EQUAL(lines[1], "x"s);
+    BOOST_CHECK_EQUAL(readline.line(), "y"s);
+}
+
+BOOST_AUTO_TEST_CASE(SessionIsHibernatedAndRestored) {
+
+    std::stringstream output;
+    std::vector<std::string> lines;
+    Readline readline{};
+
+    readline.set_output_stream(output);
+
+    auto on_line = [&](std::string_view line) { lines.emplace_back(line); };
+
+    readline.feed("hello\nwor\x1b", on_line);
+
+    const auto awake = readline.memory_usage().total();
+
+    BOOST_REQUIRE(readline.hibernate());
+    BOOST_CHECK(readline.hibernated());
+    BOOST_CHECK_LT(readline.memory_usage().total(), 300);
+    BOOST_CHECK_LT(readline.memory_usage().total(), awake / 10);
+
+    // the sequence split by the hibernation is continued
+    readline.feed("[D\x7f\n\x1b[A\n", on_line);
+
+    BOOST_CHECK(!readline.hibernated());
+    BOOST_REQUIRE_EQUAL(lines.size(), 3);
+    BOOST_CHECK_EQUAL(lines[0], "hello"s);
+    BOOST_CHECK_EQUAL(lines[1], "wr"s);
+    BOOST_CHECK_EQUAL(lines[2], "wr"s);
+}
+
+BOOST_AUTO_TEST_CASE(HistoryIsKeptInFile) {
+
+    const auto path = std::filesystem::temp_directory_path() / "test_readline_history";
+    std::filesystem::remove(path);
+
+    std::stringstream output;
+    std::vector<std::string> lines;
+    std::vector<bool> accepted;
+    Readline first{}, second{};
+    Readline *readline = &first;
+
+    auto on_line = [&](std::string_view line) {
+        lines.emplace_back(line);
+        accepted.push_back(readline->line_accepted());
+    };
+
+    first.set_output_stream(output).set_history_file(path);
+    first.feed("first\nsecond\\n\n", on_line);
+
+    // the history is loaded by a new session
+    readline = &second;
+    second.set_output_stream(output).set_history_file(path);
+    second.feed("\x1b[A\n\x1b[A\x1b[A\x1b[A\n\x04", on_line);
+
+    BOOST_REQUIRE_EQUAL(lines.size(), 5);
+    BOOST_CHECK_EQUAL(lines[2], "second\\n"s);
+    BOOST_CHECK_EQUAL(lines[3], "first"s);
+    BOOST_CHECK_EQUAL(lines[4], ""s);
+    BOOST_CHECK(accepted[3]);
+    BOOST_CHECK(!accepted[4]);
+
+    std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(SessionIsHandedOff) {
+
+    int sockets[2], pipe_fds[2];
+    BOOST_REQUIRE_EQUAL(socketpair(AF_UNIX, SOCK_STREAM, 0, sockets), 0);
+    BOOST_REQUIRE_EQUAL(pipe(pipe_fds), 0);
+
+    std::stringstream old_output, new_output;
+    std::vector<std::string> lines;
+
+    auto on_line = [&](std::string_view line) { lines.emplace_back(line); };
+
+    {
+        Readline readline{};
+        readline.set_output_stream(old_output).set_prompter([] { return "> "; });
+        readline.feed("first\nhello wor\x1b[", on_line);
+
+        SessionHandoff::send(sockets[0], pipe_fds[1], readline.save_state());
+        close(sockets[0]);
+    }
+
+    auto session = SessionHandoff::receive(sockets[1]);
+
+    BOOST_REQUIRE(session);
+    BOOST_CHECK(!SessionHandoff::receive(sockets[1]));
+    BOOST_CHECK_NE(session->fd, pipe_fds[1]);
+    BOOST_CHECK_EQUAL(write(session->fd, "x", 1), 1);
+
+    char ch = 0;
+    BOOST_CHECK_EQUAL(read(pipe_fds[0], &ch, 1), 1);
+    BOOST_CHECK_EQUAL(ch, 'x');
+
+    Readline readline{};
+    readline.set_output_stream(new_output).set_prompter([] { return "> "; });
+    readline.restore_state(session->state);
+
+    BOOST_CHECK(new_output.str().find("> ") != std::string::npos);
+    BOOST_CHECK(new_output.str().find("hello wor") != std::string::npos);
+
+    // the sequence started before the handoff moves the cursor
+    readline.feed("Dl\nd\x1b[A\x1b[A\n", on_line);
+
+    BOOST_REQUIRE_EQUAL(lines.size(), 3);
+    BOOST_CHECK_EQUAL(lines[1], "hello wolr"s);
+    BOOST_CHECK_EQUAL(lines[2], "first"s);
+
+    for (int fd: {sockets[1], pipe_fds[0], pipe_fds[1], session->fd}) {
+        close(fd);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,124 @@
+#define BOOST_TEST_MODULE CppReadline
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <pty.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+
+using namespace std::literals;
+
+BOOST_AUTO_TEST_SUITE(TestReadlineWrap)
+
+/** Read the output of the pty until the text arrives, at most for a few seconds */
+static std::string read_until(int master, std::string &output, std::string_view text) {
+    char chunk[4096];
+
+    for (int i = 0; i < 500 && output.find(text) == std::string::npos; i++) {
+        pollfd ready{master, POLLIN, 0};
+
+        if (poll(&ready, 1, 10) == 1) {
+            const auto n = read(master, chunk, sizeof(chunk));
+
+            if (n <= 0) {
+                break;
+            }
+
+            output.append(chunk, n);
+        }
+    }
+
+    return output;
+}
+
+BOOST_AUTO_TEST_CASE(LinesAreEditedAndKeptInHistory) {
+
+    const auto history = std::filesystem::temp_directory_path() /
+                         ("readline-wrap-test-" + std::to_string(getpid()));
+    std::filesystem::remove(history);
+
+    winsize size{};
+    size.ws_col = 80;
+    size.ws_row = 24;
+
+    int master = -1;
+    const pid_t child = forkpty(&master, nullptr, nullptr, &size);
+
+    // the child only executes the wrapper, checks would be logged to the pty
+    if (child == 0) {
+        execl(READLINE_WRAP, READLINE_WRAP, "-H", history.c_str(), "cat", nullptr);
+        _exit(127);
+    }
+
+    BOOST_REQUIRE(child != -1);
+
+    std::string output;
+
+    // the empty line is drawn once the wrapper switched the terminal to the noncanonical mode
+    read_until(master, output, "\x1b[");
+    output.clear();
+
+    // the typo is corrected by the editor, cat gets only the accepted line
+    BOOST_REQUIRE_EQUAL(write(master, "hellp\x7fo\r", 8), 8);
+    read_until(master, output, "hello\r\n");
+
+    const auto echoed = output.find("hello\r\n");
+    BOOST_REQUIRE(echoed != std::string::npos);
+    BOOST_CHECK(output.find("hello") < echoed);
+    BOOST_CHECK(output.find("hellp") < output.find("hello"));
+
+    // the end of the input closes cat and the wrapper with it
+    BOOST_REQUIRE_EQUAL(write(master, "\x04", 1), 1);
+    read_until(master, output, "\x01 never printed");
+
+    int status = 0;
+    BOOST_REQUIRE_EQUAL(waitpid(child, &status, 0), child);
+    BOOST_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    std::ifstream file{history};
+    std::string line;
+
+    BOOST_CHECK(std::getline(file, line));
+    BOOST_CHECK_EQUAL(line, "hello");
+
+    close(master);
+    std::filesystem::remove(history);
+}
+
+BOOST_AUTO_TEST_CASE(WrappedLineIsHiddenBeforeOutput) {
+
+    const auto history = std::filesystem::temp_directory_path() /
+                         ("readline-wrap-test-" + std::to_string(getpid()));
+
+    winsize size{};
+    size.ws_col = 10;
+    size.ws_row = 24;
+
+    int master = -1;
+    const pid_t child = forkpty(&master, nullptr, nullptr, &size);
+    if (child == 0) {
+        execl(READLINE_WRAP, READLINE_WRAP, "-H", history.c_str(), "sh", "-c", "sleep 0.5; echo done", nullptr);
+        _exit(127);
+    }
+
+    BOOST_REQUIRE(child != -1);
+
+    std::string output;
+    read_until(master, output, "\x1b[");
+
+    // the line takes three rows when the output arrives, all of them are erased
+    BOOST_REQUIRE_EQUAL(write(master, "abcdefghijklmnopqrstuvwxy", 25), 25);
+    read_until(master, output, "done");
+
+    BOOST_CHECK(output.find("\x1b[2A\r\x1b[Jdone") != std::string::npos);
+
+    BOOST_CHECK_EQUAL(write(master, "\x04", 1), 1);
+    waitpid(child, nullptr, 0);
+    close(master);
+    std::filesystem::remove(history);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
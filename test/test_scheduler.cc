@@ -0,0 +1,89 @@
+#define BOOST_TEST_MODULE CppReadline
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "../src/scheduler.hh"
+
+using namespace std::literals;
+
+BOOST_AUTO_TEST_SUITE(TestScheduler)
+
+BOOST_AUTO_TEST_CASE(InputOfSessionsIsSerialized) {
+
+    SessionScheduler scheduler{4};
+
+    constexpr size_t n = 64;
+    std::vector<std::ostringstream> outputs(n);
+    std::vector<std::vector<std::string>> lines(n);
+    std::vector<SessionScheduler::Session *> sessions;
+
+    for (size_t i = 0; i < n; i++) {
+        sessions.push_back(&scheduler.add([&, i](Readline &readline) { readline.set_output_stream(outputs[i]); }));
+    }
+
+    // every chunk is a separate work item, a sequence is split between them
+    for (const auto chunk: {"ab"sv, "\x1b["sv, "Dc\nx"sv, "y\n"sv}) {
+        for (size_t i = 0; i < n; i++) {
+            scheduler.feed(*sessions[i], std::string{chunk} + (chunk == "y\n" ? std::to_string(i) + "\n" : ""),
+                           [&lines, i](std::string_view line) { lines[i].emplace_back(line); });
+        }
+    }
+
+    scheduler.wait();
+
+    for (size_t i = 0; i < n; i++) {
+        BOOST_REQUIRE_EQUAL(lines[i].size(), 3);
+        BOOST_CHECK_EQUAL(lines[i][0], "acb"s);
+        BOOST_CHECK_EQUAL(lines[i][1], "xy"s);
+        BOOST_CHECK_EQUAL(lines[i][2], std::to_string(i));
+    }
+}
+
+BOOST_AUTO_TEST_CASE(SessionsKeepTheirHome) {
+
+    SessionScheduler scheduler{3};
+    std::ostringstream output;
+
+    auto &first = scheduler.add();
+    auto &second = scheduler.add();
+    auto &third = scheduler.add();
+    auto &fourth = scheduler.add();
+
+    BOOST_CHECK_EQUAL(first.home(), 0);
+    BOOST_CHECK_EQUAL(second.home(), 1);
+    BOOST_CHECK_EQUAL(third.home(), 2);
+    BOOST_CHECK_EQUAL(fourth.home(), 0);
+
+    // the work of a session never runs concurrently, even when it's stolen
+    std::atomic<int> running{0};
+    std::atomic<bool> overlapped{false};
+
+    for (int i = 0; i < 1000; i++) {
+        scheduler.post(first, [&](Readline &) {
+            overlapped = overlapped || running++ != 0;
+            running--;
+        });
+    }
+
+    scheduler.remove(fourth);
+    scheduler.wait();
+
+    BOOST_CHECK(!overlapped);
+    BOOST_CHECK_EQUAL(scheduler.size(), 3);
+}
+
+BOOST_AUTO_TEST_CASE(ExceptionsAreRethrownByWait) {
+
+    SessionScheduler scheduler{2};
+    auto &session = scheduler.add();
+    int after = 0;
+
+    scheduler.post(session, [](Readline &) { throw std::runtime_error{"failed"}; });
+    scheduler.post(session, [&](Readline &) { after++; });
+
+    BOOST_CHECK_THROW(scheduler.wait(), std::runtime_error);
+    BOOST_CHECK_EQUAL(after, 1);
+    BOOST_CHECK_NO_THROW(scheduler.wait());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,227 @@
+#define BOOST_TEST_MODULE CppReadline
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include "../src/telnet.hh"
+
+using namespace std::literals;
+
+BOOST_AUTO_TEST_SUITE(TestTelnet)
+
+BOOST_AUTO_TEST_CASE(CommandsAreStrippedFromInput) {
+
+    TelnetFilter telnet{};
+    size_t columns = 0, rows = 0;
+
+    telnet.set_window_size_handler([&](size_t c, size_t r) { columns = c; rows = r; });
+    telnet.start();
+
+    std::string first{"ab\xff\xff\r\n\r\0c\xff\xfa\x1f\x00"s};
+    std::string second{"\x78\x00\x1e\xff\xf0\r\xff\xf4x"s};
+
+    telnet(first);
+    telnet(second);
+
+    BOOST_CHECK_EQUAL(first, "ab\xff\n\nc"s);
+    BOOST_CHECK_EQUAL(second, "\n\x03x"s);
+    BOOST_CHECK_EQUAL(columns, 120);
+    BOOST_CHECK_EQUAL(rows, 30);
+    BOOST_CHECK(telnet.take_replies().empty());
+}
+
+BOOST_AUTO_TEST_CASE(OptionsAreNegotiated) {
+
+    TelnetFilter telnet{};
+
+    BOOST_CHECK_EQUAL(telnet.start(), "\xff\xfb\x01\xff\xfb\x03\xff\xfd\x03\xff\xfd\x1f\xff\xfe\x22"s);
+
+    // acknowledgements aren't answered, refused and unknown options are
+    std::string input{"\xff\xfd\x01\xff\xfb\x1f\xff\xfd\x63\xff\xfb\x22\xff\xfc\x1f"s};
+    telnet(input);
+
+    BOOST_CHECK(input.empty());
+    BOOST_CHECK_EQUAL(telnet.take_replies(), "\xff\xfc\x63\xff\xfe\x22\xff\xfe\x1f"s);
+    BOOST_CHECK(telnet.local_enabled(Telnet::Echo));
+    BOOST_CHECK(!telnet.remote_enabled(Telnet::WindowSize));
+}
+
+BOOST_AUTO_TEST_CASE(OutputIsEscaped) {
+
+    std::string output{"a\n\xff"};
+    TelnetFilter::encode(output);
+
+    BOOST_CHECK_EQUAL(output, "a\r\n\xff\xff"s);
+}
+
+/** Connect to the server on the loopback, a receive buffer of zero keeps the default */
+static int connect_to(const TelnetServer &server, int receive_buffer = 0) {
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(server.port());
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (receive_buffer) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receive_buffer, sizeof(receive_buffer));
+    }
+    BOOST_REQUIRE_EQUAL(connect(fd, reinterpret_cast<const sockaddr *>(&address), sizeof(address)), 0);
+
+    return fd;
+}
+
+/** Run the server until the client received the text */
+static std::string receive_until(TelnetServer &server, int fd, std::string_view text) {
+    std::string received;
+    char chunk[4096];
+
+    for (int i = 0; i < 100 && received.find(text) == std::string::npos; i++) {
+        server.poll(10);
+
+        for (ssize_t n; (n = recv(fd, chunk, sizeof(chunk), MSG_DONTWAIT)) > 0;) {
+            received.append(chunk, n);
+        }
+    }
+
+    return received;
+}
+
+/** Two clients edit lines, one of them disconnects by the handler */
+static void edit_lines(TelnetServer &server) {
+
+    server.set_session_setup([](Readline &readline) { readline.set_prompter([] { return "> "; }); })
+          .set_line_handler([](TelnetServer::Connection &, std::string_view line) -> std::optional<std::string> {
+                if (line == "exit") {
+                    return std::nullopt;
+                }
+
+                return "got: " + std::string{line} + "\n";
+            });
+
+    const int first = connect_to(server);
+    const int second = connect_to(server);
+
+    BOOST_CHECK(receive_until(server, first, "> ").find("\xff\xfb\x01") != std::string::npos);
+    receive_until(server, second, "> ");
+    BOOST_CHECK_EQUAL(server.size(), 2);
+
+    // the window size and the line are split between writes
+    const auto input = "\xff\xfb\x1f\xff\xfa\x1f\x00\x50\x00\x18\xff\xf0hellp\x7fo wo"s;
+    BOOST_REQUIRE_EQUAL(send(first, input.data(), input.size(), 0), input.size());
+    receive_until(server, first, "wo");
+
+    BOOST_REQUIRE_EQUAL(send(first, "\x1b[Crld\r\n", 8, 0), 8);
+    BOOST_REQUIRE_EQUAL(send(second, "second\r\0", 8, 0), 8);
+
+    const auto received = receive_until(server, first, "> ");
+
+    BOOST_CHECK(received.find("got: hello world\r\n") != std::string::npos);
+    BOOST_CHECK(received.find("> ") > received.find("got: "));
+    BOOST_CHECK(receive_until(server, second, "got: second").find("got: second\r\n") != std::string::npos);
+
+    BOOST_REQUIRE_EQUAL(send(second, "exit\r\n", 6, 0), 6);
+    close(first);
+
+    for (int i = 0; i < 100 && server.size(); i++) {
+        server.poll(10);
+    }
+
+    BOOST_CHECK_EQUAL(server.size(), 0);
+    close(second);
+}
+
+BOOST_AUTO_TEST_CASE(LinesAreEditedOverLoopback) {
+
+    TelnetServer server{};
+    edit_lines(server);
+}
+
+BOOST_AUTO_TEST_CASE(LinesAreEditedWithIoUring) {
+
+    TelnetServer server{0, "127.0.0.1", TelnetServer::Backend::IoUring};
+    BOOST_TEST_MESSAGE("io_uring available: " << (server.backend() == TelnetServer::Backend::IoUring));
+
+    edit_lines(server);
+}
+
+BOOST_AUTO_TEST_CASE(ClientWhichDoesntReadDoesntStallOthers) {
+
+    TelnetServer server{};
+    const size_t big = 256 * 1024;
+
+    // the big answer is more than the socket buffers hold
+    server.set_line_handler([big](TelnetServer::Connection &connection, std::string_view line) -> std::optional<std::string> {
+        if (line != "big") {
+            return "got: " + std::string{line} + "\n";
+        }
+
+        const int size = 4096;
+        setsockopt(connection.fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+        return std::string(big, 'x');
+    });
+
+    // the small window of the client fills the socket of the server quickly
+    const int stalled = connect_to(server, 4096);
+    const int active = connect_to(server);
+
+    receive_until(server, stalled, "\xff\xfe\x22");
+    receive_until(server, active, "\xff\xfe\x22");
+
+    BOOST_REQUIRE_EQUAL(send(stalled, "big\r\n", 5, 0), 5);
+
+    const auto begin = std::chrono::steady_clock::now();
+
+    for (int i = 0; i < 3; i++) {
+        const auto line = "line " + std::to_string(i);
+        const auto input = line + "\r\n";
+
+        BOOST_REQUIRE_EQUAL(send(active, input.data(), input.size(), 0), input.size());
+        BOOST_CHECK(receive_until(server, active, "got: " + line).find("got: " + line) != std::string::npos);
+    }
+
+    BOOST_CHECK(std::chrono::steady_clock::now() - begin < std::chrono::milliseconds{900});
+    BOOST_CHECK_EQUAL(server.size(), 2);
+
+    // the queued output is written once the client reads again
+    size_t received = 0;
+    char chunk[65536];
+
+    for (int i = 0; i < 1000 && received < big; i++) {
+        server.poll(10);
+
+        for (ssize_t n; (n = recv(stalled, chunk, sizeof(chunk), MSG_DONTWAIT)) > 0;) {
+            received += std::count(chunk, chunk + n, 'x');
+        }
+    }
+
+    BOOST_CHECK_EQUAL(received, big);
+
+    close(stalled);
+    close(active);
+}
+
+BOOST_AUTO_TEST_CASE(IdleSessionsAreHibernated) {
+
+    TelnetServer server{};
+    server.set_idle_timeout(std::chrono::milliseconds{1});
+
+    const int fd = connect_to(server);
+    receive_until(server, fd, "\xff\xfe\x22");
+
+    BOOST_REQUIRE_EQUAL(send(fd, "abc", 3, 0), 3);
+    receive_until(server, fd, "abc");
+
+    for (int i = 0; i < 100 && !server.hibernated(); i++) {
+        server.poll(10);
+    }
+
+    BOOST_CHECK_EQUAL(server.hibernated(), 1);
+
+    BOOST_REQUIRE_EQUAL(send(fd, "d", 1, 0), 1);
+    BOOST_CHECK(receive_until(server, fd, "d").find('d') != std::string::npos);
+
+    close(fd);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
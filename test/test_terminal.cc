@@ -0,0 +1,201 @@
+#define BOOST_TEST_MODULE CppReadline
+#define BOOST_TEST_DYN_LINK
+
+#include <boost/test/unit_test.hpp>
+#include <sstream>
+#include "../src/readline.hh"
+
+using namespace std::literals;
+
+BOOST_AUTO_TEST_SUITE(TestTerminal)
+
+BOOST_AUTO_TEST_CASE(RepliesAreParsed) {
+
+    std::stringstream input{"\x1b[?2026;2$y"
+                            "\x1b[?2004;0$y"
+                            "\x1b[?0u"
+                            "\x1b[1;3R"
+                            "\x1b[?62;22c"
+                            "not read"};
+
+    TerminalCapabilitiesReader reader{input};
+    auto capabilities = reader.read();
+
+    BOOST_CHECK_EQUAL(capabilities.synchronized_output, true);
+    BOOST_CHECK_EQUAL(capabilities.bracketed_paste, false);
+    BOOST_CHECK_EQUAL(capabilities.kitty_keyboard, true);
+    BOOST_CHECK_EQUAL(capabilities.ambiguous_wide, true);
+
+    BOOST_CHECK_EQUAL(reader.unprocessed(), "not read"sv);
+}
+
+BOOST_AUTO_TEST_CASE(MissingRepliesMeanUnsupported) {
+
+    std::stringstream input{"\x1b[1;2R\x1b[?1;2c"};
+
+    auto capabilities = TerminalCapabilitiesReader{input}.read();
+
+    BOOST_CHECK_EQUAL(capabilities.synchronized_output, false);
+    BOOST_CHECK_EQUAL(capabilities.kitty_keyboard, false);
+    BOOST_CHECK_EQUAL(capabilities.ambiguous_wide, false);
+}
+
+BOOST_AUTO_TEST_CASE(RepliesAreReadFromDescriptor) {
+
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+
+    // the reply is split in the middle of a sequence
+    const std::string replies{"\x1b[?2004;1$y\x1b[?62;22c typed"};
+    BOOST_REQUIRE_EQUAL(write(fds[1], replies.data(), 8), 8);
+    BOOST_REQUIRE_EQUAL(write(fds[1], replies.data() + 8, replies.size() - 8), replies.size() - 8);
+
+    std::istringstream unused;
+    TerminalCapabilitiesReader reader{unused};
+    auto capabilities = reader.read(fds[0]);
+
+    BOOST_REQUIRE(capabilities);
+    BOOST_CHECK_EQUAL(capabilities->bracketed_paste, true);
+    BOOST_CHECK_EQUAL(reader.unprocessed(), " typed"sv);
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(SilentTerminalTimesOut) {
+
+    int fds[2];
+    BOOST_REQUIRE_EQUAL(pipe(fds), 0);
+
+    // only the first reply arrives, the device attributes never do
+    const std::string replies{"\x1b[?2004;1$y"};
+    BOOST_REQUIRE_EQUAL(write(fds[1], replies.data(), replies.size()), replies.size());
+
+    std::istringstream unused;
+    TerminalCapabilitiesReader reader{unused};
+    const auto begin = std::chrono::steady_clock::now();
+
+    BOOST_CHECK(!reader.read(fds[0], std::chrono::milliseconds{50}));
+    BOOST_CHECK(std::chrono::steady_clock::now() - begin < std::chrono::seconds{5});
+
+    close(fds[0]);
+    close(fds[1]);
+}
+
+BOOST_AUTO_TEST_CASE(CapabilitiesAreCached) {
+
+    auto directory = std::filesystem::temp_directory_path() /
+                     ("readline-test-" + std::to_string(getpid()));
+    TerminalCapabilitiesCache cache{directory};
+
+    BOOST_CHECK(!cache.load("xterm-256color"));
+
+    TerminalCapabilities capabilities{};
+    capabilities.bracketed_paste = true;
+    capabilities.kitty_keyboard = true;
+    cache.store("xterm-256color", capabilities);
+
+    auto cached = cache.load("xterm-256color");
+
+    BOOST_REQUIRE(cached);
+    BOOST_CHECK_EQUAL(cached->bracketed_paste, true);
+    BOOST_CHECK_EQUAL(cached->kitty_keyboard, true);
+    BOOST_CHECK_EQUAL(cached->synchronized_output, false);
+    BOOST_CHECK(!cache.load("vt100"));
+
+    std::filesystem::remove_all(directory);
+}
+
+/** Encodes bit by bit, independently of both encoders */
+static std::string reference_base64(std::string_view text) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string bits, encoded;
+
+    for (unsigned char byte: text) {
+        for (int i = 7; i >= 0; i--) {
+            bits.push_back(byte >> i & 1 ? '1' : '0');
+        }
+    }
+
+    for (size_t i = 0; i < bits.size(); i += 6) {
+        auto group = bits.substr(i, 6);
+        group.resize(6, '0');
+        encoded.push_back(alphabet[std::stoi(group, nullptr, 2)]);
+    }
+
+    encoded.resize(Base64::encoded_size(text.size()), '=');
+    return encoded;
+}
+
+BOOST_AUTO_TEST_CASE(Base64IsEncoded) {
+
+    // RFC 4648, section 10
+    for (auto [text, expected]: {std::pair{""s, ""s}, {"f"s, "Zg=="s}, {"fo"s, "Zm8="s}, {"foo"s, "Zm9v"s},
+                                 {"foob"s, "Zm9vYg=="s}, {"fooba"s, "Zm9vYmE="s}, {"foobar"s, "Zm9vYmFy"s}}) {
+        std::string encoded(Base64::encoded_size(text.size()), '\0');
+        Base64::encode(text, encoded.data());
+        BOOST_CHECK_EQUAL(encoded, expected);
+    }
+
+    // around the 12 byte blocks and with tails of 0, 1 and 2 bytes
+    std::string text;
+
+    for (size_t size = 0; size < 100; size++) {
+        const auto expected = reference_base64(text);
+        std::string scalar(Base64::encoded_size(size), '\0'), vector(Base64::encoded_size(size), '\0');
+
+        Base64::encode_scalar(text, scalar.data());
+        Base64::encode(text, vector.data());
+
+        BOOST_CHECK_EQUAL(scalar, expected);
+        BOOST_CHECK_EQUAL(vector, expected);
+        text.push_back(static_cast<char>(size * 37 + 11));
+    }
+
+    // every 6 bit value in order, the alphabet itself comes out
+    std::string all;
+
+    for (unsigned n = 0; n < 64; n += 4) {
+        all.push_back(static_cast<char>(n << 2 | (n + 1) >> 4));
+        all.push_back(static_cast<char>((n + 1) << 4 | (n + 2) >> 2));
+        all.push_back(static_cast<char>((n + 2) << 6 | (n + 3)));
+    }
+
+    std::string alphabet(64, '\0');
+    Base64::encode(all, alphabet.data());
+    BOOST_CHECK_EQUAL(alphabet, "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/"s);
+
+    std::string encoded(8, '\0');
+    Base64::encode("hello", encoded.data());
+    BOOST_CHECK_EQUAL(encoded, "aGVsbG8="s);
+}
+
+BOOST_AUTO_TEST_CASE(ClipboardIsSetInChunks) {
+
+    std::stringstream output;
+    Terminal terminal{};
+    terminal.set_output_stream(output);
+    terminal.set_clipboard_limit(1 << 20);
+
+    // "aaa" is "YWFh", the last byte is left over
+    const std::string text(100000, 'a');
+    std::string encoded;
+
+    for (size_t i = 0; i < text.size() / 3; i++) {
+        encoded += "YWFh";
+    }
+
+    encoded += "YQ==";
+
+    BOOST_CHECK(terminal.copy_to_clipboard(text));
+    BOOST_CHECK_EQUAL(output.str(), "\x1b]52;c;" + encoded + "\x1b\\");
+
+    terminal.set_clipboard_limit(1000);
+    output.str({});
+
+    BOOST_CHECK(!terminal.copy_to_clipboard(text));
+    BOOST_CHECK(output.str().empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()